@@ -4,11 +4,42 @@
 //All times are in seconds.
 #include <iostream>
 #include <vector>
+#include <deque>
+#include <map>
 #include <fstream>
 #include <sstream>
 #include <algorithm>
+#include <charconv>
+#include <chrono>
+#include <cstring>
+#include <cstdio>
+#include <cstdlib>
+#include <cstdint>
+#include <ctime>
+#include <memory>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <new>
+#include <limits>
+#include <type_traits>
+#include <random>
 #include <math.h>
 
+#if defined(__unix__) || defined(__APPLE__)
+#define PSD_POSIX_IO
+#include <cerrno>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <csignal>
+#include <unistd.h>
+#endif
+
 #define M_PI 3.14159265358979323846
 //The dimensions of the active component of the detector
 #define EJ426DETX 50 //centimetres
@@ -22,17 +53,44 @@
 
 using namespace std;
 
+//Held while appending to the summary files in "Derived Quantities/" that every run adds a line to, so that runs
+//processed at the same time never interleave their lines.
+mutex summaryFileMutex;
+
+#ifdef PSD_COUNT_ALLOCATIONS
+//Every heap allocation made by the program is counted, so --check-allocations can show that the waveform pipeline
+//makes none once it is running. Only built in with -DPSD_COUNT_ALLOCATIONS.
+atomic<long long> heapAllocations(0);
+
+void *operator new(size_t size){
+    heapAllocations.fetch_add(1, memory_order_relaxed);
+    void *memory = malloc((size > 0) ? size : 1);
+    if (memory == NULL){
+        throw bad_alloc();
+    }
+    return memory;
+}
+
+void operator delete(void *memory) noexcept{
+    free(memory);
+}
+
+void operator delete(void *memory, size_t size) noexcept{
+    free(memory);
+}
+#endif
+
 //------------------------------------------------Some utilities first--------------------------------------------------
 //----------------------------------------------------------------------------------------------------------------------
 
-//Method to return the value in a vector<double> furthest from 0.
-double maxModVal(vector<double> input){
-    if (input.size() == 0){
+//Method to return the value of the n heights starting at input furthest from 0.
+double maxModVal(const double *input, int n){
+    if (n == 0){
         cout<< "No elements" << endl;
         return 0;
     }
     double output = input[0];
-    for (int i=0; i<input.size();++i){
+    for (int i=0; i<n;++i){
         if (abs(input[i])>abs(output)){
             output = input[i];
         }
@@ -40,14 +98,19 @@ double maxModVal(vector<double> input){
     return output;
 }
 
-//Method to return the modulus of the value in a vector<double> furthest from 0.
-double modMaxModVal(vector<double> input){
-    if (input.size() == 0){
+//Method to return the value in a vector<double> furthest from 0.
+double maxModVal(const vector<double> &input){
+    return maxModVal(input.data(), input.size());
+}
+
+//Method to return the modulus of the value of the n heights starting at input furthest from 0.
+double modMaxModVal(const double *input, int n){
+    if (n == 0){
         cout<< "No elements" << endl;
         return 0;
     }
     double output = input[0];
-    for (int i=0; i<input.size();++i){
+    for (int i=0; i<n;++i){
         if (abs(input[i])>abs(output)){
             output = abs(input[i]);
         }
@@ -55,1252 +118,6520 @@ double modMaxModVal(vector<double> input){
     return output;
 }
 
-//Method to count the number of waves in a file.
-void numWaves(string inFileName, int wSize){
-    int counter, time, numWaves;
-    fstream f_in;
-    vector<double> wave;
-    double height;
-    f_in.open(inFileName.c_str(),std::fstream::in);
-    if(!f_in){
-        cout<< " not found in numWaves with filename: " + inFileName << endl;
+//Method to return the modulus of the value in a vector<double> furthest from 0.
+double modMaxModVal(const vector<double> &input){
+    return modMaxModVal(input.data(), input.size());
+}
+
+//-----------------------------------------------------Sample Types-----------------------------------------------------
+//The digitiser records whole ADC counts, so the heights can be held as 16 or 32 bit integers or as floats rather than
+//as doubles, fitting 2 to 4 times as many samples into each cache line and SIMD register. Integer heights are summed
+//exactly in 64 bit integers, and for every type but double the baseline adjusted heights are held as floats.
+//----------------------------------------------------------------------------------------------------------------------
+
+#define PSD_SAMPLES_AUTO -1 //The type the file stores: int16 or float for .psdw files, double for text.
+#define PSD_SAMPLES_DOUBLE 0
+#define PSD_SAMPLES_FLOAT 1
+#define PSD_SAMPLES_INT32 2
+#define PSD_SAMPLES_INT16 3
+
+template <typename Sample> struct SampleTraits;
+template <> struct SampleTraits<double>{
+    typedef double Real; //Type of the baseline adjusted heights.
+    typedef double Sum; //Type the heights are summed in.
+    static const int type = PSD_SAMPLES_DOUBLE;
+};
+template <> struct SampleTraits<float>{
+    typedef float Real;
+    typedef double Sum;
+    static const int type = PSD_SAMPLES_FLOAT;
+};
+template <> struct SampleTraits<int32_t>{
+    typedef float Real;
+    typedef int64_t Sum;
+    static const int type = PSD_SAMPLES_INT32;
+};
+template <> struct SampleTraits<int16_t>{
+    typedef float Real;
+    typedef int64_t Sum;
+    static const int type = PSD_SAMPLES_INT16;
+};
+
+//Method to convert a height to a Sample, rounding to the nearest count and clamping to the range of integer types.
+template <typename Sample>
+inline Sample toSample(double height){
+    if (numeric_limits<Sample>::is_integer){
+        height = min(max(round(height), (double)numeric_limits<Sample>::min()), (double)numeric_limits<Sample>::max());
     }
-    numWaves = 0;
-    counter = 0;
-    //Start reading in values.
-    f_in >> time >> height;
-    while(f_in){
-        if(counter<wSize){
-            wave.push_back(height); // Same wave
-            counter++;
-        }
-        else {
-            numWaves++;
-            wave.clear();
-            counter = 0;
+    return (Sample)height;
+}
+
+//Method to find the PSD_SAMPLES_ value for a name given on the command line, or -2 if there is none.
+int sampleTypeFromName(string name){
+    string names[] = {"auto", "double", "float", "int32", "int16"};
+    for (int i=0; i<5; ++i){
+        if (name == names[i]){
+            return i - 1;
         }
-        f_in >> time >> height;
     }
-    f_in.close();
-    cout<<"The number of waves in "<<inFileName<<" is: "<<numWaves<<endl;
+    return -2;
 }
 
-//Method to print the figure of merit and its error from input peak separation
-//and peak widths with errors.
-void FoM(double X, double dX, double W_a, double dW_a, double W_b, double dW_b){
-    double figure = X/(W_a+W_b);
-    double dFoM = sqrt(dX*dX/((W_a+W_b)*(W_a+W_b))
-                        +(X*dW_a/((W_a+W_b)*(W_a+W_b)))*(X*dW_a/((W_a+W_b)*(W_a+W_b)))
-                          + (X*dW_b/((W_a+W_b)*(W_a+W_b)))*(X*dW_b/((W_a+W_b)*(W_a+W_b))));
-    cout << "The figure of merit for the inputs is: " << figure<< " with an error of: " << dFoM <<endl;
+string sampleTypeName(int sampleType){
+    string names[] = {"auto", "double", "float", "int32", "int16"};
+    return ((sampleType >= -1) && (sampleType <= PSD_SAMPLES_INT16)) ? names[sampleType + 1] : "unknown";
+}
+
+//Method to give the bytes held per sample, raw plus baseline adjusted, for a sample type. Auto counts as double.
+int sampleTypeBytes(int sampleType){
+    if (sampleType == PSD_SAMPLES_FLOAT){
+        return sizeof(float) + sizeof(float);
+    }else if (sampleType == PSD_SAMPLES_INT32){
+        return sizeof(int32_t) + sizeof(float);
+    }else if (sampleType == PSD_SAMPLES_INT16){
+        return sizeof(int16_t) + sizeof(float);
+    }
+    return sizeof(double) + sizeof(double);
 }
 
+//--------------------------------------------------Reading Waveforms---------------------------------------------------
+//The raw files (.txt, .dat, .csv) are lists of "index height" pairs, one sample per line. Reading them with
+//fstream >> time >> height goes through the locale machinery for every one of the ~10^8 samples in a run, so they are
+//read here from a mapped or buffered block of the file and the numbers decoded directly with from_chars.
+//----------------------------------------------------------------------------------------------------------------------
 
-//Method to print the first 10 waveforms in a file to a txt file.
-void firstTen(string inFileName, string outFileName, int wSize){
-    //Clear output file and set up variables.
-    ofstream f_outClear;
-    f_outClear.open(outFileName, std::ofstream::out | std::ofstream::trunc);
-    f_outClear.close();
-    int counter, numWaves, time;
-    double height;
-    counter = numWaves = 0;
-    fstream f_in;
-    vector<double> wave1;
-    f_in.open(inFileName.c_str(),std::fstream::in);
-    ofstream f_out(outFileName, ios::out | ios::app);
-    if(!f_in){
-        cout<< " not found in firstTen with filename: " + inFileName<< endl;
+#ifdef PSD_POSIX_IO
+//Method to wait on the loopback interface at port for a single connection, e.g. from a digitiser or --generate-live,
+//and return its descriptor, or -1 on failure.
+int acceptLocalConnection(int port){
+    int listener = socket(AF_INET, SOCK_STREAM, 0);
+    if (listener < 0){
+        return -1;
     }
-    //Start reading in values.
-    f_in >>time>> height;
-    while(f_in){
-        if(counter<wSize){
-            wave1.push_back(height); // Same wave
-            counter++;
+    int reuse = 1;
+    setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+    sockaddr_in address;
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_port = htons(port);
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    int connection = -1;
+    if ((bind(listener, (sockaddr*)&address, sizeof(address)) == 0) && (listen(listener, 1) == 0)){
+        cout << "Waiting for a connection on port " << port << endl;
+        connection = accept(listener, NULL, NULL);
+    }
+    ::close(listener);
+    return connection;
+}
+
+//Method to connect to port on the loopback interface, returning the descriptor or -1 on failure.
+int connectLocal(int port){
+    int connection = socket(AF_INET, SOCK_STREAM, 0);
+    if (connection < 0){
+        return -1;
+    }
+    sockaddr_in address;
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_port = htons(port);
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (connect(connection, (sockaddr*)&address, sizeof(address)) != 0){
+        ::close(connection);
+        return -1;
+    }
+    return connection;
+}
+#endif
+
+//Source of the raw bytes of an input file. Regular files are memory mapped where the platform allows it, so the parsers
+//walk the page cache directly with no read calls or copies, and several runs reading the same file share its pages.
+//Pipes, FIFOs, and anything that cannot be mapped are read through a buffer instead. "-" reads standard input and
+//"tcp:PORT" waits for one connection on that local port, for waveforms streamed from a running acquisition.
+class InputSource{
+public:
+    InputSource(string inFileName, size_t bufferSize = 1<<22)
+            : mapped(false), bytes(NULL), length(0), fileOffset(0), eof(false){
+#ifdef PSD_POSIX_IO
+        if (inFileName == "-"){
+            fd = dup(STDIN_FILENO);
+        }else if (inFileName.compare(0, 4, "tcp:") == 0){
+            fd = acceptLocalConnection(atoi(inFileName.c_str() + 4));
+        }else{
+            fd = open(inFileName.c_str(), O_RDONLY);
         }
-        else {
-            numWaves++;
-            //Save values
-            if (numWaves<10) {
-                if (f_out.is_open()) {
-                    for (int i = 0; i < wave1.size(); ++i) {
-                        f_out <<i <<" "<< wave1[i]<<endl;
-                    }
-                } else {
-                    cout << "Unable to open file " << endl;
-                }
-            }else{
-                break;
+        if (fd < 0){
+            return;
+        }
+        struct stat info;
+        if ((fstat(fd, &info) == 0) && S_ISREG(info.st_mode) && (info.st_size > 0)){
+            void *map = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (map != MAP_FAILED){
+                madvise(map, info.st_size, MADV_SEQUENTIAL);
+#ifdef MADV_HUGEPAGE
+                madvise(map, info.st_size, MADV_HUGEPAGE);
+#endif
+                mapped = true;
+                bytes = (const char*)map;
+                length = info.st_size;
+                eof = true;
+                return;
             }
-            wave1.clear();
-            counter = 0;
         }
-        f_in>>time>>height;
+#else
+        file = (inFileName == "-") ? stdin : fopen(inFileName.c_str(), "rb");
+        if (file == NULL){
+            return;
+        }
+#endif
+        buffer.resize(bufferSize);
+        bytes = buffer.data();
+    }
+    ~InputSource(){
+        close();
+    }
+    //The file descriptor and mapping are released by the destructor, so an InputSource cannot be copied.
+    InputSource(const InputSource&) = delete;
+    InputSource &operator=(const InputSource&) = delete;
+    bool is_open() const{
+        return mapped || !buffer.empty();
+    }
+    void close(){
+#ifdef PSD_POSIX_IO
+        if (mapped){
+            munmap((void*)bytes, length);
+        }
+        if (fd >= 0){
+            ::close(fd);
+            fd = -1;
+        }
+#else
+        if (file != NULL){
+            fclose(file);
+            file = NULL;
+        }
+#endif
+        mapped = false;
+        buffer.clear();
+        bytes = NULL;
+        length = 0;
+        eof = true;
+    }
+    //The bytes currently available, data()[0, size()).
+    const char *data() const{
+        return bytes;
+    }
+    size_t size() const{
+        return length;
+    }
+    //Byte offset in the file of data()[0].
+    long long offset() const{
+        return fileOffset;
+    }
+    //True once the whole file is available in data(), which is always the case when it is mapped.
+    bool atEnd() const{
+        return eof;
+    }
+    //Method to drop the first consumed bytes and read more of the file after the rest.
+    void refill(size_t consumed){
+        if (eof){
+            return;
+        }
+        size_t remaining = length - consumed;
+        memmove(buffer.data(), buffer.data() + consumed, remaining);
+        fileOffset += consumed;
+        length = remaining;
+#ifdef PSD_POSIX_IO
+        ssize_t numRead = read(fd, buffer.data() + length, buffer.size() - length);
+        while ((numRead < 0) && (errno == EINTR)){
+            numRead = read(fd, buffer.data() + length, buffer.size() - length);
+        }
+#else
+        long long numRead = fread(buffer.data() + length, 1, buffer.size() - length, file);
+#endif
+        if (numRead <= 0){
+            eof = true;
+        } else {
+            length += numRead;
+        }
     }
-    f_in.close();
-    f_out.close();
-    cout<<"                       firstTen Completed                    "<<endl;
 
-}
+private:
+    bool mapped;
+#ifdef PSD_POSIX_IO
+    int fd;
+#else
+    FILE *file;
+#endif
+    vector<char> buffer;
+    const char *bytes;
+    size_t length;
+    long long fileOffset;
+    bool eof;
+};
 
-//Method to adjust the values in a file by their baseline to zero. The first baseLEnd values are
-//averaged and then subtracted from the whole wave.
-void baselineAdjust(string inFileName, string outFileName, int wSize, int baseLEnd){
-    //Clear output file and set up variables.
-    ofstream f_outClear;
-    f_outClear.open(outFileName, std::ofstream::out | std::ofstream::trunc);
-    f_outClear.close();
-    int counter, time;
-    double height, basel;
-    counter = basel = 0;
-    fstream f_in;
-    vector<double> wave;
-    f_in.open(inFileName.c_str(),std::fstream::in);
-    ofstream f_out(outFileName, ios::out | ios::app);
-    if(!f_in){
-        cout<< " not found in baselineAdjust with filename: " + inFileName<< endl;
+class SampleParser{
+public:
+    //columns is 2 for the usual "index height" files and 1 for files holding only the heights.
+    SampleParser(string inFileName, int columns = 2)
+            : fileName(inFileName), columns(columns), source(inFileName), pos(0), error(false){}
+    bool is_open() const{
+        return source.is_open();
     }
-    //Start reading in values.
-    f_in >> time>> height;
-    while(f_in){
-        if(counter<wSize){
-            wave.push_back(height); // Same wave
-            counter++;
+    void close(){
+        source.close();
+        pos = 0;
+    }
+    //True if reading stopped because of a malformed value rather than the end of the file.
+    bool failed() const{
+        return error;
+    }
+    //Byte offset in the file of the next character to be read.
+    long long bytePosition() const{
+        return source.offset() + pos;
+    }
+
+    //Method to read the next height, skipping the index column. Returns false at the end of the file or on an error.
+    bool nextSample(double &height){
+        if (error || !skipSeparators()){
+            return false;
         }
-        else {
-            //calculate baseline.
-            basel = 0;
-            for (int i = 0; i < baseLEnd; ++i) {
-                basel += wave[i]/baseLEnd;
+        const char *data = source.data();
+        size_t end = source.size();
+        if (columns == 2){
+            //The index is never used, so it is skipped rather than decoded.
+            size_t start = pos;
+            while (pos < end && !isSeparator(data[pos])){
+                pos++;
             }
-            //Subtract baseline
-            for (int i = 0; i < wave.size(); ++i) {
-                wave[i] -= basel;
+            if (!skipSeparators()){
+                reportError("missing height after index", start);
+                return false;
             }
-            //Save values
-            if (f_out.is_open()) {
-                for (int i = 0; i < wave.size(); ++i) {
-                    f_out << i << " "<<wave[i] << endl;
-                }
-            } else {
-                cout << "Unable to open file " << endl;
+            data = source.data();
+            end = source.size();
+        }
+        size_t start = pos;
+        if (data[pos] == '+'){
+            pos++;
+        }
+        from_chars_result result = from_chars(data + pos, data + end, height);
+        if (result.ec != errc()){
+            reportError("could not read height", start);
+            return false;
+        }
+        pos = result.ptr - data;
+        return true;
+    }
+
+    //Method to read the next waveform of wSize samples into wave. As in the original stream readers, the waveform is
+    //only complete once the sample after its last one has been read, and that sample is skipped.
+    template <typename Sample>
+    bool nextWave(vector<Sample> &wave, int wSize){
+        double height;
+        wave.resize(wSize);
+        for (int i=0; i<wSize; ++i){
+            if (!nextSample(height)){
+                return false;
             }
-            wave.clear();
-            counter = 0;
+            wave[i] = toSample<Sample>(height);
         }
-        f_in>>time>>height;
+        return nextSample(height);
     }
-    f_in.close();
-    f_out.close();
-    cout<<"                       baselineAdjust Completed                    "<<endl;
 
-}
+private:
+    //Enough bytes to hold any single line, so a number is never split across a refill.
+    static const size_t lookahead = 256;
 
-//-----------------------------------------------------PSA METHODS------------------------------------------------------
-//Forms the majority of the code, several methods are attempted here, the most notable of which being thewidths method
-//which shows promising results in discriminating the heavy particle signature (neutrons) from the other signals
-// (thought to be gammas mostly)
-//----------------------------------------------------------------------------------------------------------------------
+    static bool isSeparator(char c){
+        return c == ' ' || c == '\n' || c == '\r' || c == '\t' || c == ',';
+    }
 
-//--------------------------------------------------Tail vs Peak Integral-----------------------------------------------
+    //Method to move to the start of the next number, refilling the buffer as needed. Returns false at the end of the file.
+    //A number followed by the end of its line is complete, so a stream is only read further once the buffered lines
+    //run out and a waveform is analysed as soon as its last line arrives.
+    bool skipSeparators(){
+        while (true){
+            const char *data = source.data();
+            size_t end = source.size();
+            while (pos < end && isSeparator(data[pos])){
+                pos++;
+            }
+            if (pos < end && (end - pos >= lookahead || source.atEnd() || memchr(data + pos, '\n', end - pos) != NULL)){
+                return true;
+            }
+            if (pos == end && source.atEnd()){
+                return false;
+            }
+            source.refill(pos);
+            pos = 0;
+        }
+    }
+
+    void reportError(string message, size_t start){
+        error = true;
+        cout << "Parse error in " << fileName << " at byte " << source.offset() + start << ": " << message << endl;
+    }
+
+    string fileName;
+    int columns;
+    InputSource source;
+    size_t pos; //Position in source.data() of the next unread byte.
+    bool error;
+};
+
+//-----------------------------------------------Binary Waveform Files--------------------------------------------------
+//The text dumps spend ~13 bytes and a number conversion on every sample, and the index column is never used. A .psdw
+//file holds the same waveforms as raw int16 or float32 heights behind a small header describing the run, and every
+//method reading waveforms accepts either kind of file.
 //----------------------------------------------------------------------------------------------------------------------
 
+#define PSDW_MAGIC "PSDWAVE1"
+#define PSDW_INT16 0
+#define PSDW_FLOAT32 1
 
-//Giant method to do all of the peak/tail PSA all at once.
-//PEAK IS FIRST COLUMN, TAIL IS SECOND IN OUTPUT FILE
-void peakTailIntegrate(string inFileName, string outFileName, int wSize, int baseLEnd, int peakXValue, int tailEndXVal){
-    //Clear output file and set up variables.
-    ofstream f_outClear;
-    f_outClear.open(outFileName, std::ofstream::out | std::ofstream::trunc);
-    f_outClear.close();
-    int  pulserNo, counter,peakXVal;
-    double height;
-    pulserNo = counter = 0;
-    fstream f_in;
-    vector<double> wave;
-    double peak,tail,basel, maxVal,time;
-    f_in.open(inFileName.c_str(),std::fstream::in);
-    ofstream f_out(outFileName, ios::out | ios::app);
-    if(!f_in){
-        cout<< " not found in peakTailIntegrate with filename: " + inFileName<< endl;
+//Header at the start of a .psdw file, followed by numWaves blocks of wSize samples each.
+struct WaveFileHeader{
+    char magic[8]; //PSDW_MAGIC.
+    int32_t version; //Format version, currently 1.
+    int32_t dtype; //PSDW_INT16 or PSDW_FLOAT32.
+    int32_t wSize; //Number of samples in each waveform.
+    int32_t reserved;
+    double runTime; //Duration of the run in seconds.
+    int64_t numWaves; //Number of waveforms, or 0 if the writer could not go back and fill it in.
+    char location[32]; //Location of the run, as in File Details.txt.
+};
+static_assert(sizeof(WaveFileHeader) == 72, "WaveFileHeader must have no padding");
+
+//Method to check whether a file starts with the .psdw header. Streams are always text, since peeking at them would
+//consume their first bytes.
+bool isBinaryWaveFile(string inFileName){
+#ifdef PSD_POSIX_IO
+    struct stat info;
+    if ((stat(inFileName.c_str(), &info) != 0) || !S_ISREG(info.st_mode)){
+        return false;
     }
-    //Start reading in values.
-    f_in >> time>>height;
-    while(f_in){
-        if(counter<wSize){
-            wave.push_back(height); // Same wave
-            counter++;
-        }
-        else {
-            //remove pulsers.
-            peak = tail = basel = 0;
-            for (int i=0;i<baseLEnd;++i){
-                basel += wave[i]/baseLEnd;
-            }
-            for (int i=0;i<wSize;++i){
-                wave[i] -= basel;
+#endif
+    char magic[8];
+    FILE *file = fopen(inFileName.c_str(), "rb");
+    if (file == NULL){
+        return false;
+    }
+    bool binary = (fread(magic, 1, 8, file) == 8) && (memcmp(magic, PSDW_MAGIC, 8) == 0);
+    fclose(file);
+    return binary;
+}
+
+//Reads the waveforms out of a .psdw file, converting the stored samples to the type asked for.
+class BinaryWaveReader{
+public:
+    BinaryWaveReader(string inFileName) : fileName(inFileName), source(inFileName), pos(0), error(false){
+        memset(&header, 0, sizeof(header));
+        if (!source.is_open()){
+            return;
+        }
+        if (!available(sizeof(header))){
+            reportError("file too short for header");
+            return;
+        }
+        memcpy(&header, source.data(), sizeof(header));
+        pos = sizeof(header);
+        if ((memcmp(header.magic, PSDW_MAGIC, 8) != 0) || (header.version != 1)){
+            reportError("not a version 1 .psdw file");
+        }else if ((header.dtype != PSDW_INT16) && (header.dtype != PSDW_FLOAT32)){
+            reportError("unknown sample type");
+        }
+    }
+    bool is_open() const{
+        return source.is_open();
+    }
+    void close(){
+        source.close();
+    }
+    bool failed() const{
+        return error;
+    }
+    const WaveFileHeader &fileHeader() const{
+        return header;
+    }
+    //Byte offset in the file of the next byte to be read.
+    long long bytePosition() const{
+        return source.offset() + pos;
+    }
+
+    //Method to read the next waveform into wave. The file must have been written with the same wSize.
+    template <typename Sample>
+    bool nextWave(vector<Sample> &wave, int wSize){
+        if (error){
+            return false;
+        }
+        if (wSize != header.wSize){
+            cout << fileName << " holds waveforms of " << header.wSize << " samples, not " << wSize << endl;
+            error = true;
+            return false;
+        }
+        size_t sampleBytes = (header.dtype == PSDW_INT16) ? sizeof(int16_t) : sizeof(float);
+        size_t waveBytes = sampleBytes*wSize;
+        if (!available(waveBytes)){
+            if (source.size() > pos){
+                reportError("last waveform is incomplete");
             }
-            maxVal = maxModVal(wave);
-            //Integrate.
-            for (int i = 0; i < wave.size(); ++i) {
-                if (i < peakXValue){
-                    peak += wave[i];
-                }
-                else if ((i > peakXValue) && (i < tailEndXVal)){
-                    tail += wave[i];
+            return false;
+        }
+        const char *data = source.data() + pos;
+        wave.resize(wSize);
+        if (header.dtype == PSDW_INT16){
+            copySamples<int16_t>(data, wave.data(), wSize);
+        }else{
+            copySamples<float>(data, wave.data(), wSize);
+        }
+        pos += waveBytes;
+        return true;
+    }
+
+    //The PSD_SAMPLES_ type the file stores its heights as.
+    int storedSampleType() const{
+        return (header.dtype == PSDW_INT16) ? PSD_SAMPLES_INT16 : PSD_SAMPLES_FLOAT;
+    }
+
+private:
+    //Method to convert n stored samples into the wave, copying them straight across when the types match.
+    template <typename Stored, typename Sample>
+    static void copySamples(const char *data, Sample *wave, int n){
+        if (is_same<Stored, Sample>::value){
+            memcpy(wave, data, n*sizeof(Sample));
+            return;
+        }
+        Stored sample;
+        for (int i=0; i<n; ++i){
+            memcpy(&sample, data + i*sizeof(Stored), sizeof(Stored));
+            wave[i] = toSample<Sample>(sample);
+        }
+    }
+
+    //Method to make sure the next numBytes are in the source, reading more of the file if needed.
+    bool available(size_t numBytes){
+        while ((source.size() - pos < numBytes) && !source.atEnd()){
+            source.refill(pos);
+            pos = 0;
+        }
+        return source.size() - pos >= numBytes;
+    }
+
+    void reportError(string message){
+        error = true;
+        cout << "Error in " << fileName << " at byte " << source.offset() + pos << ": " << message << endl;
+    }
+
+    string fileName;
+    InputSource source;
+    WaveFileHeader header;
+    size_t pos; //Position in source.data() of the next unread byte.
+    bool error;
+};
+
+//Writes waveforms to a .psdw file.
+class BinaryWaveWriter{
+public:
+    BinaryWaveWriter(string outFileName, int wSize, int dtype, string location, double runTime)
+            : fileName(outFileName), numWaves(0), numLossy(0){
+        memset(&header, 0, sizeof(header));
+        memcpy(header.magic, PSDW_MAGIC, 8);
+        header.version = 1;
+        header.dtype = dtype;
+        header.wSize = wSize;
+        header.runTime = runTime;
+        strncpy(header.location, location.c_str(), sizeof(header.location) - 1);
+        file = fopen(outFileName.c_str(), "wb");
+        if (file == NULL){
+            cout << "Unable to open file: " + outFileName << endl;
+            return;
+        }
+        fwrite(&header, sizeof(header), 1, file);
+    }
+    ~BinaryWaveWriter(){
+        close();
+    }
+    //The file is closed and its header rewritten by the destructor, so a BinaryWaveWriter cannot be copied.
+    BinaryWaveWriter(const BinaryWaveWriter&) = delete;
+    BinaryWaveWriter &operator=(const BinaryWaveWriter&) = delete;
+    bool is_open() const{
+        return file != NULL;
+    }
+    //Method to append a waveform. int16 files round each height to the nearest count, and any height that was not
+    //already a whole number in range is counted and reported on close.
+    void writeWave(const vector<double> &wave){
+        writeWave(wave.data(), wave.size());
+    }
+    //Method to do the same for the n heights from wave, held as double or float.
+    template <typename Real>
+    void writeWave(const Real *wave, int n){
+        if (file == NULL){
+            return;
+        }
+        if (header.dtype == PSDW_INT16){
+            block16.resize(n);
+            for (int i=0; i<n; ++i){
+                double clamped = min(max((double)wave[i], -32768.0), 32767.0);
+                block16[i] = (int16_t)lround(clamped);
+                if (block16[i] != wave[i]){
+                    numLossy++;
                 }
             }
-            //Save values
-            if (f_out.is_open()) {
-                f_out << peak << " " << tail << endl;
-            } else {
-                cout << "Unable to open file " << endl;
+            fwrite(block16.data(), sizeof(int16_t), block16.size(), file);
+        }else if (is_same<Real, float>::value){
+            fwrite(wave, sizeof(float), n, file);
+        }else{
+            block32.resize(n);
+            for (int i=0; i<n; ++i){
+                block32[i] = (float)wave[i];
             }
-            wave.clear();
-            counter = 0;
+            fwrite(block32.data(), sizeof(float), block32.size(), file);
+        }
+        numWaves++;
+    }
+    //Method to fill in the number of waveforms and close the file. Writing to a pipe leaves numWaves as 0.
+    void close(){
+        if (file == NULL){
+            return;
+        }
+        header.numWaves = numWaves;
+        if (fseek(file, 0, SEEK_SET) == 0){
+            fwrite(&header, sizeof(header), 1, file);
+        }
+        fclose(file);
+        file = NULL;
+        if (numLossy > 0){
+            cout << numLossy << " samples written to " << fileName << " were not whole numbers between -32768 and 32767 "
+            << "and have been rounded, use float32 to keep them exactly." << endl;
         }
-        f_in>>time>>height;
     }
-    f_in.close();
-    f_out.close();
-    cout<<"                       peakTailIntegrate Completed                    "<<endl;
 
-}
+private:
+    string fileName;
+    FILE *file;
+    WaveFileHeader header;
+    long long numWaves, numLossy;
+    vector<int16_t> block16;
+    vector<float> block32;
+};
 
-//-------------------------------------------Risetime vs Peak Height----------------------------------------------------
-//----------------------------------------------------------------------------------------------------------------------
+//Reads waveforms from either a text dump or a .psdw file, whichever inFileName turns out to be.
+class WaveReader{
+public:
+    //columns is passed on to the SampleParser for text files.
+    WaveReader(string inFileName, int columns = 2){
+        if (isBinaryWaveFile(inFileName)){
+            binary.reset(new BinaryWaveReader(inFileName));
+        }else{
+            text.reset(new SampleParser(inFileName, columns));
+        }
+    }
+    bool is_open() const{
+        return binary ? binary->is_open() : text->is_open();
+    }
+    void close(){
+        if (binary){
+            binary->close();
+        }else{
+            text->close();
+        }
+    }
+    bool failed() const{
+        return binary ? binary->failed() : text->failed();
+    }
+    template <typename Sample>
+    bool nextWave(vector<Sample> &wave, int wSize){
+        return binary ? binary->nextWave(wave, wSize) : text->nextWave(wave, wSize);
+    }
+    //The PSD_SAMPLES_ type the file stores its heights as, double for text files.
+    int storedSampleType() const{
+        return binary ? binary->storedSampleType() : PSD_SAMPLES_DOUBLE;
+    }
+    //Bytes of the file read so far.
+    long long bytePosition() const{
+        return binary ? binary->bytePosition() : text->bytePosition();
+    }
 
+private:
+    unique_ptr<SampleParser> text;
+    unique_ptr<BinaryWaveReader> binary;
+};
 
-//Method to calculate integral rise time vs amplitude for an input file
-//PEAK VALUE IS FIRST COLUMN, INTEGRAL RISETIME IS SECOND COLUMN).
-void IntegralRisetimeVsAmplitude(string inFileName, string outFileName, double lowThresh, double highThresh, int wSize, int baseLEnd){
-    //Clear output file and set up variables.
-    ofstream f_outClear;
-    f_outClear.open(outFileName, std::ofstream::out | std::ofstream::trunc);
-    f_outClear.close();
-    int counter, lowTime, highTime, risetime;
-    fstream f_in;
-    vector<double> wave;
-    double basel, totalIntegral, peak, accumulate, height;
-    f_in.open(inFileName.c_str(),std::fstream::in);
-    ofstream f_out(outFileName, ios::out | ios::app);
-    if(!f_in){
-        cout<< " not found in IntegralRisetimeVsAmplitude with filename: " + inFileName<< endl;
+//Reads the waveforms of a raw file with their baseline, the average of their first baseLEnd heights, subtracted as they
+//are read, so that the baseline adjusted analyses need no "Baseline Adjusted" copy of the run written out and read back.
+//The heights are adjusted in place as they are read, with no copy. With baseLEnd 0 they are passed on unchanged, for
+//files that are already baseline adjusted.
+class BaselineAdjustedReader{
+public:
+    BaselineAdjustedReader(string inFileName, int baseLEnd) : f_in(inFileName), baseLEnd(baseLEnd), basel(0){}
+    bool is_open() const{
+        return f_in.is_open();
     }
-    counter = 0;
-    //Start reading in values.
-    f_in >> height;
-    while(f_in){
-        if(counter<wSize){
-            wave.push_back(height); // Same wave
-            counter++;
-        }
-        else {
-            //Calculate baseline.
-            basel = totalIntegral = accumulate = 0;
-            for (int i=0; i < baseLEnd; ++i) {
+    void close(){
+        f_in.close();
+    }
+    bool nextWave(vector<double> &wave, int wSize){
+        if (!f_in.nextWave(wave, wSize)){
+            return false;
+        }
+        basel = 0;
+        if (baseLEnd > 0){
+            for (int i = 0; i < baseLEnd; ++i) {
                 basel += wave[i]/baseLEnd;
             }
-            //Subtract baseline an integrate.
-            for (int i=0; i<wSize; i++){
+            for (int i = 0; i < wave.size(); ++i) {
                 wave[i] -= basel;
-                totalIntegral += wave[i];
-            }
-            peak = maxModVal(wave);
-            for (int i=0; i<wave.size();++i){
-                accumulate += wave[i];
-                if (accumulate > lowThresh*totalIntegral){
-                    lowTime = i;
-                    break;
-                }
-            }
-            accumulate = 0;
-            for (int i=0; i<wSize;++i){
-                accumulate += wave[i];
-                if (accumulate > highThresh*totalIntegral){
-                    highTime = i;
-                    break;
-                }
-            }
-            risetime = highTime - lowTime;
-            //Save values.
-            if (f_out.is_open()) {
-                f_out << peak << " " << risetime << endl;
-            } else {
-                cout << "Unable to open file " << endl;
             }
-            wave.clear();
-            counter = 0;
         }
-        f_in>>height;
+        return true;
+    }
+    //Baseline subtracted from the last waveform read.
+    double baseline() const{
+        return basel;
+    }
+private:
+    WaveReader f_in;
+    int baseLEnd;
+    double basel;
+};
+
+//Method to convert a text dump into a .psdw file, splitting the waveforms exactly as the text readers do. dtype is
+//"int16" for the raw ADC counts or "float32" for anything with fractional heights.
+void convertToBinary(string inFileName, string outFileName, int wSize, string dtype, string location, double runTime){
+    if ((dtype != "int16") && (dtype != "float32")){
+        cout << "Please enter a dtype of 'int16' or 'float32'." << endl;
+        return;
+    }
+    SampleParser f_in(inFileName);
+    if(!f_in.is_open()){
+        cout<< " not found in convertToBinary with filename: " + inFileName<< endl;
+        return;
+    }
+    BinaryWaveWriter f_out(outFileName, wSize, (dtype == "int16") ? PSDW_INT16 : PSDW_FLOAT32, location, runTime);
+    vector<double> wave;
+    int numWaves = 0;
+    while(f_in.nextWave(wave, wSize)){
+        f_out.writeWave(wave);
+        numWaves++;
     }
     f_in.close();
     f_out.close();
-    cout<<"                       IntegralRisetimeVsAmplitude Completed                    "<<endl;
-
+    cout<<"Converted "<<numWaves<<" waves from "<<inFileName<<" to "<<outFileName<<endl;
+    cout<<"                       convertToBinary Completed                    "<<endl;
 }
 
-//--------------------------------------------------------------Widths--------------------------------------------------
+//-------------------------------------------------Writing Output Files-------------------------------------------------
+//The output files used to be written with ofstream << endl, which flushes the stream on every line, so baselineAdjust
+//alone made one flush per sample. OutputFile keeps the same << interface but collects the lines in a large buffer,
+//formats the numbers with to_chars exactly as ostream does (6 significant figures), and only writes whole buffers.
+//The per waveform tables can instead be written as .psdc column files of raw doubles.
 //----------------------------------------------------------------------------------------------------------------------
 
-//Method to calculate the width of the pulse for a given fraction of its height, such as the full width half maximum
-//This one works for an input file that is a list of wave heights of size WSIZE
-void Widths(string inFileName, string outFileName, double threshold, int wSize, int baseLEnd){
-    //Clear output file and set up variables.
-    ofstream f_outClear;
-    f_outClear.open(outFileName, std::ofstream::out | std::ofstream::trunc);
-    f_outClear.close();
-    int counter, lowTime, highTime, width, time;
-    fstream f_in;
-    vector<double> wave;
-    double maxVal, height, basel;
-    f_in.open(inFileName.c_str(),std::fstream::in);
-    ofstream f_out(outFileName, ios::out | ios::app);
-    if(!f_in){
-        cout<< " not found in Widths with filename: " + inFileName<< endl;
+#define PSD_OUTPUT_TEXT 0
+#define PSD_OUTPUT_BINARY 1
+#define PSDC_MAGIC "PSDCOLS1"
+
+//Header at the start of a .psdc file, followed by numRows rows of numColumns doubles each.
+struct ColumnFileHeader{
+    char magic[8]; //PSDC_MAGIC.
+    int32_t version; //Format version, currently 1.
+    int32_t numColumns; //Numbers on each line of the equivalent text file.
+    int64_t numRows; //Lines of the equivalent text file.
+};
+static_assert(sizeof(ColumnFileHeader) == 24, "ColumnFileHeader must have no padding");
+
+//Method to give the name a table is written under in a format: the text file name, or the same with .psdc in place of
+//its extension.
+string outputFileName(string textFileName, int format){
+    if (format != PSD_OUTPUT_BINARY){
+        return textFileName;
     }
-    counter = 0;
-    //Start reading in values.
-    f_in >> time >> height;
-    while(f_in){
-        if(counter<wSize){
-            wave.push_back(height); // Same wave
-            counter++;
-        }
-        else {
-            basel = 0.0;
-            //Subtract the baseline (For LUNA results this looks like around 2244?).
-            for(int i=0;i<baseLEnd;i++){
-                basel+=wave[i];
-            }
-            basel = basel/baseLEnd;
-            for(int i=0;i<wave.size();++i){
-                wave[i]-=basel;
-            }
-            //Find maxVal for the wave.
-            maxVal = maxModVal(wave);
-            for (int i=0; i<wave.size();++i){
-                if (abs(wave[i]) > threshold*abs(maxVal)){
-                    lowTime = i;
-                    break;
-                }
-            }
-            //Find the width.
-            for (int i=wSize; i>0;--i){
-                if (abs(wave[i]) > threshold*abs(maxVal)){
-                    highTime = i;
-                    break;
-                }
-            }
-            width = highTime - lowTime;
-            //eliminate the noise cases with widths of 3999 or similar and output them.
-            if ((width < 0.8*wSize)&&(width>0.0)){
-                if (f_out.is_open()){
-                    f_out << width << endl;
-                } else {
-                    cout << "Unable to open file: " + outFileName<< endl;
-                }
-            }
-            wave.clear();
-            counter = 0;
-        }
-        f_in >> time >> height;
+    size_t dot = textFileName.find_last_of('.');
+    size_t slash = textFileName.find_last_of('/');
+    if ((dot == string::npos) || ((slash != string::npos) && (dot < slash))){
+        return textFileName + ".psdc";
     }
-    f_in.close();
-    f_out.close();
-    cout<<"                       Widths Completed                    "<<endl;
-
+    return textFileName.substr(0, dot) + ".psdc";
 }
 
-
-//Method to bin the data (in bin sizes of 1) from one of the output files from the Widths method.
-//This method normalises the data to
-void widthBinTimeNormalised(string inFileName, string outFileName, double time, double binSize, int wSize){
-    //Clear output file and set up variables.
-    ofstream f_outClear;
-    f_outClear.open(outFileName, std::ofstream::out | std::ofstream::trunc);
-    f_outClear.close();
-    double width;
-    fstream f_in;
-    vector<double> widthBinVals((int)(wSize/binSize));
-    f_in.open(inFileName.c_str(),std::fstream::in);
-    if(!f_in){
-        cout<< " not found in widthBinTimeNormalised with filename: " + inFileName<< endl;
+//Buffered output file written with << like an ofstream. endl ends the line without flushing, and the buffer is written
+//out when it fills and on close(). In PSD_OUTPUT_BINARY format the numbers on each line become a row of doubles in a
+//.psdc file, anything else written is left out, and every line must hold as many numbers as the first.
+class OutputFile{
+public:
+    OutputFile() : file(NULL), format(PSD_OUTPUT_TEXT), used(0), numColumns(0), rowColumns(0), numRows(0),
+                   error(false){}
+    OutputFile(string outFileName, int format = PSD_OUTPUT_TEXT, bool append = false) : OutputFile(){
+        open(outFileName, format, append);
     }
-    //read in values.
-    f_in >> width;
-    while(f_in){
-        int index = round(width/binSize);
-        widthBinVals[index]++;
-        f_in >> width;
+    //The file is closed by the destructor, so an OutputFile cannot be copied.
+    OutputFile(const OutputFile&) = delete;
+    OutputFile &operator=(const OutputFile&) = delete;
+    ~OutputFile(){
+        close();
     }
-    f_in.close();
-    ofstream f_out(outFileName, ios::out | ios::app);
-
-    for(int i=0;i<widthBinVals.size();++i){
-        widthBinVals[i]/=time;
-        if (f_out.is_open()) {
-            f_out << i * binSize << " " << widthBinVals[i] << endl;
-        }else{
-            cout <<"Unable to open file: " + outFileName <<endl;
+    //Method to open outFileName, emptying it unless append is set. Binary files are always started afresh.
+    void open(string outFileName, int outFormat = PSD_OUTPUT_TEXT, bool append = false){
+        close();
+        fileName = outFileName;
+        format = outFormat;
+        error = false;
+        numColumns = rowColumns = 0;
+        numRows = 0;
+        file = fopen(outFileName.c_str(), (append && (format == PSD_OUTPUT_TEXT)) ? "ab" : "wb");
+        if (file == NULL){
+            return;
+        }
+        buffer.resize(bufferSize);
+        used = 0;
+        if (format == PSD_OUTPUT_BINARY){
+            writeHeader();
         }
     }
-    f_out.close();
-    cout<<"                       widthBinTimeNormalised Completed                    "<<endl;
-
-}
+    bool is_open() const{
+        return file != NULL;
+    }
+    //Method to write out whatever is buffered.
+    void flush(){
+        if ((file != NULL) && (used > 0)){
+            if (fwrite(buffer.data(), 1, used, file) != used){
+                reportError("write failed");
+            }
+            used = 0;
+        }
+    }
+    void close(){
+        if (file == NULL){
+            return;
+        }
+        if ((format == PSD_OUTPUT_BINARY) && (rowColumns > 0)){
+            endLine();
+        }
+        flush();
+        if (format == PSD_OUTPUT_BINARY){
+            fseek(file, 0, SEEK_SET);
+            writeHeader();
+            flush();
+        }
+        fclose(file);
+        file = NULL;
+    }
 
+    OutputFile &operator<<(double value){
+        if (format == PSD_OUTPUT_BINARY){
+            addColumn(value);
+            return *this;
+        }
+        reserve(32);
+        to_chars_result result = to_chars(buffer.data() + used, buffer.data() + buffer.size(), value,
+                                          chars_format::general, 6);
+        used = result.ptr - buffer.data();
+        return *this;
+    }
+    OutputFile &operator<<(float value){
+        return *this << (double)value;
+    }
+    OutputFile &operator<<(long long value){
+        if (format == PSD_OUTPUT_BINARY){
+            addColumn(value);
+            return *this;
+        }
+        reserve(24);
+        to_chars_result result = to_chars(buffer.data() + used, buffer.data() + buffer.size(), value);
+        used = result.ptr - buffer.data();
+        return *this;
+    }
+    OutputFile &operator<<(int value){
+        return *this << (long long)value;
+    }
+    OutputFile &operator<<(const string &text){
+        return write(text.data(), text.size());
+    }
+    OutputFile &operator<<(const char *text){
+        return write(text, strlen(text));
+    }
+    OutputFile &operator<<(char c){
+        return write(&c, 1);
+    }
+    //endl and the other stream manipulators all end the line.
+    OutputFile &operator<<(ostream &(*)(ostream &)){
+        endLine();
+        return *this;
+    }
 
-//-------------------------------------------------Total Integral vs Width----------------------------------------------
-//----------------------------------------------------------------------------------------------------------------------
+private:
+    static const size_t bufferSize = 1<<20;
 
-//Method to calculate total integral and width of a set of waveforms.
-//It also gets rid of any extremely wide waves of width greater than 80% wave size
-//WIDTH IS FIRST COLUMN, TOTAL INTEGRAL IS SECOND IN OUTPUT FILE
-void totalIntVsWidth(string inFileName, string outFileName, double threshold, int wSize, int baseLEnd, int wStart, int wEnd){
-    //Clear output file and set up variables.
-    ofstream f_outClear;
-    f_outClear.open(outFileName, std::ofstream::out | std::ofstream::trunc);
-    f_outClear.close();
-    int counter, lowTime, highTime, width, time;
-    fstream f_in;
-    vector<double> wave;
-    double maxVal, height, basel, totalInt;
-    f_in.open(inFileName.c_str(),std::fstream::in);
-    ofstream f_out(outFileName, ios::out | ios::app);
-    if(!f_in){
-        cout<< " not found in totalIntVsWidth with filename: " + inFileName<< endl;
+    //Method to make room for at least numBytes more in the buffer.
+    void reserve(size_t numBytes){
+        if (buffer.size() - used < numBytes){
+            flush();
+        }
     }
-    counter = 0;
-    //Start reading in values.
-    f_in >> time >> height;
-    while(f_in){
-        if(counter<wSize){
-            wave.push_back(height); // Same wave
-            counter++;
-        }
-        else {
-            basel = 0.0;
-            //Subtract the baseline (For LUNA results this looks like around 2244?).
-            for(int i=0;i<baseLEnd;i++){
-                basel+=wave[i]/baseLEnd;
-            }
-            for(int i=0;i<wave.size();++i){
-                wave[i]-=basel;
-            }
-            //Find maxVal for the wave.
-            maxVal = maxModVal(wave);
-            for (int i=0; i<wave.size();++i){
-                if (abs(wave[i]) > threshold*abs(maxVal)){
-                    lowTime = i;
-                    break;
-                }
-            }
-            //Find the width.
-            for (int i=wSize; i>0;--i){
-                if (abs(wave[i]) > threshold*abs(maxVal)){
-                    highTime = i;
-                    break;
-                }
-            }
-            width = highTime - lowTime;
-            //eliminate the noise cases with widths of 3999 or similar and output them.
-            if ((width < 0.8*wSize)&&(width>0.0)){
-                //Integral bit.
-                totalInt = 0;
-                for (int i=wStart; i<wEnd; ++i) {
-                    totalInt += wave[i];
-                }
-
-                //Save values
-                if (f_out.is_open()) {
-                    f_out << width << " " << totalInt << endl;
-                } else {
-                    cout << "Unable to open file: " + outFileName << endl;
-                }
+    OutputFile &write(const char *text, size_t length){
+        if (format == PSD_OUTPUT_BINARY){
+            return *this;
+        }
+        if (length > bufferSize){
+            flush();
+            if (fwrite(text, 1, length, file) != length){
+                reportError("write failed");
             }
-            wave.clear();
-            counter = 0;
+            return *this;
         }
-        f_in >> time >> height;
+        reserve(length);
+        memcpy(buffer.data() + used, text, length);
+        used += length;
+        return *this;
+    }
+    void endLine(){
+        if (format == PSD_OUTPUT_TEXT){
+            write("\n", 1);
+            return;
+        }
+        if (numRows == 0){
+            numColumns = rowColumns;
+        }else if (rowColumns != numColumns){
+            reportError("line of " + to_string(rowColumns) + " numbers in a file of " + to_string(numColumns) +
+                        " columns");
+        }
+        numRows++;
+        rowColumns = 0;
+    }
+    void addColumn(double value){
+        reserve(sizeof(double));
+        memcpy(buffer.data() + used, &value, sizeof(double));
+        used += sizeof(double);
+        rowColumns++;
+    }
+    void writeHeader(){
+        ColumnFileHeader header;
+        memset(&header, 0, sizeof(header));
+        memcpy(header.magic, PSDC_MAGIC, 8);
+        header.version = 1;
+        header.numColumns = numColumns;
+        header.numRows = numRows;
+        reserve(sizeof(header));
+        memcpy(buffer.data() + used, &header, sizeof(header));
+        used += sizeof(header);
+    }
+    void reportError(string message){
+        if (!error){
+            cout << "Error writing " << fileName << ": " << message << endl;
+        }
+        error = true;
     }
-    f_in.close();
-    f_out.close();
-    cout<<"                       totalIntVsWidth Completed                    "<<endl;
 
-}
+    string fileName;
+    FILE *file;
+    int format; //PSD_OUTPUT_TEXT or PSD_OUTPUT_BINARY.
+    vector<char> buffer;
+    size_t used; //Bytes of buffer waiting to be written.
+    int numColumns, rowColumns; //Numbers on each row, and on the row being written.
+    long long numRows;
+    bool error;
+};
 
+//Method to read a .psdc file into values, row by row. Returns false if the file is missing or not a .psdc file.
+bool readColumnFile(string inFileName, int &numColumns, vector<double> &values){
+    values.clear();
+    numColumns = 0;
+    FILE *file = fopen(inFileName.c_str(), "rb");
+    if (file == NULL){
+        return false;
+    }
+    ColumnFileHeader header;
+    bool valid = (fread(&header, sizeof(header), 1, file) == 1) && (memcmp(header.magic, PSDC_MAGIC, 8) == 0) &&
+                 (header.version == 1);
+    if (valid){
+        numColumns = header.numColumns;
+        values.resize(header.numColumns*header.numRows);
+        valid = fread(values.data(), sizeof(double), values.size(), file) == values.size();
+    }
+    fclose(file);
+    return valid;
+}
 
-//After the above baseline adjustment has been made to the file, this method will calculate the total int vs width.
-void totalIntVsWidthPostBaselineAdjusted(string inFileName, string outFileName, double threshold, int wSize, int wStart, int wEnd){
-    //Clear output file and set up variables.
-    ofstream f_outClear;
-    f_outClear.open(outFileName, std::ofstream::out | std::ofstream::trunc);
-    f_outClear.close();
+//Method to pick the input file for a run, preferring a converted .psdw file over the text dump if there is one.
+string runInputFileName(string runPath, string fileModifier){
+    FILE *file = fopen((runPath + ".psdw").c_str(), "rb");
+    if (file != NULL){
+        fclose(file);
+        return runPath + ".psdw";
+    }
+    return runPath + fileModifier;
+}
 
-    int counter, lowTime, highTime, width, time;
+//Method to count the number of waves in a file.
+void numWaves(string inFileName, int wSize){
+    int numWaves;
+    WaveReader f_in(inFileName);
     vector<double> wave;
-    double maxVal, height, totalInt;
-
-    fstream f_in;
-    f_in.open(inFileName.c_str(),std::fstream::in);
-    ofstream f_out(outFileName, ios::out | ios::app);
-    if(!f_in){
-        cout<< " not found in totalIntVsWidthPostBaselineAdjusted with filename: " + inFileName<< endl;
+    if(!f_in.is_open()){
+        cout<< " not found in numWaves with filename: " + inFileName << endl;
     }
-    counter = 0;
+    numWaves = 0;
     //Start reading in values.
-    f_in >> time >> height;
-    while(f_in){
-        if(counter<wSize){
-            wave.push_back(height); // Same wave
-            counter++;
-        }
-        else {
-            //Find maxVal for the wave.
-            maxVal = maxModVal(wave);
-            for (int i=0; i<wave.size();++i){
-                if (abs(wave[i]) > threshold*abs(maxVal)){
-                    lowTime = i;
-                    break;
-                }
-            }
-            //Find the width.
-            for (int i=wSize; i>0;--i){
-                if (abs(wave[i]) > threshold*abs(maxVal)){
-                    highTime = i;
-                    break;
-                }
-            }
-            width = highTime - lowTime;
-            //eliminate the noise cases with widths of 3999 or similar and output them.
-            if ((width < 0.8*wSize)&&(width>0.0)){
-                //Integral bit.
-                totalInt = 0;
-                for (int i=wStart; i<wEnd; ++i) {
-                    totalInt += wave[i];
-                }
-
-                //Save values
-                if (f_out.is_open()) {
-                    f_out << width << " " << totalInt << endl;
-                } else {
-                    cout << "Unable to open file: " + outFileName << endl;
-                }
-            }
-            wave.clear();
-            counter = 0;
-        }
-        f_in >> time >> height;
+    while(f_in.nextWave(wave, wSize)){
+        numWaves++;
     }
     f_in.close();
-    f_out.close();
-    cout<<"                       totalIntVsWidthPostBaselineAdjusted Completed                    "<<endl;
+    cout<<"The number of waves in "<<inFileName<<" is: "<<numWaves<<endl;
+}
 
+//Method to calculate the figure of merit and its error, dFoM, from input peak separation
+//and peak widths with errors.
+double figureOfMerit(double X, double dX, double W_a, double dW_a, double W_b, double dW_b, double &dFoM){
+    double figure = X/(W_a+W_b);
+    dFoM = sqrt(dX*dX/((W_a+W_b)*(W_a+W_b))
+                        +(X*dW_a/((W_a+W_b)*(W_a+W_b)))*(X*dW_a/((W_a+W_b)*(W_a+W_b)))
+                          + (X*dW_b/((W_a+W_b)*(W_a+W_b)))*(X*dW_b/((W_a+W_b)*(W_a+W_b))));
+    return figure;
 }
 
-void totalIntPostBaselineAdjusted(string inFileName, string outFileName, int wSize, int wStart, int wEnd){
-    //Clear output file and set up variables.
-    ofstream f_outClear;
-    f_outClear.open(outFileName, std::ofstream::out | std::ofstream::trunc);
-    f_outClear.close();
+//Method to print the figure of merit and its error from input peak separation
+//and peak widths with errors.
+void FoM(double X, double dX, double W_a, double dW_a, double W_b, double dW_b){
+    double dFoM;
+    double figure = figureOfMerit(X, dX, W_a, dW_a, W_b, dW_b, dFoM);
+    cout << "The figure of merit for the inputs is: " << figure<< " with an error of: " << dFoM <<endl;
+}
 
-    int counter, lowTime, highTime, time;
-    vector<double> wave;
-    double  height, totalInt;
 
-    fstream f_in;
-    f_in.open(inFileName.c_str(),std::fstream::in);
-    ofstream f_out(outFileName, ios::out | ios::app);
-    if(!f_in){
-        cout<< " not found in totalIntPostBaselineAdjusted with filename: " + inFileName << endl;
+//Method to print the first 10 waveforms in a file to a txt file.
+void firstTen(string inFileName, string outFileName, int wSize){
+    //Set up variables, the output file is emptied when it is opened.
+    int numWaves;
+    numWaves = 0;
+    WaveReader f_in(inFileName);
+    vector<double> wave1;
+    OutputFile f_out(outFileName);
+    if(!f_in.is_open()){
+        cout<< " not found in firstTen with filename: " + inFileName<< endl;
     }
-    counter = 0;
     //Start reading in values.
-    f_in >> time >> height;
-    while(f_in){
-        if(counter<wSize){
-            wave.push_back(height); // Same wave
-            counter++;
-        }
-        else {
-            //Find maxVal for the wave.
-            //Integral bit.
-            totalInt = 0;
-            for (int i=wStart; i<wEnd; ++i) {
-                totalInt += wave[i];
-            }
-            //Save values
+    while(f_in.nextWave(wave1, wSize)){
+        numWaves++;
+        //Save values
+        if (numWaves<10) {
             if (f_out.is_open()) {
-                f_out << totalInt << endl;
+                for (int i = 0; i < wave1.size(); ++i) {
+                    f_out <<i <<" "<< wave1[i]<<endl;
+                }
             } else {
-                cout << "Unable to open file: " + outFileName << endl;
+                cout << "Unable to open file " << endl;
             }
-            wave.clear();
-            counter = 0;
+        }else{
+            break;
         }
-        f_in >> time >> height;
     }
     f_in.close();
     f_out.close();
-    cout<<"                       totalIntPostBaselineAdjusted Completed                    "<<endl;
+    cout<<"                       firstTen Completed                    "<<endl;
 
 }
 
-//-----------------------------------------------Pulse Gradient Analysis------------------------------------------------
-//----------------------------------------------------------------------------------------------------------------------
-//Methods to perform the pulse gradient analysis detailed in Radiation Detection and Measurement (G.F.Knoll, 1989) comparing
-//the (baseline adjusted) amplitude to a sample value.
-void PGA(string inFileName, string outFileName, int sampleNo, int wSize, int baseLEnd ){
-    ofstream f_outClear;
-    f_outClear.open(outFileName, std::ofstream::out | std::ofstream::trunc);
-    f_outClear.close();
-    int counter, time;
-    fstream f_in;
+//Method to adjust the values in a file by their baseline to zero. The first baseLEnd values are
+//averaged and then subtracted from the whole wave. The baseline adjusted analyses no longer need this copy, as
+//BaselineAdjustedReader adjusts the raw file as it reads it. If a copy is wanted, an outFileName ending in .psdw writes
+//it as float32 heights, a third of the size of the text and readable by every method in place of the raw file.
+void baselineAdjust(string inFileName, string outFileName, int wSize, int baseLEnd){
+    //Set up variables, the output file is emptied when it is opened.
+    BaselineAdjustedReader f_in(inFileName, baseLEnd);
     vector<double> wave;
-    double amplitudeVal, height, basel, sampleVal, PGAVal;
-    f_in.open(inFileName.c_str(),std::fstream::in);
-    ofstream f_out(outFileName, ios::out | ios::app);
-    if(!f_in){
-        cout<< " not found in PGA with filename: " + inFileName<< endl;
+    if(!f_in.is_open()){
+        cout<< " not found in baselineAdjust with filename: " + inFileName<< endl;
     }
-    counter = 0;
+    if ((outFileName.size() > 5) && (outFileName.compare(outFileName.size() - 5, 5, ".psdw") == 0)){
+        BinaryWaveWriter f_out(outFileName, wSize, PSDW_FLOAT32, "", 0);
+        while(f_in.nextWave(wave, wSize)){
+            f_out.writeWave(wave);
+        }
+        f_in.close();
+        f_out.close();
+        cout<<"                       baselineAdjust Completed                    "<<endl;
+        return;
+    }
+    OutputFile f_out(outFileName);
     //Start reading in values.
-    f_in >> time >> height;
-    while(f_in) {
-        if (counter < wSize) {
-            wave.push_back(height); // Same wave
-            counter++;
-        }
-        else {
-            basel = 0.0;
-            //Calculate and subtract the baseline (For LUNA results this looks like around 2244?).
-            for (int i = 0; i < baseLEnd; i++) {
-                basel += wave[i]/baseLEnd;
-            }
+    while(f_in.nextWave(wave, wSize)){
+        //Save values
+        if (f_out.is_open()) {
             for (int i = 0; i < wave.size(); ++i) {
-                wave[i] -= basel;
-            }
-            //Find amplitude value and sample value for the wave.
-            amplitudeVal = maxModVal(wave);
-            sampleVal = wave[sampleNo];
-            PGAVal = abs(sampleVal - amplitudeVal);
-            //print to output
-            if (f_out.is_open()) {
-                f_out << PGAVal << endl;
-            } else {
-                cout << "Unable to open file: " + outFileName << endl;
+                f_out << i << " "<<wave[i] << endl;
             }
-            wave.clear();
-            counter = 0;
+        } else {
+            cout << "Unable to open file " << endl;
         }
-        f_in >> time >> height;
     }
     f_in.close();
     f_out.close();
-    cout<<"                       PGA Completed                    "<<endl;
+    cout<<"                       baselineAdjust Completed                    "<<endl;
 
 }
-//-------------------------------------------------Run Comparison Methods-----------------------------------------------
-//It's become necessary to compare various aspects of runs to determine what is causing the gradual increase in
-//neutron rates with real time. The earliest runs in real time from LUNA are dump_001_wf_0 and dump_001_wf_1.
+
+//-----------------------------------------------------PSA METHODS------------------------------------------------------
+//Forms the majority of the code, several methods are attempted here, the most notable of which being thewidths method
+//which shows promising results in discriminating the heavy particle signature (neutrons) from the other signals
+// (thought to be gammas mostly)
 //----------------------------------------------------------------------------------------------------------------------
 
-//Method to calculate the average peak height for the waves for 2 runs for comparison. The baseline is first subtracted
-//from the wave, then the peak value is extracted
-void peakValAverage(string inFileName, string outFileName, int wSize, int baseLEnd){
-    int counter, time;
-    vector<double> peakHeights, wave;
-    double height, avgHeight, basel;
-    fstream f_in;
-    f_in.open(inFileName.c_str(),std::fstream::in);
-    if(!f_in){
-        cout<< " not found in peakValAverage with filename: " + inFileName << endl;
+//--------------------------------------------------Tail vs Peak Integral-----------------------------------------------
+//----------------------------------------------------------------------------------------------------------------------
+
+
+//Giant method to do all of the peak/tail PSA all at once.
+//PEAK IS FIRST COLUMN, TAIL IS SECOND IN OUTPUT FILE
+void peakTailIntegrate(string inFileName, string outFileName, int wSize, int baseLEnd, int peakXValue, int tailEndXVal){
+    //Set up variables, the output file is emptied when it is opened.
+    int  pulserNo,peakXVal;
+    pulserNo = 0;
+    WaveReader f_in(inFileName);
+    vector<double> wave;
+    double peak,tail,basel;
+    OutputFile f_out(outFileName);
+    if(!f_in.is_open()){
+        cout<< " not found in peakTailIntegrate with filename: " + inFileName<< endl;
     }
-    avgHeight = 0;
-    counter = 0;
     //Start reading in values.
-    f_in >> time >> height;
-    while(f_in){
-        if(counter<wSize){
-            wave.push_back(height); // Same wave
-            counter++;
+    while(f_in.nextWave(wave, wSize)){
+        //remove pulsers.
+        peak = tail = basel = 0;
+        for (int i=0;i<baseLEnd;++i){
+            basel += wave[i]/baseLEnd;
+        }
+        for (int i=0;i<wSize;++i){
+            wave[i] -= basel;
         }
-        else {
-            basel = 0.0;
-            //Find and subtract the baseline for the wave
-            for(int i=0;i<baseLEnd;i++){
-                basel+=wave[i]/baseLEnd;
+        //Integrate.
+        for (int i = 0; i < wave.size(); ++i) {
+            if (i < peakXValue){
+                peak += wave[i];
             }
-            for(int i=0;i<wSize;i++){
-                wave[i]-=basel;
+            else if ((i > peakXValue) && (i < tailEndXVal)){
+                tail += wave[i];
             }
-            //Find maxVal for the wave.
-            peakHeights.push_back(modMaxModVal(wave));
-            wave.clear();
-            counter = 0;
         }
-        f_in >> time >> height;
+        //Save values
+        if (f_out.is_open()) {
+            f_out << peak << " " << tail << endl;
+        } else {
+            cout << "Unable to open file " << endl;
+        }
     }
     f_in.close();
-    for(int i=0;i<peakHeights.size();++i){
-        avgHeight+=peakHeights[i]/peakHeights.size();
-    }
-
-    ofstream f_out(outFileName, ios::out | ios::app);
-    if (f_out.is_open()) {
-        f_out << inFileName<<" "<< avgHeight << endl;
-    } else {
-        cout << "Unable to open file: " + outFileName << endl;
-    }
     f_out.close();
-    cout<<"                       peakValAverage Completed                    "<<endl;
+    cout<<"                       peakTailIntegrate Completed                    "<<endl;
 
 }
 
+//Charge comparison with any number of gates. Each gate is a window [start, end) measured from the start of the
+//waveform, the pulse onset or the peak, and all of the gates of a waveform are summed from one running integral, so
+//trying many gate settings costs one pass over the data rather than one per setting.
 
-//Method to compare the average baseline for 2 runs for comparison.
-void baselineAverage(string inFileName, string outFileName, int wSize, int baseLEnd){
+#define PSD_GATE_ABSOLUTE 0 //Limits are sample numbers.
+#define PSD_GATE_ONSET 1 //Limits are relative to the pulse onset.
+#define PSD_GATE_PEAK 2 //Limits are relative to the sample with the largest height.
 
-    int counter, time;
-    vector<double> baseLVals, wave;
-    double height, avgBaseL, basel;
-    fstream f_in;
-    f_in.open(inFileName.c_str(),std::fstream::in);
-    if(!f_in){
-        cout<< " not found in baselineAverage with filename: " + inFileName << endl;
-    }
-    avgBaseL = 0;
-    counter = 0;
+//A named integration window.
+struct Gate{
+    string name;
+    int reference; //PSD_GATE_ position the limits are measured from.
+    int start; //First sample of the gate, relative to the reference.
+    int end; //Sample after the last one of the gate, relative to the reference.
+};
+
+//The gates to integrate for every waveform.
+struct GateSet{
+    vector<Gate> gates;
+    double onsetFraction; //The onset is the first sample before the peak above this fraction of the maximum height.
+    int tailGate; //Index of the gate named "tail", or -1.
+    int totalGate; //Index of the gate named "total", or -1. With tailGate, the tail/total ratio is output.
+};
+
+//Method to read gates given as "name:reference:start:end,..." with reference one of absolute, onset or peak, e.g.
+//"total:onset:-5:300,tail:peak:20:300". Returns false if any gate cannot be read.
+bool parseGates(string list, GateSet &gateSet){
+    gateSet.gates.clear();
+    gateSet.tailGate = gateSet.totalGate = -1;
+    stringstream gateList(list);
+    string gateText;
+    while (getline(gateList, gateText, ',')){
+        for (int i=0; i<gateText.size(); ++i){
+            if (gateText[i] == ':'){
+                gateText[i] = ' ';
+            }
+        }
+        Gate gate;
+        string reference;
+        stringstream fields(gateText);
+        if (!(fields >> gate.name >> reference >> gate.start >> gate.end)){
+            return false;
+        }
+        if (reference == "absolute"){
+            gate.reference = PSD_GATE_ABSOLUTE;
+        }else if (reference == "onset"){
+            gate.reference = PSD_GATE_ONSET;
+        }else if (reference == "peak"){
+            gate.reference = PSD_GATE_PEAK;
+        }else{
+            return false;
+        }
+        if (gate.name == "tail"){
+            gateSet.tailGate = gateSet.gates.size();
+        }else if (gate.name == "total"){
+            gateSet.totalGate = gateSet.gates.size();
+        }
+        gateSet.gates.push_back(gate);
+    }
+    return !gateSet.gates.empty();
+}
+
+//Method to sum heights[0..size) over every gate, writing the sums to gateSums. onset and peak are the samples the
+//relative gates are measured from, and the parts of a gate outside the waveform are left out. prefix is workspace for
+//the running integral.
+template <typename Real>
+void evaluateGates(const Real *heights, int size, const GateSet &gateSet, int onset, int peak, vector<double> &prefix,
+                   double *gateSums){
+    prefix.resize(size + 1);
+    prefix[0] = 0;
+    for (int i=0; i<size; ++i){
+        prefix[i+1] = prefix[i] + heights[i];
+    }
+    for (int j=0; j<gateSet.gates.size(); ++j){
+        const Gate &gate = gateSet.gates[j];
+        int origin = 0;
+        if (gate.reference == PSD_GATE_ONSET){
+            origin = onset;
+        }else if (gate.reference == PSD_GATE_PEAK){
+            origin = peak;
+        }
+        int start = min(max(origin + gate.start, 0), size);
+        int end = min(max(origin + gate.end, start), size);
+        gateSums[j] = prefix[end] - prefix[start];
+    }
+}
+
+//-------------------------------------------Risetime vs Peak Height----------------------------------------------------
+//----------------------------------------------------------------------------------------------------------------------
+
+
+//Fractions of the total integral between which an integral rise time is measured, such as 0.1 and 0.9.
+struct RisetimeThresholds{
+    double low;
+    double high;
+};
+
+//Method to calculate the integral rise times of heights[0..size) for each pair of thresholds, writing them to
+//risetimes. The time for a fraction is the first sample at which the running integral goes above fraction*total, or
+//the last sample if it never does. The integral is built once and its running maximum kept in workspace, which rises
+//monotonically and first goes above a target at the same sample as the integral itself, so every fraction is found
+//with a binary search rather than another scan.
+template <typename Real>
+void integralRisetimes(const Real *heights, int size, const vector<RisetimeThresholds> &thresholds,
+                       vector<double> &workspace, double *risetimes){
+    workspace.resize(size);
+    double accumulate = 0, largest = -numeric_limits<double>::infinity();
+    for (int i=0; i<size; ++i){
+        accumulate += heights[i];
+        largest = max(largest, accumulate);
+        workspace[i] = largest;
+    }
+    double totalIntegral = accumulate;
+    for (int j=0; j<thresholds.size(); ++j){
+        int times[2];
+        double fractions[2] = {thresholds[j].low, thresholds[j].high};
+        for (int k=0; k<2; ++k){
+            times[k] = upper_bound(workspace.begin(), workspace.end(), fractions[k]*totalIntegral) - workspace.begin();
+            times[k] = min(times[k], size - 1);
+        }
+        risetimes[j] = times[1] - times[0];
+    }
+}
+
+//Method to calculate integral rise times vs amplitude for an input file, with one rise time column for each pair of
+//thresholds (e.g. 10/90 and 20/80).
+//PEAK VALUE IS FIRST COLUMN, INTEGRAL RISETIMES ARE THE FOLLOWING COLUMNS).
+void IntegralRisetimeVsAmplitude(string inFileName, string outFileName, const vector<RisetimeThresholds> &thresholds,
+                                 int wSize, int baseLEnd){
+    //Set up variables, the output file is emptied when it is opened.
+    WaveReader f_in(inFileName);
+    vector<double> wave, workspace, risetimes(thresholds.size());
+    double basel, peak;
+    OutputFile f_out(outFileName);
+    if(!f_in.is_open()){
+        cout<< " not found in IntegralRisetimeVsAmplitude with filename: " + inFileName<< endl;
+    }
     //Start reading in values.
-    f_in >> time >> height;
-    while(f_in){
-        if(counter<wSize){
-            wave.push_back(height); // Same wave
-            counter++;
+    while(f_in.nextWave(wave, wSize)){
+        //Calculate baseline.
+        basel = 0;
+        for (int i=0; i < baseLEnd; ++i) {
+            basel += wave[i]/baseLEnd;
         }
-        else {
-            basel = 0.0;
-            //Find the baseline for the wave
-            for(int i=0;i<baseLEnd;i++){
-                basel+=wave[i]/baseLEnd;
+        //Subtract baseline.
+        for (int i=0; i<wSize; i++){
+            wave[i] -= basel;
+        }
+        peak = maxModVal(wave);
+        integralRisetimes(wave.data(), wave.size(), thresholds, workspace, risetimes.data());
+        //Save values.
+        if (f_out.is_open()) {
+            f_out << peak;
+            for (int j=0; j<risetimes.size(); ++j){
+                f_out << " " << risetimes[j];
             }
-            //Find maxVal for the wave.
-            baseLVals.push_back(basel);
-            wave.clear();
-            counter = 0;
+            f_out << endl;
+        } else {
+            cout << "Unable to open file " << endl;
         }
-        f_in >> time >> height;
     }
     f_in.close();
-    for(int i=0;i<baseLVals.size();++i){
-        avgBaseL+=baseLVals[i]/baseLVals.size();
-    }
+    f_out.close();
+    cout<<"                       IntegralRisetimeVsAmplitude Completed                    "<<endl;
 
-    ofstream f_out(outFileName, ios::out | ios::app);
-    if (f_out.is_open()) {
-        f_out << inFileName<<" "<< avgBaseL << endl;
-    } else {
-        cout << "Unable to open file: " + outFileName << endl;
+}
+
+//Method to do the same for a single pair of thresholds.
+void IntegralRisetimeVsAmplitude(string inFileName, string outFileName, double lowThresh, double highThresh, int wSize, int baseLEnd){
+    vector<RisetimeThresholds> thresholds(1);
+    thresholds[0].low = lowThresh;
+    thresholds[0].high = highThresh;
+    IntegralRisetimeVsAmplitude(inFileName, outFileName, thresholds, wSize, baseLEnd);
+}
+
+//--------------------------------------------------------------Widths--------------------------------------------------
+//----------------------------------------------------------------------------------------------------------------------
+
+#define PSD_WIDTH_OUTERMOST 0 //Edges are the first and last samples above the level anywhere in the waveform.
+#define PSD_WIDTH_FROM_PEAK 1 //Edges are the ends of the run of samples above the level that contains the peak.
+
+//Edges of a pulse at some level. low and high are the outer samples above the level, and lowCrossing and highCrossing
+//are where the pulse crosses the level, interpolated between samples when asked for and equal to low and high if not.
+struct PulseEdges{
+    int low;
+    int high;
+    double lowCrossing;
+    double highCrossing;
+};
+
+//Method to find the first and last of the n values whose modulus is above level, searching forwards and backwards, with
+//0 for either if there is none. The last is never taken to be value 0, which makes no difference as 0 stands for none.
+template <typename Real>
+void outermostAboveScalar(const Real *values, int n, double level, int &first, int &last){
+    first = last = 0;
+    for (int i=0; i<n; ++i){
+        if (abs(values[i]) > level){
+            first = i;
+            break;
+        }
+    }
+    for (int i=n-1; i>0; --i){
+        if (abs(values[i]) > level){
+            last = i;
+            break;
+        }
     }
-    f_out.close();
-    cout<<"                       baselineAverage Completed                    "<<endl;
 }
 
-//Method to compare the average width for the neutron region and the low non-neutron region for 2 runs.
-void regionWidthComparison(string inFileName1, string inFileName2, double lowThreshold, double highThreshold){
-    vector<double> neutronVec1, nonNeutronVec1, neutronVec2, nonNeutronVec2;
-    double width1, width2, avgNeutWidth1, avgNonWidth1, avgNeutWidth2, avgNonWidth2;
-    avgNeutWidth1 = avgNeutWidth2 = avgNonWidth1 = avgNonWidth2 = 0.0;
-    //First run
-    fstream f_in1;
-    f_in1.open(inFileName1.c_str(),std::fstream::in);
-    if(!f_in1){
-        cout<< " not found in regionWidthComparison first filename with filename: " + inFileName1 << endl;
+//The search for doubles uses the kernels chosen by selectKernels further down.
+void outermostAbove(const double *values, int n, double level, int &first, int &last);
+
+template <typename Real>
+void outermostAbove(const Real *values, int n, double level, int &first, int &last){
+    outermostAboveScalar(values, n, level, first, last);
+}
+
+//Method to find the edges of the pulse in heights[0..size) where its modulus passes level. PSD_WIDTH_OUTERMOST is the
+//search all of the methods here have always used: the first sample above the level searching forwards, and the last
+//one searching backwards, with 0 for either if there is none. PSD_WIDTH_FROM_PEAK instead walks outwards from
+//peakIndex until the heights drop back to the level, so its cost follows the length of the pulse rather than of the
+//waveform, and noise above the level away from the pulse is not counted. Nothing outside heights[0..size) is read.
+template <typename Real>
+PulseEdges findPulseEdges(const Real *heights, int size, double level, int peakIndex, int method, bool interpolate){
+    PulseEdges edges = {0, 0, 0.0, 0.0};
+    if (method == PSD_WIDTH_FROM_PEAK){
+        if ((peakIndex < 0) || (peakIndex >= size) || !(abs(heights[peakIndex]) > level)){
+            return edges;
+        }
+        edges.low = edges.high = peakIndex;
+        while ((edges.low > 0) && (abs(heights[edges.low - 1]) > level)){
+            edges.low--;
+        }
+        while ((edges.high < size - 1) && (abs(heights[edges.high + 1]) > level)){
+            edges.high++;
+        }
+    }else{
+        outermostAbove(heights, size, level, edges.low, edges.high);
     }
-    //Start reading in values.
-    f_in1 >> width1;
-    while(f_in1){
-        if((width1>lowThreshold)&&(width1<highThreshold)){
-            neutronVec1.push_back(width1);
-        }else if(width1<lowThreshold){
-            nonNeutronVec1.push_back(width1);
+    edges.lowCrossing = edges.low;
+    edges.highCrossing = edges.high;
+    if (interpolate){
+        //Straight line between the last sample at or below the level and the first one above it.
+        if ((edges.low > 0) && (abs(heights[edges.low]) > level)){
+            double inside = abs(heights[edges.low]), outside = abs(heights[edges.low - 1]);
+            edges.lowCrossing -= (inside - level)/(inside - outside);
+        }
+        if ((edges.high < size - 1) && (abs(heights[edges.high]) > level)){
+            double inside = abs(heights[edges.high]), outside = abs(heights[edges.high + 1]);
+            edges.highCrossing += (inside - level)/(inside - outside);
         }
-        f_in1 >> width1;
     }
-    f_in1.close();
+    return edges;
+}
 
-    for (int i=0;i<neutronVec1.size();++i){
-        avgNeutWidth1+=neutronVec1[i];
+//Counts of the widths found in a run, one bin per sample. The single pass engine fills one as it goes, so the binned
+//widths and the derived quantities further down come from memory instead of from re-reading a _Widths.txt file.
+class WidthHistogram{
+public:
+    WidthHistogram(int maxWidth = 0) : counts(maxWidth + 1, 0), total(0){}
+    //Method to count one width. Negative widths are never written to the widths files, so they are ignored here too.
+    void add(int width){
+        if (width < 0){
+            return;
+        }
+        if (width >= counts.size()){
+            counts.resize(width + 1, 0);
+        }
+        counts[width]++;
+        total++;
     }
-    avgNeutWidth1/=neutronVec1.size();
+    //Number of widths w with lowThreshold <= w <= highThreshold, the neutron cut used by the derived quantities.
+    long long countBetween(double lowThreshold, double highThreshold) const{
+        long long numBetween = 0;
+        for (int width = max(0, (int)ceil(lowThreshold)); (width < counts.size()) && (width <= highThreshold); ++width){
+            numBetween += counts[width];
+        }
+        return numBetween;
+    }
+    long long count(int width) const{
+        return ((width >= 0) && (width < counts.size())) ? counts[width] : 0;
+    }
+    long long totalCount() const{
+        return total;
+    }
+    //Largest width the histogram has room for.
+    int maxWidth() const{
+        return counts.size() - 1;
+    }
+private:
+    vector<long long> counts;
+    long long total;
+};
 
-    for (int i=0;i<nonNeutronVec1.size();++i){
-        avgNonWidth1+=nonNeutronVec1[i];
+//Method to fill a WidthHistogram from a widths file, text or .psdc, for the methods that are given a file rather than a
+//histogram.
+//methodName is the caller, for the message if the file is missing.
+WidthHistogram readWidthHistogram(string inFileName, string methodName){
+    WidthHistogram widths;
+    double width;
+    //Widths written with --binary-output.
+    int numColumns;
+    vector<double> values;
+    if (readColumnFile(inFileName, numColumns, values)){
+        for (int i=0; i<values.size(); i+=max(numColumns, 1)){
+            widths.add(round(values[i]));
+        }
+        return widths;
     }
-    avgNonWidth1/=nonNeutronVec1.size();
+    fstream f_in;
+    f_in.open(inFileName.c_str(),std::fstream::in);
+    if(!f_in){
+        cout<< " not found in " + methodName + " with filename: " + inFileName<< endl;
+    }
+    f_in >> width;
+    while(f_in){
+        widths.add(round(width));
+        f_in >> width;
+    }
+    f_in.close();
+    return widths;
+}
 
-    //Repeat for other run.
-    fstream f_in2;
-    f_in2.open(inFileName2.c_str(),std::fstream::in);
-    if(!f_in2){
-        cout<< " not found in regionWidthComparison second filename with filename: " + inFileName2 << endl;
+//Method to calculate the width of the pulse for a given fraction of its height, such as the full width half maximum
+//This one works for an input file that is a list of wave heights of size WSIZE
+void Widths(string inFileName, string outFileName, double threshold, int wSize, int baseLEnd){
+    //Set up variables, the output file is emptied when it is opened.
+    int width;
+    WaveReader f_in(inFileName);
+    vector<double> wave;
+    double maxVal, basel;
+    OutputFile f_out(outFileName);
+    if(!f_in.is_open()){
+        cout<< " not found in Widths with filename: " + inFileName<< endl;
     }
     //Start reading in values.
-    f_in2 >> width2;
-    while(f_in2){
-        if((width2>lowThreshold)&&(width2<highThreshold)){
-            neutronVec2.push_back(width2);
-        }else if(width2<lowThreshold){
-            nonNeutronVec2.push_back(width2);
+    while(f_in.nextWave(wave, wSize)){
+        basel = 0.0;
+        //Subtract the baseline (For LUNA results this looks like around 2244?).
+        for(int i=0;i<baseLEnd;i++){
+            basel+=wave[i];
+        }
+        basel = basel/baseLEnd;
+        for(int i=0;i<wave.size();++i){
+            wave[i]-=basel;
+        }
+        //Find maxVal for the wave.
+        maxVal = maxModVal(wave);
+        //Find the width.
+        PulseEdges edges = findPulseEdges(wave.data(), wave.size(), threshold*abs(maxVal), 0, PSD_WIDTH_OUTERMOST, false);
+        width = edges.high - edges.low;
+        //eliminate the noise cases with widths of 3999 or similar and output them.
+        if ((width < 0.8*wSize)&&(width>0.0)){
+            if (f_out.is_open()){
+                f_out << width << endl;
+            } else {
+                cout << "Unable to open file: " + outFileName<< endl;
+            }
         }
-        f_in2 >> width2;
     }
-    f_in2.close();
-    //Average the values over their vectors.
-    for (int i=0;i<neutronVec2.size();++i){
-        avgNeutWidth2+=neutronVec2[i];
+    f_in.close();
+    f_out.close();
+    cout<<"                       Widths Completed                    "<<endl;
+
+}
+
+
+//Method to bin the widths (in bin sizes of binSize) counted by the Widths method.
+//This method normalises the data to the length of the run, time.
+void widthBinTimeNormalised(const WidthHistogram &widths, string outFileName, double time, double binSize, int wSize){
+    //Set up variables, the output file is emptied when it is opened.
+    vector<double> widthBinVals((int)(wSize/binSize));
+    for (int width=0; width<=widths.maxWidth(); ++width){
+        int index = round(width/binSize);
+        if ((widths.count(width) > 0) && (index < widthBinVals.size())){
+            widthBinVals[index] += widths.count(width);
+        }
     }
-    avgNeutWidth2/=neutronVec2.size();
+    OutputFile f_out(outFileName);
 
-    for (int i=0;i<nonNeutronVec2.size();++i){
-        avgNonWidth2+=nonNeutronVec2[i];
+    for(int i=0;i<widthBinVals.size();++i){
+        widthBinVals[i]/=time;
+        if (f_out.is_open()) {
+            f_out << i * binSize << " " << widthBinVals[i] << endl;
+        }else{
+            cout <<"Unable to open file: " + outFileName <<endl;
+        }
     }
-    avgNonWidth2/=nonNeutronVec2.size();
+    f_out.close();
+    cout<<"                       widthBinTimeNormalised Completed                    "<<endl;
 
-    //Print em.
-    cout<<"For the input file "<<inFileName1<<" the average neutron region width is: "<<avgNeutWidth1<<endl;
-    cout<<"and the average low region non-neutron width is: "<<avgNonWidth1<<endl;
-    cout<<"For the input file "<<inFileName2<<" the average neutron region width is: "<<avgNeutWidth2<<endl;
-    cout<<"and the average low region non-neutron width is: "<<avgNonWidth2<<endl<<endl;
-    cout<<"                       regionWidthComparison Completed                    "<<endl;
+}
 
+//Method to do the same from one of the output files from the Widths method.
+void widthBinTimeNormalised(string inFileName, string outFileName, double time, double binSize, int wSize){
+    widthBinTimeNormalised(readWidthHistogram(inFileName, "widthBinTimeNormalised"), outFileName, time, binSize, wSize);
 }
 
-//method to calculate the average deviation from the baseline for diagnosing electronic noise in LUNA runs.
-void baselineDeviation(string inFileName, string outFileName, int wSize, int baseLEnd){
-    fstream f_in;
-    f_in.open(inFileName.c_str(),std::fstream::in);
-    if(!f_in){
-        cout<< " not found in baselineDeviation with filename: " + inFileName << endl;
-    }
+
+//-------------------------------------------------Total Integral vs Width----------------------------------------------
+//----------------------------------------------------------------------------------------------------------------------
+
+//Method to calculate total integral and width of a set of waveforms.
+//It also gets rid of any extremely wide waves of width greater than 80% wave size
+//WIDTH IS FIRST COLUMN, TOTAL INTEGRAL IS SECOND IN OUTPUT FILE
+void totalIntVsWidth(string inFileName, string outFileName, double threshold, int wSize, int baseLEnd, int wStart, int wEnd){
+    //Set up variables, the output file is emptied when it is opened.
+    int width;
+    WaveReader f_in(inFileName);
     vector<double> wave;
-    double height, basel, deviation, delta;
-    int counter = 0, time;
-    f_in >> time >> height;
-    while(f_in){
-        if(counter<wSize){
-            wave.push_back(height); // Same wave
-            counter++;
+    double maxVal, basel, totalInt;
+    OutputFile f_out(outFileName);
+    if(!f_in.is_open()){
+        cout<< " not found in totalIntVsWidth with filename: " + inFileName<< endl;
+    }
+    //Start reading in values.
+    while(f_in.nextWave(wave, wSize)){
+        basel = 0.0;
+        //Subtract the baseline (For LUNA results this looks like around 2244?).
+        for(int i=0;i<baseLEnd;i++){
+            basel+=wave[i]/baseLEnd;
         }
-        else {
-            basel = 0.0;
-            //Find the baseline for the wave
-            for(int i=0;i<baseLEnd;i++){
-                basel+=wave[i]/baseLEnd;
+        for(int i=0;i<wave.size();++i){
+            wave[i]-=basel;
+        }
+        //Find maxVal for the wave.
+        maxVal = maxModVal(wave);
+        //Find the width.
+        PulseEdges edges = findPulseEdges(wave.data(), wave.size(), threshold*abs(maxVal), 0, PSD_WIDTH_OUTERMOST, false);
+        width = edges.high - edges.low;
+        //eliminate the noise cases with widths of 3999 or similar and output them.
+        if ((width < 0.8*wSize)&&(width>0.0)){
+            //Integral bit.
+            totalInt = 0;
+            for (int i=wStart; i<wEnd; ++i) {
+                totalInt += wave[i];
             }
-            for(int i=0;i<baseLEnd;i++){
-                delta = wave[i]-basel;
-                deviation+=delta*delta/baseLEnd;
+
+            //Save values
+            if (f_out.is_open()) {
+                f_out << width << " " << totalInt << endl;
+            } else {
+                cout << "Unable to open file: " + outFileName << endl;
             }
-            deviation = sqrt(deviation);
-            wave.clear();
-            counter = 0;
         }
-        f_in >> time >> height;
     }
-    ofstream f_out(outFileName, ios::out | ios::app);
-    //cout << inFileName <<" "<<deviation<< endl;
-    if (f_out.is_open()) {
-        f_out << inFileName <<" "<<deviation<< endl;
-    } else {
-        cout << "Unable to open file: " + outFileName << endl;
+    f_in.close();
+    f_out.close();
+    cout<<"                       totalIntVsWidth Completed                    "<<endl;
+
+}
+
+
+//After the above baseline adjustment has been made to the file, this method will calculate the total int vs width.
+//Given baseLEnd, inFileName is instead the raw file, adjusted as it is read with no copy written.
+void totalIntVsWidthPostBaselineAdjusted(string inFileName, string outFileName, double threshold, int wSize, int wStart,
+                                         int wEnd, int baseLEnd = 0){
+    //Set up variables, the output file is emptied when it is opened.
+
+    int width;
+    vector<double> wave;
+    double maxVal, totalInt;
+    BaselineAdjustedReader f_in(inFileName, baseLEnd);
+    OutputFile f_out(outFileName);
+    if(!f_in.is_open()){
+        cout<< " not found in totalIntVsWidthPostBaselineAdjusted with filename: " + inFileName<< endl;
+    }
+    //Start reading in values.
+    while(f_in.nextWave(wave, wSize)){
+        //Find maxVal for the wave.
+        maxVal = maxModVal(wave);
+        //Find the width.
+        PulseEdges edges = findPulseEdges(wave.data(), wave.size(), threshold*abs(maxVal), 0, PSD_WIDTH_OUTERMOST, false);
+        width = edges.high - edges.low;
+        //eliminate the noise cases with widths of 3999 or similar and output them.
+        if ((width < 0.8*wSize)&&(width>0.0)){
+            //Integral bit.
+            totalInt = 0;
+            for (int i=wStart; i<wEnd; ++i) {
+                totalInt += wave[i];
+            }
+
+            //Save values
+            if (f_out.is_open()) {
+                f_out << width << " " << totalInt << endl;
+            } else {
+                cout << "Unable to open file: " + outFileName << endl;
+            }
+        }
     }
+    f_in.close();
     f_out.close();
-    f_in.close();;
-    cout<<"                       baselineDeviation Completed                    "<<endl;
+    cout<<"                       totalIntVsWidthPostBaselineAdjusted Completed                    "<<endl;
+
 }
 
-//Method to sort the LUNA runs by detector.
-void sortedLUNA(string inFileName, string outFileName0, string outFileName1){
-    fstream f_in;
-    f_in.open(inFileName.c_str(),std::fstream::in);
-    if(!f_in){
-        cout<< " not found in sortedLUNA with filename: " + inFileName << endl;
+//Method to write the total integral of each waveform of a baseline adjusted file, or of the raw file given baseLEnd.
+void totalIntPostBaselineAdjusted(string inFileName, string outFileName, int wSize, int wStart, int wEnd,
+                                  int baseLEnd = 0){
+    //Set up variables, the output file is emptied when it is opened.
+
+    int lowTime, highTime;
+    vector<double> wave;
+    double totalInt;
+    BaselineAdjustedReader f_in(inFileName, baseLEnd);
+    OutputFile f_out(outFileName);
+    if(!f_in.is_open()){
+        cout<< " not found in totalIntPostBaselineAdjusted with filename: " + inFileName << endl;
     }
-    string filename1, filename0;
-    double LUNAVal1, LUNAVal0;
     //Start reading in values.
-    ofstream f_out0(outFileName0, ios::out | ios::app), f_out1(outFileName1, ios::out | ios::app);
-    f_in >> filename0 >> LUNAVal0 >>filename1>>LUNAVal1;
-    while(f_in){
-        if (f_out0.is_open()) {
-            f_out0 << filename0 <<" "<<LUNAVal0<<endl;
+    while(f_in.nextWave(wave, wSize)){
+        //Find maxVal for the wave.
+        //Integral bit.
+        totalInt = 0;
+        for (int i=wStart; i<wEnd; ++i) {
+            totalInt += wave[i];
+        }
+        //Save values
+        if (f_out.is_open()) {
+            f_out << totalInt << endl;
         } else {
-            cout << "Unable to open file0 " << endl;
+            cout << "Unable to open file: " + outFileName << endl;
+        }
+    }
+    f_in.close();
+    f_out.close();
+    cout<<"                       totalIntPostBaselineAdjusted Completed                    "<<endl;
+
+}
+
+//-----------------------------------------------Pulse Gradient Analysis------------------------------------------------
+//----------------------------------------------------------------------------------------------------------------------
+//Methods to perform the pulse gradient analysis detailed in Radiation Detection and Measurement (G.F.Knoll, 1989) comparing
+//the (baseline adjusted) amplitude to a sample value.
+void PGA(string inFileName, string outFileName, int sampleNo, int wSize, int baseLEnd ){
+    WaveReader f_in(inFileName);
+    vector<double> wave;
+    double amplitudeVal, basel, sampleVal, PGAVal;
+    OutputFile f_out(outFileName);
+    if(!f_in.is_open()){
+        cout<< " not found in PGA with filename: " + inFileName<< endl;
+    }
+    //Start reading in values.
+    while(f_in.nextWave(wave, wSize)){
+        basel = 0.0;
+        //Calculate and subtract the baseline (For LUNA results this looks like around 2244?).
+        for (int i = 0; i < baseLEnd; i++) {
+            basel += wave[i]/baseLEnd;
+        }
+        for (int i = 0; i < wave.size(); ++i) {
+            wave[i] -= basel;
+        }
+        //Find amplitude value and sample value for the wave.
+        amplitudeVal = maxModVal(wave);
+        sampleVal = wave[sampleNo];
+        PGAVal = abs(sampleVal - amplitudeVal);
+        //print to output
+        if (f_out.is_open()) {
+            f_out << PGAVal << endl;
+        } else {
+            cout << "Unable to open file: " + outFileName << endl;
+        }
+    }
+    f_in.close();
+    f_out.close();
+    cout<<"                       PGA Completed                    "<<endl;
+
+}
+//-------------------------------------------------------Baselines------------------------------------------------------
+//Every method takes the baseline of a waveform as the plain mean of its first baseLEnd heights. The engine can also
+//find the median and a trimmed mean of those heights, which a stray pulse in the baseline region pulls about far less,
+//and a baseline after the pulse has died away, and keeps running statistics of all of them over the run.
+//----------------------------------------------------------------------------------------------------------------------
+
+//Running mean, variance and range of a stream of values, updated one value at a time by Welford's method so that long
+//runs lose no precision, and mergeable so that partial results from separate threads can be combined.
+class RunningStats{
+public:
+    RunningStats() : n(0), mean(0.0), m2(0.0), minimum(numeric_limits<double>::infinity()),
+                     maximum(-numeric_limits<double>::infinity()){}
+    void add(double value){
+        n++;
+        double delta = value - mean;
+        mean += delta/n;
+        m2 += delta*(value - mean);
+        minimum = min(minimum, value);
+        maximum = max(maximum, value);
+    }
+    //Method to combine another set of values into this one.
+    void merge(const RunningStats &other){
+        if (other.n == 0){
+            return;
+        }
+        long long total = n + other.n;
+        double delta = other.mean - mean;
+        mean += delta*other.n/total;
+        m2 += other.m2 + delta*delta*((double)n*other.n/total);
+        n = total;
+        minimum = min(minimum, other.minimum);
+        maximum = max(maximum, other.maximum);
+    }
+    long long count() const{
+        return n;
+    }
+    double average() const{
+        return mean;
+    }
+    //Spread of the values about their mean (population standard deviation), 0 for fewer than 2 values.
+    double standardDeviation() const{
+        return (n > 1) ? sqrt(m2/n) : 0.0;
+    }
+    double smallest() const{
+        return minimum;
+    }
+    double largest() const{
+        return maximum;
+    }
+private:
+    long long n;
+    double mean, m2; //m2 is the sum of squared differences from the mean.
+    double minimum, maximum;
+};
+
+//Fraction of the baseline heights dropped from each end for the trimmed mean.
+#define PSD_BASELINE_TRIM 0.25
+
+//Which of the extra baseline estimates the engine makes for each waveform.
+struct BaselineOptions{
+    bool robust; //Whether to find the median and trimmed mean of the first baseLEnd heights.
+    double trimFraction; //Fraction of the heights dropped from each end for the trimmed mean.
+    int tailStart, tailEnd; //Samples after the pulse to take a second baseline over, none if tailEnd <= tailStart.
+};
+
+//Method to find the median and the trimmed mean, without the lowest and highest trimFraction of them, of n heights.
+//The heights are sorted in workspace, so the raw waveform is left as it is.
+template <typename Sample>
+void robustBaseline(const Sample *heights, int n, double trimFraction, vector<double> &workspace, double &median,
+                    double &trimmedMean){
+    if (n <= 0){
+        median = trimmedMean = 0.0;
+        return;
+    }
+    workspace.assign(heights, heights + n);
+    sort(workspace.begin(), workspace.end());
+    median = (n % 2 == 1) ? workspace[n/2] : 0.5*(workspace[n/2 - 1] + workspace[n/2]);
+    int trim = min((int)(trimFraction*n), (n - 1)/2);
+    double sum = 0.0;
+    for (int i=trim; i<n-trim; ++i){
+        sum += workspace[i];
+    }
+    trimmedMean = sum/(n - 2*trim);
+}
+
+//-------------------------------------------------Run Comparison Methods-----------------------------------------------
+//It's become necessary to compare various aspects of runs to determine what is causing the gradual increase in
+//neutron rates with real time. The earliest runs in real time from LUNA are dump_001_wf_0 and dump_001_wf_1.
+//----------------------------------------------------------------------------------------------------------------------
+
+//Method to calculate the average peak height for the waves for 2 runs for comparison. The baseline is first subtracted
+//from the wave, then the peak value is extracted
+void peakValAverage(string inFileName, string outFileName, int wSize, int baseLEnd){
+    vector<double> peakHeights, wave;
+    double avgHeight, basel;
+    WaveReader f_in(inFileName);
+    if(!f_in.is_open()){
+        cout<< " not found in peakValAverage with filename: " + inFileName << endl;
+    }
+    avgHeight = 0;
+    //Start reading in values.
+    while(f_in.nextWave(wave, wSize)){
+        basel = 0.0;
+        //Find and subtract the baseline for the wave
+        for(int i=0;i<baseLEnd;i++){
+            basel+=wave[i]/baseLEnd;
+        }
+        for(int i=0;i<wSize;i++){
+            wave[i]-=basel;
+        }
+        //Find maxVal for the wave.
+        peakHeights.push_back(modMaxModVal(wave));
+    }
+    f_in.close();
+    for(int i=0;i<peakHeights.size();++i){
+        avgHeight+=peakHeights[i]/peakHeights.size();
+    }
+
+    lock_guard<mutex> summaryLock(summaryFileMutex);
+    ofstream f_out(outFileName, ios::out | ios::app);
+    if (f_out.is_open()) {
+        f_out << inFileName<<" "<< avgHeight << endl;
+    } else {
+        cout << "Unable to open file: " + outFileName << endl;
+    }
+    f_out.close();
+    cout<<"                       peakValAverage Completed                    "<<endl;
+
+}
+
+
+//Method to compare the average width for the neutron region and the low non-neutron region for 2 runs.
+void regionWidthComparison(string inFileName1, string inFileName2, double lowThreshold, double highThreshold){
+    vector<double> neutronVec1, nonNeutronVec1, neutronVec2, nonNeutronVec2;
+    double width1, width2, avgNeutWidth1, avgNonWidth1, avgNeutWidth2, avgNonWidth2;
+    avgNeutWidth1 = avgNeutWidth2 = avgNonWidth1 = avgNonWidth2 = 0.0;
+    //First run
+    fstream f_in1;
+    f_in1.open(inFileName1.c_str(),std::fstream::in);
+    if(!f_in1){
+        cout<< " not found in regionWidthComparison first filename with filename: " + inFileName1 << endl;
+    }
+    //Start reading in values.
+    f_in1 >> width1;
+    while(f_in1){
+        if((width1>lowThreshold)&&(width1<highThreshold)){
+            neutronVec1.push_back(width1);
+        }else if(width1<lowThreshold){
+            nonNeutronVec1.push_back(width1);
+        }
+        f_in1 >> width1;
+    }
+    f_in1.close();
+
+    for (int i=0;i<neutronVec1.size();++i){
+        avgNeutWidth1+=neutronVec1[i];
+    }
+    avgNeutWidth1/=neutronVec1.size();
+
+    for (int i=0;i<nonNeutronVec1.size();++i){
+        avgNonWidth1+=nonNeutronVec1[i];
+    }
+    avgNonWidth1/=nonNeutronVec1.size();
+
+    //Repeat for other run.
+    fstream f_in2;
+    f_in2.open(inFileName2.c_str(),std::fstream::in);
+    if(!f_in2){
+        cout<< " not found in regionWidthComparison second filename with filename: " + inFileName2 << endl;
+    }
+    //Start reading in values.
+    f_in2 >> width2;
+    while(f_in2){
+        if((width2>lowThreshold)&&(width2<highThreshold)){
+            neutronVec2.push_back(width2);
+        }else if(width2<lowThreshold){
+            nonNeutronVec2.push_back(width2);
+        }
+        f_in2 >> width2;
+    }
+    f_in2.close();
+    //Average the values over their vectors.
+    for (int i=0;i<neutronVec2.size();++i){
+        avgNeutWidth2+=neutronVec2[i];
+    }
+    avgNeutWidth2/=neutronVec2.size();
+
+    for (int i=0;i<nonNeutronVec2.size();++i){
+        avgNonWidth2+=nonNeutronVec2[i];
+    }
+    avgNonWidth2/=nonNeutronVec2.size();
+
+    //Print em.
+    cout<<"For the input file "<<inFileName1<<" the average neutron region width is: "<<avgNeutWidth1<<endl;
+    cout<<"and the average low region non-neutron width is: "<<avgNonWidth1<<endl;
+    cout<<"For the input file "<<inFileName2<<" the average neutron region width is: "<<avgNeutWidth2<<endl;
+    cout<<"and the average low region non-neutron width is: "<<avgNonWidth2<<endl<<endl;
+    cout<<"                       regionWidthComparison Completed                    "<<endl;
+
+}
+
+//Method to sort the LUNA runs by detector.
+void sortedLUNA(string inFileName, string outFileName0, string outFileName1){
+    fstream f_in;
+    f_in.open(inFileName.c_str(),std::fstream::in);
+    if(!f_in){
+        cout<< " not found in sortedLUNA with filename: " + inFileName << endl;
+    }
+    string filename1, filename0;
+    double LUNAVal1, LUNAVal0;
+    //Start reading in values.
+    ofstream f_out0(outFileName0, ios::out | ios::app), f_out1(outFileName1, ios::out | ios::app);
+    f_in >> filename0 >> LUNAVal0 >>filename1>>LUNAVal1;
+    while(f_in){
+        if (f_out0.is_open()) {
+            f_out0 << filename0 <<" "<<LUNAVal0<<endl;
+        } else {
+            cout << "Unable to open file0 " << endl;
+        }
+        if (f_out1.is_open()) {
+            f_out1 << filename1 <<" "<<LUNAVal1<<endl;
+        } else {
+            cout << "Unable to open file1 " << endl;
+        }
+        f_in >> filename0 >> LUNAVal0 >>filename1>>LUNAVal1;
+    }
+    f_out0.close();
+    f_out1.close();
+    f_in.close();
+    cout<<"                       sortedLUNA Completed                    "<<endl;
+}
+
+
+//------------------------------------------Derived Quantities----------------------------------------------------------
+//Section to calculate the physically derived quantities of the detectors/neutrons coming through from the
+//above methods. Quantites such as flux, efficiency etc.
+//----------------------------------------------------------------------------------------------------------------------
+//Method to sort the neutron cases from the non-neutrons. Outputs the number of neutrons, non-neutrons,
+//their rates per hour and per second, total events, the neutron flux and its error in cm^-2s^-1 and the
+//difference between the rates of non-neutrons and neutrons with its error in s^-1. All derived from the
+//Widths methods above.
+
+//Neutron and non-neutron rates and the neutron flux through the detector, with their errors.
+struct WidthRates{
+    double neutRate, neutRateErr; //s^-1
+    double nonNeutRate, nonNeutRateErr; //s^-1
+    double flux, fluxError; //cm^-2s^-1
+};
+
+//Method to work out the rates and flux from the numbers of neutrons and non-neutrons counted over time seconds, known
+//to within timeError seconds.
+WidthRates widthRates(double numNeutrons, double numRejections, double time, double timeError){
+    WidthRates rates;
+    double A = EJ426DETY*EJ426DETX;
+    double AT = EJ426DETY*EJ426DETX*time;
+    rates.flux = numNeutrons/AT;
+    rates.fluxError = sqrt(numNeutrons/(AT*AT)
+                           + numNeutrons*numNeutrons*DETAREAERROR*DETAREAERROR/(AT*AT*A*A)
+                           + numNeutrons*numNeutrons*timeError*timeError/(AT*AT*time*time));
+    rates.neutRate = numNeutrons/time;
+    rates.neutRateErr = sqrt(numNeutrons*(1+numNeutrons*timeError*timeError/(time*time)))/time;
+    rates.nonNeutRate = numRejections/time;
+    rates.nonNeutRateErr = sqrt(numRejections*(1+numRejections*timeError*timeError/(time*time)))/time;
+    return rates;
+}
+
+void printWidthsDerivedQuantities(const WidthHistogram &widths, string inFileName, double lowThreshold,
+                                  double highThreshold, double time){
+    cout<<inFileName<<endl;
+    int numNeutrons = widths.countBetween(lowThreshold, highThreshold);
+    int total = widths.totalCount();
+    int numRejections = total - numNeutrons;
+
+    //calculate errors and other associated values
+    WidthRates rates = widthRates(numNeutrons, numRejections, time, TIMEERR);
+    double flux = rates.flux, fluxError = rates.fluxError;
+    double neutRateErr = rates.neutRateErr;
+    double nonNeutRateErr = rates.nonNeutRateErr;
+    double neutRateHrErr = neutRateErr*3600;
+    double nonNeutRateHrErr = nonNeutRateErr*3600;
+
+    cout<<"For the input run widths file: "<<inFileName<<endl
+    <<"which was "<<time<<"s long"<<endl
+    <<"using the low threshhold value of "<<lowThreshold<< " and a high of "<< highThreshold
+    <<" to discriminate widths, the number of neutrons is: "<<numNeutrons<<endl
+    <<"and the number of rejections is: "<<numRejections<<endl
+    <<"with a total number of events: "<<total<<endl
+    <<"this results in a calculated neutron flux, for the detector, of: "<<flux<<"cm^-2s^-1"<<endl
+    <<"with an associated error of: "<<fluxError<<"cm^-2s^-1"<<endl
+    <<"the neutron rate for this run is: "<<numNeutrons/time<<"s^-1 with an error of: "<<neutRateErr<<"s^-1" <<endl
+    <<"which, in units of hours, is: "<<numNeutrons*3600/time<<"hr^-1 with an error of: "<<neutRateHrErr<<"hr^-1" <<endl
+    <<"the non-neutron rate for this run is: "<<numRejections/time<<"s^-1 with an error of: "<<nonNeutRateErr<<"s^-1" <<endl
+    <<"which, in units of hours, is: "<<numRejections*3600/time<<"hr^-1 with an error of: "<<nonNeutRateHrErr<<"hr^-1" <<endl
+    <<"The difference between non-neutron and neutron rates is: "<<numRejections/time - numNeutrons/time<<"s^-1 with "
+    <<"error: "<<sqrt(neutRateErr*neutRateErr + nonNeutRateErr*nonNeutRateErr)<<"s^-1" <<endl;
+    cout<<"                       printWidthsDerivedQuantities Completed                    "<<endl;
+
+}
+
+//Method to do the same from a _Widths file.
+void printWidthsDerivedQuantities(string inFileName, double lowThreshold, double highThreshold, double time){
+    printWidthsDerivedQuantities(readWidthHistogram(inFileName, "printWidthsDerivedQuantities"), inFileName,
+                                 lowThreshold, highThreshold, time);
+}
+
+//Method to append the widths file name, run time and number of neutrons to outFileName.
+void printWidthsDerivedQuantitiesOutFile(const WidthHistogram &widths, string inFileName, string outFileName,
+                                         double lowThreshold, double highThreshold, double time){
+    cout<<inFileName<<endl;
+    int numNeutrons = widths.countBetween(lowThreshold, highThreshold);
+    lock_guard<mutex> summaryLock(summaryFileMutex);
+    ofstream f_out(outFileName, ios::out | ios::app);
+    if (f_out.is_open()) {
+        f_out << inFileName << " "<< time<<" "<<numNeutrons<<endl;
+    } else {
+        cout << "Unable to open file: " + outFileName << endl;
+    }
+    f_out.close();
+    cout<<"                       printWidthsDerivedQuantitiesOutFile Completed                    "<<endl;
+
+}
+
+void printWidthsDerivedQuantitiesOutFile(string inFileName, string outFileName, double lowThreshold, double highThreshold, double time){
+    printWidthsDerivedQuantitiesOutFile(readWidthHistogram(inFileName, "printWidthsDerivedQuantitiesOutFile"),
+                                        inFileName, outFileName, lowThreshold, highThreshold, time);
+}
+
+
+//Method to print out to a file the filename and the neutron rate for that run based on the thresholds given. The thresholds
+//are to be decided upon inspection of the widths files produced by the above methods.
+void WidthDerivedNeutronRate(const WidthHistogram &widths, string inFileName, string outFileName, double lowThreshold,
+                             double highThreshold, double time){
+    cout<<inFileName<<endl;
+    int numNeutrons = widths.countBetween(lowThreshold, highThreshold);
+    lock_guard<mutex> summaryLock(summaryFileMutex);
+    ofstream f_out(outFileName, ios::out | ios::app);
+    if (f_out.is_open()) {
+        f_out << inFileName <<" "<<numNeutrons/time<<endl;
+    } else {
+        cout << "Unable to open file " << endl;
+    }
+    f_out.close();
+    cout<<"For the input run widths file "<<inFileName<<" the neutron rate is: "<<numNeutrons/time<<endl;
+    cout<<"                       WidthDerivedNeutronRate Completed                    "<<endl;
+}
+
+void WidthDerivedNeutronRate(string inFileName, string outFileName, double lowThreshold, double highThreshold, double time){
+    WidthDerivedNeutronRate(readWidthHistogram(inFileName, "WidthDerivedNeutronRate"), inFileName, outFileName,
+                            lowThreshold, highThreshold, time);
+}
+
+double widthDerivedNeutronRateVal(const WidthHistogram &widths, string inFileName, double lowThreshold,
+                                  double highThreshold, double time){
+    cout<<inFileName<<endl;
+    int numNeutrons = widths.countBetween(lowThreshold, highThreshold);
+    cout<<"                       WidthDerivedNeutronRateVal Completed                    "<<endl;
+    return numNeutrons/time;
+}
+
+double widthDerivedNeutronRateVal(string inFileName, double lowThreshold, double highThreshold, double time){
+    return widthDerivedNeutronRateVal(readWidthHistogram(inFileName, "WidthDerivedNeutronRateVal"), inFileName,
+                                      lowThreshold, highThreshold, time);
+}
+
+//Method to calculate the efficiency of the detector from the number of neutrons measured by the widths method (takes in a _Widths file),
+// an orientation and the activity of the source. Will produce both the absolute and intrinsic effeciency. The input orientation must be
+// either "horizontal" or "vertical", being the largest faces of the detector facing up and down or left and right respectively.
+void WidthsDerivedEfficiencies(const WidthHistogram &widths, string inFileName, string outFileName, string orientation,
+                               double distanceInMetres, double sourceActivity, double lowThreshold, double highThreshold,
+                               double time){
+    if (!(orientation == "horizontal")&&!(orientation == "vertical")){
+        cout<<"Please enter an orientation of 'vertical' or 'horizontal'."<<endl;
+        exit(1);
+    }
+    double neutronRate = widthDerivedNeutronRateVal(widths, inFileName, lowThreshold, highThreshold, time);
+    double absoluteEfficiency = neutronRate/sourceActivity;
+    double solidAngle, detectorWidth, detectorDepth, bonusDistance, trueDistance;
+    if(orientation == "horizontal"){
+        detectorWidth = DETZ/100; //metres
+        detectorDepth = DETY/100; //metres
+    }else{
+        detectorWidth = DETY/100;
+        detectorDepth = DETZ/100;
+    }
+    bonusDistance = detectorDepth/2;
+    trueDistance = distanceInMetres + bonusDistance;
+    solidAngle = 4*atan(detectorWidth*EJ426DETX/
+                                (4*trueDistance*sqrt(detectorWidth*detectorWidth/
+                                                             4+EJ426DETX*EJ426DETX/4+trueDistance*trueDistance)));
+    double intrinsicEfficiency = absoluteEfficiency*4*M_PI/solidAngle;
+
+    lock_guard<mutex> summaryLock(summaryFileMutex);
+    ofstream f_out(outFileName, ios::out | ios::app);
+    if (f_out.is_open()) {
+        f_out << inFileName <<" "<<absoluteEfficiency<<" "<< intrinsicEfficiency<< endl;
+    } else {
+        cout << "Unable to open file: " + outFileName << endl;
+    }
+    f_out.close();
+    cout<<"                       WidthsDerivedEfficiency Completed                    "<<endl;
+}
+
+void WidthsDerivedEfficiencies(string inFileName, string outFileName, string orientation, double distanceInMetres, double sourceActivity,
+                                double lowThreshold, double highThreshold, double time){
+    WidthsDerivedEfficiencies(readWidthHistogram(inFileName, "WidthsDerivedEfficiency"), inFileName, outFileName,
+                              orientation, distanceInMetres, sourceActivity, lowThreshold, highThreshold, time);
+}
+
+
+//---------------------------------------------------Waveform Kernels---------------------------------------------------
+//The loops shared by every analysis (baseline average, baseline subtraction, the search for the largest height and the
+//window integrals) written once, with AVX2 and AVX-512 versions picked at start up on processors that support them and
+//a plain version for everything else. Sums are accumulated in several lanes, so they can differ from a simple loop in
+//the last few bits.
+//----------------------------------------------------------------------------------------------------------------------
+
+//Method to sum n values.
+double sumScalar(const double *values, int n){
+    double sum = 0.0;
+    for (int i=0; i<n; ++i){
+        sum += values[i];
+    }
+    return sum;
+}
+
+//Method to sum the squared differences of n values from mean.
+double sumSquaredDeviationScalar(const double *values, int n, double mean){
+    double sum = 0.0;
+    for (int i=0; i<n; ++i){
+        double delta = values[i] - mean;
+        sum += delta*delta;
+    }
+    return sum;
+}
+
+//Method to write raw - basel to adjusted for n values, returning their sum and raising maxAbs to the largest modulus.
+double subtractSumMaxAbsScalar(const double *raw, double *adjusted, int n, double basel, double &maxAbs){
+    double sum = 0.0;
+    for (int i=0; i<n; ++i){
+        adjusted[i] = raw[i] - basel;
+        sum += adjusted[i];
+        maxAbs = max(maxAbs, abs(adjusted[i]));
+    }
+    return sum;
+}
+
+//Method to count the n values for which polarity*value is level or more.
+template <typename Real>
+int countBeyondScalar(const Real *values, int n, double polarity, double level){
+    int count = 0;
+    for (int i=0; i<n; ++i){
+        count += (polarity*values[i] >= level);
+    }
+    return count;
+}
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define PSD_X86_SIMD
+#include <immintrin.h>
+
+__attribute__((target("avx2")))
+double sumAVX2(const double *values, int n){
+    __m256d acc0 = _mm256_setzero_pd(), acc1 = _mm256_setzero_pd();
+    int i = 0;
+    for (; i+8<=n; i+=8){
+        acc0 = _mm256_add_pd(acc0, _mm256_loadu_pd(values + i));
+        acc1 = _mm256_add_pd(acc1, _mm256_loadu_pd(values + i + 4));
+    }
+    double lanes[4];
+    _mm256_storeu_pd(lanes, _mm256_add_pd(acc0, acc1));
+    return lanes[0] + lanes[1] + lanes[2] + lanes[3] + sumScalar(values + i, n - i);
+}
+
+__attribute__((target("avx2")))
+double sumSquaredDeviationAVX2(const double *values, int n, double mean){
+    __m256d acc = _mm256_setzero_pd(), vMean = _mm256_set1_pd(mean);
+    int i = 0;
+    for (; i+4<=n; i+=4){
+        __m256d delta = _mm256_sub_pd(_mm256_loadu_pd(values + i), vMean);
+        acc = _mm256_add_pd(acc, _mm256_mul_pd(delta, delta));
+    }
+    double lanes[4];
+    _mm256_storeu_pd(lanes, acc);
+    return lanes[0] + lanes[1] + lanes[2] + lanes[3] + sumSquaredDeviationScalar(values + i, n - i, mean);
+}
+
+__attribute__((target("avx2")))
+double subtractSumMaxAbsAVX2(const double *raw, double *adjusted, int n, double basel, double &maxAbs){
+    __m256d acc = _mm256_setzero_pd(), vMax = _mm256_setzero_pd(), vBasel = _mm256_set1_pd(basel);
+    __m256d signMask = _mm256_set1_pd(-0.0);
+    int i = 0;
+    for (; i+4<=n; i+=4){
+        __m256d value = _mm256_sub_pd(_mm256_loadu_pd(raw + i), vBasel);
+        _mm256_storeu_pd(adjusted + i, value);
+        acc = _mm256_add_pd(acc, value);
+        vMax = _mm256_max_pd(vMax, _mm256_andnot_pd(signMask, value));
+    }
+    double lanes[4], maxLanes[4];
+    _mm256_storeu_pd(lanes, acc);
+    _mm256_storeu_pd(maxLanes, vMax);
+    maxAbs = max(maxAbs, max(max(maxLanes[0], maxLanes[1]), max(maxLanes[2], maxLanes[3])));
+    return lanes[0] + lanes[1] + lanes[2] + lanes[3]
+           + subtractSumMaxAbsScalar(raw + i, adjusted + i, n - i, basel, maxAbs);
+}
+
+__attribute__((target("avx2,popcnt")))
+int countBeyondAVX2(const double *values, int n, double polarity, double level){
+    __m256d vPolarity = _mm256_set1_pd(polarity), vLevel = _mm256_set1_pd(level);
+    int count = 0;
+    int i = 0;
+    for (; i+4<=n; i+=4){
+        __m256d beyond = _mm256_cmp_pd(_mm256_mul_pd(_mm256_loadu_pd(values + i), vPolarity), vLevel, _CMP_GE_OQ);
+        count += _mm_popcnt_u32(_mm256_movemask_pd(beyond));
+    }
+    return count + countBeyondScalar(values + i, n - i, polarity, level);
+}
+
+//Whole blocks of four are tested with one compare, and the sample within the block found from the bits of its mask.
+__attribute__((target("avx2")))
+void outermostAboveAVX2(const double *values, int n, double level, int &first, int &last){
+    __m256d vLevel = _mm256_set1_pd(level), signMask = _mm256_set1_pd(-0.0);
+    int end = n - n%4;
+    first = last = 0;
+    int i = 0;
+    for (; i<end; i+=4){
+        int above = _mm256_movemask_pd(_mm256_cmp_pd(_mm256_andnot_pd(signMask, _mm256_loadu_pd(values + i)), vLevel,
+                                                     _CMP_GT_OQ));
+        if (above != 0){
+            first = i + __builtin_ctz(above);
+            break;
+        }
+    }
+    if (i == end){
+        while ((i < n) && !(abs(values[i]) > level)){
+            i++;
+        }
+        if (i == n){
+            return;
+        }
+        first = i;
+    }
+    for (int j=n-1; j>=end; --j){
+        if (abs(values[j]) > level){
+            last = j;
+            return;
+        }
+    }
+    for (int j=end-4; j>=0; j-=4){
+        int above = _mm256_movemask_pd(_mm256_cmp_pd(_mm256_andnot_pd(signMask, _mm256_loadu_pd(values + j)), vLevel,
+                                                     _CMP_GT_OQ));
+        if (above != 0){
+            last = j + 31 - __builtin_clz(above);
+            return;
+        }
+    }
+}
+
+//The lanes are added through memory rather than with _mm512_reduce_add_pd, which trips uninitialised variable warnings
+//in some GCC versions.
+__attribute__((target("avx512f")))
+double addLanesAVX512(__m512d value){
+    double lanes[8];
+    _mm512_storeu_pd(lanes, value);
+    return ((lanes[0] + lanes[1]) + (lanes[2] + lanes[3])) + ((lanes[4] + lanes[5]) + (lanes[6] + lanes[7]));
+}
+
+//The sign bit is cleared by hand rather than with _mm512_abs_pd, and the maximum is taken with every lane of a zeroing
+//mask selected rather than with _mm512_max_pd, as both trip the same warnings.
+__attribute__((target("avx512f")))
+__m512d absAVX512(__m512d value){
+    return _mm512_castsi512_pd(_mm512_and_epi64(_mm512_castpd_si512(value), _mm512_set1_epi64(0x7FFFFFFFFFFFFFFF)));
+}
+
+__attribute__((target("avx512f")))
+__m512d maxAVX512(__m512d a, __m512d b){
+    return _mm512_maskz_max_pd(0xFF, a, b);
+}
+
+__attribute__((target("avx512f")))
+double maxLaneAVX512(__m512d value){
+    double lanes[8];
+    _mm512_storeu_pd(lanes, value);
+    return *max_element(lanes, lanes + 8);
+}
+
+__attribute__((target("avx512f")))
+double sumAVX512(const double *values, int n){
+    __m512d acc0 = _mm512_setzero_pd(), acc1 = _mm512_setzero_pd();
+    int i = 0;
+    for (; i+16<=n; i+=16){
+        acc0 = _mm512_add_pd(acc0, _mm512_loadu_pd(values + i));
+        acc1 = _mm512_add_pd(acc1, _mm512_loadu_pd(values + i + 8));
+    }
+    return addLanesAVX512(_mm512_add_pd(acc0, acc1)) + sumScalar(values + i, n - i);
+}
+
+__attribute__((target("avx512f")))
+double sumSquaredDeviationAVX512(const double *values, int n, double mean){
+    __m512d acc = _mm512_setzero_pd(), vMean = _mm512_set1_pd(mean);
+    int i = 0;
+    for (; i+8<=n; i+=8){
+        __m512d delta = _mm512_sub_pd(_mm512_loadu_pd(values + i), vMean);
+        acc = _mm512_fmadd_pd(delta, delta, acc);
+    }
+    return addLanesAVX512(acc) + sumSquaredDeviationScalar(values + i, n - i, mean);
+}
+
+__attribute__((target("avx512f")))
+double subtractSumMaxAbsAVX512(const double *raw, double *adjusted, int n, double basel, double &maxAbs){
+    __m512d acc = _mm512_setzero_pd(), vMax = _mm512_setzero_pd(), vBasel = _mm512_set1_pd(basel);
+    int i = 0;
+    for (; i+8<=n; i+=8){
+        __m512d value = _mm512_sub_pd(_mm512_loadu_pd(raw + i), vBasel);
+        _mm512_storeu_pd(adjusted + i, value);
+        acc = _mm512_add_pd(acc, value);
+        vMax = maxAVX512(vMax, absAVX512(value));
+    }
+    maxAbs = max(maxAbs, maxLaneAVX512(vMax));
+    return addLanesAVX512(acc) + subtractSumMaxAbsScalar(raw + i, adjusted + i, n - i, basel, maxAbs);
+}
+
+__attribute__((target("avx512f,popcnt")))
+int countBeyondAVX512(const double *values, int n, double polarity, double level){
+    __m512d vPolarity = _mm512_set1_pd(polarity), vLevel = _mm512_set1_pd(level);
+    int count = 0;
+    int i = 0;
+    for (; i+8<=n; i+=8){
+        __mmask8 beyond = _mm512_cmp_pd_mask(_mm512_mul_pd(_mm512_loadu_pd(values + i), vPolarity), vLevel,
+                                             _CMP_GE_OQ);
+        count += _mm_popcnt_u32(beyond);
+    }
+    return count + countBeyondScalar(values + i, n - i, polarity, level);
+}
+
+__attribute__((target("avx512f")))
+void outermostAboveAVX512(const double *values, int n, double level, int &first, int &last){
+    __m512d vLevel = _mm512_set1_pd(level);
+    int end = n - n%8;
+    first = last = 0;
+    int i = 0;
+    for (; i<end; i+=8){
+        unsigned int above = _mm512_cmp_pd_mask(absAVX512(_mm512_loadu_pd(values + i)), vLevel, _CMP_GT_OQ);
+        if (above != 0){
+            first = i + __builtin_ctz(above);
+            break;
+        }
+    }
+    if (i == end){
+        while ((i < n) && !(abs(values[i]) > level)){
+            i++;
+        }
+        if (i == n){
+            return;
+        }
+        first = i;
+    }
+    for (int j=n-1; j>=end; --j){
+        if (abs(values[j]) > level){
+            last = j;
+            return;
+        }
+    }
+    for (int j=end-8; j>=0; j-=8){
+        unsigned int above = _mm512_cmp_pd_mask(absAVX512(_mm512_loadu_pd(values + j)), vLevel, _CMP_GT_OQ);
+        if (above != 0){
+            last = j + 31 - __builtin_clz(above);
+            return;
+        }
+    }
+}
+#endif
+
+//The set of kernels in use, chosen once by selectKernels.
+struct WaveKernels{
+    const char *name;
+    double (*sum)(const double *values, int n);
+    double (*sumSquaredDeviation)(const double *values, int n, double mean);
+    double (*subtractSumMaxAbs)(const double *raw, double *adjusted, int n, double basel, double &maxAbs);
+    int (*countBeyond)(const double *values, int n, double polarity, double level);
+    void (*outermostAbove)(const double *values, int n, double level, int &first, int &last);
+};
+
+//Method to pick the widest kernels the processor supports. Setting the environment variable PSD_KERNELS to "scalar"
+//or "avx2" limits the choice, for comparing results and timings.
+WaveKernels selectKernels(){
+    WaveKernels kernels = {"scalar", sumScalar, sumSquaredDeviationScalar, subtractSumMaxAbsScalar,
+                           countBeyondScalar<double>, outermostAboveScalar<double>};
+#ifdef PSD_X86_SIMD
+    const char *limit = getenv("PSD_KERNELS");
+    string choice = (limit == NULL) ? "" : limit;
+    if (choice == "scalar"){
+        return kernels;
+    }
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f") && (choice != "avx2")){
+        WaveKernels avx512 = {"avx512", sumAVX512, sumSquaredDeviationAVX512, subtractSumMaxAbsAVX512,
+                              countBeyondAVX512, outermostAboveAVX512};
+        return avx512;
+    }
+    if (__builtin_cpu_supports("avx2")){
+        WaveKernels avx2 = {"avx2", sumAVX2, sumSquaredDeviationAVX2, subtractSumMaxAbsAVX2, countBeyondAVX2,
+                            outermostAboveAVX2};
+        return avx2;
+    }
+#endif
+    return kernels;
+}
+
+const WaveKernels waveKernels = selectKernels();
+
+//Method to find the index of the first value whose modulus is maxAbs, so that adjusted[index] is the same value
+//maxModVal returns.
+template <typename Real>
+int firstIndexOfAbs(const Real *values, int n, double maxAbs){
+    for (int i=0; i<n; ++i){
+        if (abs(values[i]) == maxAbs){
+            return i;
+        }
+    }
+    return 0;
+}
+
+//The same loops for the narrower sample types. The heights are summed in SampleTraits<Sample>::Sum, which is exact for
+//integer samples, and the adjusted heights are (Real)raw - (Real)basel, so every kernel for a type gives the same
+//adjusted heights and the same maxAbs.
+template <typename Sample>
+double sumSamples(const Sample *values, int n){
+    typename SampleTraits<Sample>::Sum sum = 0;
+    for (int i=0; i<n; ++i){
+        sum += values[i];
+    }
+    return sum;
+}
+
+template <typename Sample>
+double sumSquaredDeviationSamples(const Sample *values, int n, double mean){
+    double sum = 0.0;
+    for (int i=0; i<n; ++i){
+        double delta = values[i] - mean;
+        sum += delta*delta;
+    }
+    return sum;
+}
+
+template <typename Sample>
+double subtractSumMaxAbsSamples(const Sample *raw, typename SampleTraits<Sample>::Real *adjusted, int n, double basel,
+                                double &maxAbs){
+    typedef typename SampleTraits<Sample>::Real Real;
+    typename SampleTraits<Sample>::Sum sum = 0;
+    Real base = (Real)basel, largest = (Real)maxAbs;
+    for (int i=0; i<n; ++i){
+        sum += raw[i];
+        adjusted[i] = (Real)raw[i] - base;
+        largest = max(largest, (Real)abs(adjusted[i]));
+    }
+    maxAbs = largest;
+    return (double)sum - n*basel;
+}
+
+#ifdef PSD_X86_SIMD
+//16 bit samples widened 8 at a time to 32 bit integers for the sum and to floats for the adjusted heights.
+__attribute__((target("avx2")))
+double subtractSumMaxAbsInt16AVX2(const int16_t *raw, float *adjusted, int n, double basel, double &maxAbs){
+    __m256 vBasel = _mm256_set1_ps((float)basel), vMax = _mm256_set1_ps((float)maxAbs);
+    __m256 signMask = _mm256_set1_ps(-0.0f);
+    int64_t sum = 0;
+    int i = 0;
+    while (i+8<=n){
+        //Each lane gains at most 2^15 a step, so the lanes are emptied every 2^15 steps, well before they can overflow.
+        int blockEnd = i + 8*min((n - i)/8, 1<<15);
+        __m256i acc = _mm256_setzero_si256();
+        for (; i<blockEnd; i+=8){
+            __m256i value = _mm256_cvtepi16_epi32(_mm_loadu_si128((const __m128i*)(raw + i)));
+            acc = _mm256_add_epi32(acc, value);
+            __m256 height = _mm256_sub_ps(_mm256_cvtepi32_ps(value), vBasel);
+            _mm256_storeu_ps(adjusted + i, height);
+            vMax = _mm256_max_ps(vMax, _mm256_andnot_ps(signMask, height));
+        }
+        int32_t lanes[8];
+        _mm256_storeu_si256((__m256i*)lanes, acc);
+        for (int j=0; j<8; ++j){
+            sum += lanes[j];
+        }
+    }
+    float maxLanes[8];
+    _mm256_storeu_ps(maxLanes, vMax);
+    for (int j=0; j<8; ++j){
+        maxAbs = max(maxAbs, (double)maxLanes[j]);
+    }
+    return ((double)sum - i*basel) + subtractSumMaxAbsSamples(raw + i, adjusted + i, n - i, basel, maxAbs);
+}
+#endif
+
+//The kernels in use for one sample type, chosen once by sampleKernels.
+template <typename Sample>
+struct SampleKernels{
+    double (*sum)(const Sample *values, int n);
+    double (*sumSquaredDeviation)(const Sample *values, int n, double mean);
+    double (*subtractSumMaxAbs)(const Sample *raw, typename SampleTraits<Sample>::Real *adjusted, int n, double basel,
+                                double &maxAbs);
+};
+
+//Method to pick the kernels for a sample type. Doubles use waveKernels, 16 bit samples have their own AVX2 kernel
+//whenever waveKernels is not limited to scalar, and everything else uses the loops above.
+template <typename Sample>
+SampleKernels<Sample> selectSampleKernels(){
+    SampleKernels<Sample> kernels = {sumSamples<Sample>, sumSquaredDeviationSamples<Sample>,
+                                     subtractSumMaxAbsSamples<Sample>};
+    return kernels;
+}
+
+template <>
+SampleKernels<double> selectSampleKernels<double>(){
+    SampleKernels<double> kernels = {waveKernels.sum, waveKernels.sumSquaredDeviation, waveKernels.subtractSumMaxAbs};
+    return kernels;
+}
+
+template <>
+SampleKernels<int16_t> selectSampleKernels<int16_t>(){
+    SampleKernels<int16_t> kernels = {sumSamples<int16_t>, sumSquaredDeviationSamples<int16_t>,
+                                      subtractSumMaxAbsSamples<int16_t>};
+#ifdef PSD_X86_SIMD
+    if (string(waveKernels.name) != "scalar"){
+        kernels.subtractSumMaxAbs = subtractSumMaxAbsInt16AVX2;
+    }
+#endif
+    return kernels;
+}
+
+template <typename Sample>
+const SampleKernels<Sample> &sampleKernels(){
+    static const SampleKernels<Sample> kernels = selectSampleKernels<Sample>();
+    return kernels;
+}
+
+//------------------------------------------------------Profiling-------------------------------------------------------
+//With --profile, each run records the time its threads spend in each stage of the analysis, along with counts of the
+//waveforms, samples, bytes and rejections, and writes them out as JSON or as a line of CSV. Each thread adds to its own
+//StageTimes through threadStageTimes, so the timers take no locks, and with profiling off that pointer is NULL and a
+//timer costs a single test.
+//----------------------------------------------------------------------------------------------------------------------
+
+#define PSD_PROFILE_NONE 0
+#define PSD_PROFILE_JSON 1
+#define PSD_PROFILE_CSV 2
+
+//Stages of a run that are timed.
+#define PSD_STAGE_NONE -1 //Time that is not counted, such as waiting on another thread.
+#define PSD_STAGE_READ 0 //Parsing or decoding the waveforms.
+#define PSD_STAGE_BASELINE 1 //Baselines, subtraction and the window integrals.
+#define PSD_STAGE_FLAGS 2 //Pile-up, saturation and baseline excursion checks.
+#define PSD_STAGE_WIDTH 3 //Width search.
+#define PSD_STAGE_FEATURES 4 //Rise times, gates and PGA.
+#define PSD_STAGE_OUTPUT 5 //Consumers writing the output files.
+#define PSD_STAGE_DERIVED 6 //Derived quantities worked out after the pass.
+#define PSD_NUM_STAGES 7
+
+//Quantities counted.
+#define PSD_COUNT_WAVES 0
+#define PSD_COUNT_SAMPLES 1
+#define PSD_COUNT_REJECTED 2
+#define PSD_COUNT_PILEUP 3
+#define PSD_COUNT_SATURATED 4
+#define PSD_COUNT_BASELINE 5
+#define PSD_NUM_COUNTS 6
+
+const char *stageNames[PSD_NUM_STAGES] = {"read", "baseline", "flags", "width", "features", "output", "derived"};
+const char *countNames[PSD_NUM_COUNTS] = {"waveforms", "samples", "rejected", "pileup", "saturated",
+                                          "baseline_excursions"};
+
+//Times and counts added up by one thread.
+struct StageTimes{
+    long long nanoseconds[PSD_NUM_STAGES];
+    long long calls[PSD_NUM_STAGES];
+    long long counts[PSD_NUM_COUNTS];
+};
+
+//The calling thread's StageTimes, or NULL if it is not being profiled.
+thread_local StageTimes *threadStageTimes = NULL;
+
+//Times the calling thread as it moves from one stage to the next. Each call to next ends the current stage and starts
+//another, so that back to back stages need only one reading of the clock between them, and the last stage ends when
+//the clock goes out of scope.
+class StageClock{
+public:
+    StageClock(int stage) : times(threadStageTimes), stage(stage){
+        if (times != NULL){
+            last = chrono::steady_clock::now();
+        }
+    }
+    ~StageClock(){
+        next(PSD_STAGE_NONE);
+    }
+    void next(int nextStage){
+        if (times == NULL){
+            return;
+        }
+        chrono::steady_clock::time_point now = chrono::steady_clock::now();
+        if (stage != PSD_STAGE_NONE){
+            times->nanoseconds[stage] += chrono::duration_cast<chrono::nanoseconds>(now - last).count();
+            times->calls[stage]++;
+        }
+        stage = nextStage;
+        last = now;
+    }
+private:
+    StageTimes *times;
+    int stage;
+    chrono::steady_clock::time_point last;
+};
+
+//Method to add to one of the calling thread's counts, if it is being profiled.
+inline void profileCount(int counter, long long amount = 1){
+    if (threadStageTimes != NULL){
+        threadStageTimes->counts[counter] += amount;
+    }
+}
+
+//Times and counts for one run, gathered from every thread that worked on it.
+class RunProfile{
+public:
+    RunProfile(string runName, int numThreads)
+            : runName(runName), numThreads(numThreads), bytesRead(0), start(chrono::steady_clock::now()),
+              wallSeconds(0){}
+    //Method to give the calling thread a StageTimes of its own to add to. The deque keeps earlier ones where they are.
+    StageTimes *addThread(){
+        lock_guard<mutex> lock(threadsMutex);
+        threads.emplace_back();
+        memset(&threads.back(), 0, sizeof(StageTimes));
+        return &threads.back();
+    }
+    void addBytesRead(long long bytes){
+        bytesRead += bytes;
+    }
+    //Method to stop the clock for the whole run and add up the threads' times and counts.
+    void finish(){
+        wallSeconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+        lock_guard<mutex> lock(threadsMutex);
+        memset(&total, 0, sizeof(total));
+        for (const StageTimes &times : threads){
+            for (int s=0; s<PSD_NUM_STAGES; ++s){
+                total.nanoseconds[s] += times.nanoseconds[s];
+                total.calls[s] += times.calls[s];
+            }
+            for (int c=0; c<PSD_NUM_COUNTS; ++c){
+                total.counts[c] += times.counts[c];
+            }
+        }
+    }
+    //Method to print the rates and the share of the thread time spent in each stage.
+    void print() const{
+        double stageSeconds = 0;
+        for (int s=0; s<PSD_NUM_STAGES; ++s){
+            stageSeconds += total.nanoseconds[s]*1e-9;
+        }
+        cout << "Profile of " << runName << ": " << wallSeconds << "s, " << total.counts[PSD_COUNT_WAVES]/wallSeconds
+             << " waveforms/s, " << total.counts[PSD_COUNT_SAMPLES]/wallSeconds << " samples/s, "
+             << bytesRead/wallSeconds/1e6 << " MB/s, " << total.counts[PSD_COUNT_REJECTED] << " rejected" << endl;
+        for (int s=0; s<PSD_NUM_STAGES; ++s){
+            cout << "    " << stageNames[s] << ": " << total.nanoseconds[s]*1e-9 << "s";
+            if (stageSeconds > 0){
+                cout << " (" << round(1000*total.nanoseconds[s]*1e-9/stageSeconds)/10 << "%)";
+            }
+            cout << endl;
+        }
+    }
+    //Method to write the profile as a JSON object. The stage times are summed over the threads.
+    void writeJSON(string outFileName) const{
+        ofstream f_out(outFileName);
+        if (!f_out.is_open()) {
+            cout << "Unable to open file: " + outFileName << endl;
+            return;
+        }
+        string escaped;
+        for (char c : runName){
+            if ((c == '"') || (c == '\\')){
+                escaped += '\\';
+            }
+            escaped += c;
+        }
+        f_out << "{" << endl;
+        f_out << "  \"run\": \"" << escaped << "\"," << endl;
+        f_out << "  \"threads\": " << numThreads << "," << endl;
+        f_out << "  \"wall_seconds\": " << wallSeconds << "," << endl;
+        f_out << "  \"bytes_read\": " << bytesRead << "," << endl;
+        for (int c=0; c<PSD_NUM_COUNTS; ++c){
+            f_out << "  \"" << countNames[c] << "\": " << total.counts[c] << "," << endl;
+        }
+        f_out << "  \"waveforms_per_second\": " << total.counts[PSD_COUNT_WAVES]/wallSeconds << "," << endl;
+        f_out << "  \"samples_per_second\": " << total.counts[PSD_COUNT_SAMPLES]/wallSeconds << "," << endl;
+        f_out << "  \"bytes_per_second\": " << bytesRead/wallSeconds << "," << endl;
+        f_out << "  \"stages\": {" << endl;
+        for (int s=0; s<PSD_NUM_STAGES; ++s){
+            f_out << "    \"" << stageNames[s] << "\": {\"seconds\": " << total.nanoseconds[s]*1e-9 << ", \"calls\": "
+                  << total.calls[s] << "}" << ((s+1 < PSD_NUM_STAGES) ? "," : "") << endl;
+        }
+        f_out << "  }" << endl;
+        f_out << "}" << endl;
+        f_out.close();
+    }
+    //Method to append the profile as a line of CSV, with a header line first if the file is new.
+    void appendCSV(string outFileName) const{
+        lock_guard<mutex> summaryLock(summaryFileMutex);
+        ifstream existing(outFileName, ios::in | ios::ate);
+        bool isNew = !existing.is_open() || (existing.tellg() <= 0);
+        existing.close();
+        ofstream f_out(outFileName, ios::out | ios::app);
+        if (!f_out.is_open()) {
+            cout << "Unable to open file: " + outFileName << endl;
+            return;
+        }
+        if (isNew){
+            f_out << "run,threads,wall_seconds,bytes_read";
+            for (int c=0; c<PSD_NUM_COUNTS; ++c){
+                f_out << "," << countNames[c];
+            }
+            f_out << ",waveforms_per_second,samples_per_second,bytes_per_second";
+            for (int s=0; s<PSD_NUM_STAGES; ++s){
+                f_out << "," << stageNames[s] << "_seconds";
+            }
+            f_out << endl;
+        }
+        f_out << runName << "," << numThreads << "," << wallSeconds << "," << bytesRead;
+        for (int c=0; c<PSD_NUM_COUNTS; ++c){
+            f_out << "," << total.counts[c];
+        }
+        f_out << "," << total.counts[PSD_COUNT_WAVES]/wallSeconds << "," << total.counts[PSD_COUNT_SAMPLES]/wallSeconds
+              << "," << bytesRead/wallSeconds;
+        for (int s=0; s<PSD_NUM_STAGES; ++s){
+            f_out << "," << total.nanoseconds[s]*1e-9;
+        }
+        f_out << endl;
+        f_out.close();
+    }
+private:
+    string runName;
+    int numThreads;
+    atomic<long long> bytesRead;
+    chrono::steady_clock::time_point start;
+    double wallSeconds;
+    mutex threadsMutex;
+    deque<StageTimes> threads;
+    StageTimes total;
+};
+
+//Points the calling thread's timers at a StageTimes of its own in profile for as long as it is in scope. Does nothing
+//if profile is NULL.
+class ProfileThread{
+public:
+    ProfileThread(RunProfile *profile) : previous(threadStageTimes){
+        if (profile != NULL){
+            threadStageTimes = profile->addThread();
+        }
+    }
+    ~ProfileThread(){
+        threadStageTimes = previous;
+    }
+private:
+    StageTimes *previous;
+};
+
+//-----------------------------------------------Single Pass Analysis---------------------------------------------------
+//Each of the methods above opens and parses the raw waveform file for itself, so a full run used to read the same file
+//around a dozen times. The engine below reads each waveform once, calculates the quantities all of the methods need and
+//hands the waveform to a list of consumers, each of which writes one of the usual output files.
+//----------------------------------------------------------------------------------------------------------------------
+
+//Reasons a waveform can be flagged before the pulse shape analysis. A waveform with any of the flags being rejected is
+//left out of the widths, integrals, PGA, rise times and gates.
+#define PSD_FLAG_PILEUP 1 //A second pulse, separated from the first by a return to the baseline.
+#define PSD_FLAG_SATURATED 2 //The pulse is clipped flat at its peak by the ADC.
+#define PSD_FLAG_BASELINE 4 //A pulse or spike in the baseline region, so the baseline itself is off.
+#define PSD_FLAG_ALL 7
+//A second pulse must reach this fraction of the largest height (and PSD_PILEUP_SIGMA deviations of the baseline), and
+//the waveform must have stayed below a tenth of the largest height (and 3 deviations) for PSD_PILEUP_GAP of the
+//waveform's length in between. The gap keeps the bursts of light from a single neutron from being counted as pile-up.
+#define PSD_PILEUP_FRACTION 0.3
+#define PSD_PILEUP_SIGMA 5.0
+#define PSD_PILEUP_GAP 0.02
+void outermostAbove(const double *values, int n, double level, int &first, int &last){
+    waveKernels.outermostAbove(values, n, level, first, last);
+}
+
+//Number of identical heights in a row at the peak that mark a clipped pulse, if they are at the full scale of the
+//digitiser or of the sample type. Slow pulses often have a few equal heights at an unclipped peak.
+#define PSD_SATURATION_SAMPLES 4
+//A height in the baseline region further than this fraction of the largest height, and PSD_EXCURSION_SIGMA
+//deviations, from the baseline is an excursion.
+#define PSD_EXCURSION_FRACTION 0.2
+#define PSD_EXCURSION_SIGMA 4.0
+
+//Method to count the adjusted heights for which polarity*height is level or more, with the kernels for doubles.
+int countBeyond(const double *adjusted, int n, double polarity, double level){
+    return waveKernels.countBeyond(adjusted, n, polarity, level);
+}
+
+int countBeyond(const float *adjusted, int n, double polarity, double level){
+    return countBeyondScalar(adjusted, n, polarity, level);
+}
+
+//Method to count the separate pulses in a baseline adjusted waveform: rises to high or beyond, in the direction of
+//polarity, each after at least gap samples below low. peakIndex is the largest height, which must be beyond high if
+//any height is.
+template <typename Real>
+int countPulses(const Real *adjusted, int n, int peakIndex, double polarity, double high, double low, int gap){
+    //Almost every waveform has a single run of heights beyond high, around its peak. That is checked by counting the
+    //heights beyond high with the kernels and comparing with the length of the run around peakIndex. Only waveforms
+    //with heights beyond high elsewhere need the slower scan for returns to the baseline.
+    int numBeyond = countBeyond(adjusted, n, polarity, high);
+    if (numBeyond == 0){
+        return 0;
+    }
+    int start = peakIndex, end = peakIndex;
+    while ((start > 0) && (polarity*adjusted[start - 1] >= high)){
+        start--;
+    }
+    while ((end < n) && (polarity*adjusted[end] >= high)){
+        end++;
+    }
+    if (end - start == numBeyond){
+        return 1;
+    }
+    int numPulses = 0;
+    int quiet = gap; //Samples in a row below low, so a pulse at the very start counts.
+    for (int i=0; i<n; ++i){
+        double height = polarity*adjusted[i];
+        if (height >= high){
+            if (quiet >= gap){
+                numPulses++;
+            }
+            quiet = 0;
+        }else if (height < low){
+            quiet++;
+        }else{
+            quiet = 0;
+        }
+    }
+    return numPulses;
+}
+
+//Method to count how many raw heights in a row, around peakIndex, are the same as the height at peakIndex.
+template <typename Sample>
+int flatTopLength(const Sample *raw, int n, int peakIndex){
+    int start = peakIndex, end = peakIndex + 1;
+    while ((start > 0) && (raw[start - 1] == raw[peakIndex])){
+        start--;
+    }
+    while ((end < n) && (raw[end] == raw[peakIndex])){
+        end++;
+    }
+    return end - start;
+}
+
+//Version of what analyseWave works out. It is part of the key of every feature store, so stores written by an older
+//analysis are read again rather than replayed. Add one whenever a change alters any feature or flag.
+#define PSD_ANALYSIS_VERSION 1
+
+//Parameters shared by all of the analyses of a run.
+struct AnalysisParams{
+    int wSize; //Number of points in the waveform.
+    int baseLEnd; //Point up to which only the baseline is present.
+    double threshold; //Fraction of the maximum height at which the width is measured, 0.5 for the FWHM.
+    int wStart; //Start of the total integral window.
+    int wEnd; //End of the total integral window.
+    int peakXValue; //End of the peak integral window.
+    int tailEndXVal; //End of the tail integral window.
+    int PGASampleVal; //Sample value for the PGA method.
+    int sampleType; //PSD_SAMPLES_ type the heights are held as.
+    int widthMethod; //PSD_WIDTH_ search used for the width.
+    bool interpolateWidth; //Whether the width is measured between interpolated crossings rather than whole samples.
+    vector<RisetimeThresholds> risetimes; //Pairs of fractions to measure integral rise times between, if any.
+    GateSet gates; //Charge comparison gates, if any.
+    BaselineOptions baselines; //Extra baseline estimates to make, if any.
+    int rejectFlags; //PSD_FLAG_ reasons, combined with |, for leaving a waveform out of the pulse shape analysis.
+    double adcMin, adcMax; //Full scale codes of the digitiser, or -/+infinity if they are not known.
+};
+
+//A waveform as read from the file and the quantities calculated from it by analyseWave. The heights themselves are
+//held in a WaveBuffer of the run's sample type, and rawAt and adjustedAt read them back as doubles.
+struct Waveform{
+    int index; //Position of the waveform in the file, counting from 0.
+    int size; //Number of heights.
+    int sampleType; //PSD_SAMPLES_ type of raw. adjusted is double for PSD_SAMPLES_DOUBLE and float otherwise.
+    const void *raw; //Heights as read from the file.
+    const void *adjusted; //Heights with the baseline subtracted.
+    double basel; //Average of the first baseLEnd heights.
+    double deviation; //RMS deviation from the baseline over the first baseLEnd heights.
+    double baselMedian; //Median of the first baseLEnd heights, if AnalysisParams::baselines.robust is set.
+    double baselTrimmed; //Trimmed mean of the first baseLEnd heights, if AnalysisParams::baselines.robust is set.
+    double tailBasel; //Average of the heights in the baselines tail window, if there is one.
+    double tailDeviation; //RMS deviation from tailBasel over the tail window.
+    int flags; //PSD_FLAG_ reasons found for the waveform, combined with |.
+    bool rejected; //Whether any of flags are in AnalysisParams::rejectFlags, in which case the width, PGA, rise times
+                   //and gates are not worked out.
+    double maxVal; //Baseline adjusted height furthest from 0.
+    double width; //Width of the pulse at threshold*maxVal, in samples. Whole unless interpolateWidth is set.
+    double totalInt; //Integral from wStart to wEnd.
+    double peak; //Integral up to peakXValue.
+    double tail; //Integral from peakXValue to tailEndXVal.
+    double PGAVal; //Difference between the amplitude and the value at PGASampleVal.
+    int peakIndex; //Sample at which maxVal is found.
+    int numRisetimes; //One for each pair of thresholds in AnalysisParams::risetimes.
+    const double *risetimes; //Integral rise times, in samples.
+    int numGates; //One for each gate in AnalysisParams::gates.
+    const double *gateSums; //Integrals over the gates.
+
+    double rawAt(int i) const{
+        if (sampleType == PSD_SAMPLES_FLOAT){
+            return ((const float*)raw)[i];
+        }else if (sampleType == PSD_SAMPLES_INT32){
+            return ((const int32_t*)raw)[i];
+        }else if (sampleType == PSD_SAMPLES_INT16){
+            return ((const int16_t*)raw)[i];
+        }
+        return ((const double*)raw)[i];
+    }
+    double adjustedAt(int i) const{
+        return (sampleType == PSD_SAMPLES_DOUBLE) ? ((const double*)adjusted)[i] : ((const float*)adjusted)[i];
+    }
+};
+
+//Storage for the heights of one waveform of a given sample type, along with its analysed Waveform.
+template <typename Sample>
+struct WaveBuffer{
+    vector<Sample> raw;
+    vector<typename SampleTraits<Sample>::Real> adjusted;
+    vector<double> risetimes;
+    vector<double> risetimeWorkspace;
+    vector<double> gateSums;
+    vector<double> prefix;
+    vector<double> baselineWorkspace;
+    Waveform wave;
+};
+
+//Method to calculate everything the consumers need from a waveform. The calculations are the same as in the individual
+//methods above, with the width found by findPulseEdges using params.widthMethod.
+//After the baseline, one fused pass subtracts it, finds the largest height and sums the waveform between each pair of
+//integration limits, and the integrals are put together from those sums.
+template <typename Sample>
+void analyseWave(WaveBuffer<Sample> &buffer, const AnalysisParams &params){
+    typedef typename SampleTraits<Sample>::Real Real;
+    const SampleKernels<Sample> &kernels = sampleKernels<Sample>();
+    Waveform &wave = buffer.wave;
+    int size = buffer.raw.size();
+    const Sample *raw = buffer.raw.data();
+    wave.size = size;
+    wave.sampleType = SampleTraits<Sample>::type;
+    wave.raw = raw;
+    StageClock clock(PSD_STAGE_BASELINE);
+    //Baseline and its deviation.
+    wave.basel = kernels.sum(raw, params.baseLEnd)/params.baseLEnd;
+    wave.deviation = sqrt(kernels.sumSquaredDeviation(raw, params.baseLEnd, wave.basel)/params.baseLEnd);
+    //Median and trimmed mean of the baseline, and the baseline after the pulse.
+    wave.baselMedian = wave.baselTrimmed = wave.basel;
+    if (params.baselines.robust){
+        robustBaseline(raw, min(params.baseLEnd, size), params.baselines.trimFraction, buffer.baselineWorkspace,
+                       wave.baselMedian, wave.baselTrimmed);
+    }
+    int tailStart = max(params.baselines.tailStart, 0), tailEnd = min(params.baselines.tailEnd, size);
+    wave.tailBasel = wave.tailDeviation = 0.0;
+    if (tailEnd > tailStart){
+        wave.tailBasel = kernels.sum(raw + tailStart, tailEnd - tailStart)/(tailEnd - tailStart);
+        wave.tailDeviation = sqrt(kernels.sumSquaredDeviation(raw + tailStart, tailEnd - tailStart, wave.tailBasel)
+                                  /(tailEnd - tailStart));
+    }
+    //Subtract the baseline, one segment between integration limits at a time.
+    int limits[] = {0, params.baseLEnd, params.wStart, params.wEnd, params.peakXValue, params.peakXValue+1,
+                    params.tailEndXVal, size};
+    int numLimits = sizeof(limits)/sizeof(limits[0]);
+    for (int i=0; i<numLimits; ++i){
+        limits[i] = min(max(limits[i], 0), size);
+    }
+    sort(limits, limits + numLimits);
+    buffer.adjusted.resize(size);
+    const Real *adjusted = buffer.adjusted.data();
+    wave.adjusted = adjusted;
+    double maxAbs = 0.0, baselineMaxAbs = 0.0;
+    wave.totalInt = wave.peak = wave.tail = 0.0;
+    for (int i=0; i+1<numLimits; ++i){
+        int start = limits[i], end = limits[i+1];
+        if (start == end){
+            continue;
+        }
+        double segmentMaxAbs = 0.0;
+        double segment = kernels.subtractSumMaxAbs(raw + start, buffer.adjusted.data() + start, end - start, wave.basel,
+                                                   segmentMaxAbs);
+        maxAbs = max(maxAbs, segmentMaxAbs);
+        if (end <= params.baseLEnd){
+            baselineMaxAbs = max(baselineMaxAbs, segmentMaxAbs);
+        }
+        if ((start >= params.wStart) && (end <= params.wEnd)){
+            wave.totalInt += segment;
+        }
+        if (end <= params.peakXValue){
+            wave.peak += segment;
+        }
+        if ((start > params.peakXValue) && (end <= params.tailEndXVal)){
+            wave.tail += segment;
+        }
+    }
+    int peakIndex = firstIndexOfAbs(adjusted, size, maxAbs);
+    wave.maxVal = (size > 0) ? adjusted[peakIndex] : 0.0;
+    wave.peakIndex = peakIndex;
+    //Pile-up, clipping and baseline excursions. Rejected waveforms go no further.
+    clock.next(PSD_STAGE_FLAGS);
+    wave.flags = 0;
+    if (size > 0){
+        double polarity = (wave.maxVal < 0) ? -1.0 : 1.0;
+        int gap = max(1, (int)(PSD_PILEUP_GAP*size));
+        double high = max(PSD_PILEUP_FRACTION*maxAbs, PSD_PILEUP_SIGMA*wave.deviation);
+        double low = max(0.1*maxAbs, 3.0*wave.deviation);
+        if (countPulses(adjusted, size, peakIndex, polarity, high, low, gap) > 1){
+            wave.flags |= PSD_FLAG_PILEUP;
+        }
+        double lowestCode = max(params.adcMin, (double)numeric_limits<Sample>::lowest());
+        double highestCode = min(params.adcMax, (double)numeric_limits<Sample>::max());
+        bool atFullScale = (raw[peakIndex] <= lowestCode) || (raw[peakIndex] >= highestCode);
+        if (atFullScale && (flatTopLength(raw, size, peakIndex) >= PSD_SATURATION_SAMPLES)){
+            wave.flags |= PSD_FLAG_SATURATED;
+        }
+        if (baselineMaxAbs > max(PSD_EXCURSION_FRACTION*maxAbs, PSD_EXCURSION_SIGMA*wave.deviation)){
+            wave.flags |= PSD_FLAG_BASELINE;
+        }
+    }
+    wave.rejected = (wave.flags & params.rejectFlags) != 0;
+    if (threadStageTimes != NULL){
+        threadStageTimes->counts[PSD_COUNT_WAVES]++;
+        threadStageTimes->counts[PSD_COUNT_SAMPLES] += size;
+        threadStageTimes->counts[PSD_COUNT_REJECTED] += wave.rejected;
+        threadStageTimes->counts[PSD_COUNT_PILEUP] += (wave.flags & PSD_FLAG_PILEUP) != 0;
+        threadStageTimes->counts[PSD_COUNT_SATURATED] += (wave.flags & PSD_FLAG_SATURATED) != 0;
+        threadStageTimes->counts[PSD_COUNT_BASELINE] += (wave.flags & PSD_FLAG_BASELINE) != 0;
+    }
+    if (wave.rejected){
+        wave.width = wave.PGAVal = 0.0;
+        wave.numRisetimes = wave.numGates = 0;
+        wave.risetimes = buffer.risetimes.data();
+        wave.gateSums = buffer.gateSums.data();
+        return;
+    }
+    //Width.
+    clock.next(PSD_STAGE_WIDTH);
+    PulseEdges edges = findPulseEdges(adjusted, size, params.threshold*abs(wave.maxVal), peakIndex, params.widthMethod,
+                                      params.interpolateWidth);
+    wave.width = edges.highCrossing - edges.lowCrossing;
+    //Integral rise times.
+    clock.next(PSD_STAGE_FEATURES);
+    buffer.risetimes.resize(params.risetimes.size());
+    if (!params.risetimes.empty()){
+        integralRisetimes(adjusted, size, params.risetimes, buffer.risetimeWorkspace, buffer.risetimes.data());
+    }
+    wave.numRisetimes = buffer.risetimes.size();
+    wave.risetimes = buffer.risetimes.data();
+    //Charge comparison gates, measured from the peak and from the onset found by walking back from it.
+    buffer.gateSums.resize(params.gates.gates.size());
+    if (!params.gates.gates.empty()){
+        int onset = findPulseEdges(adjusted, size, params.gates.onsetFraction*abs(wave.maxVal), peakIndex,
+                                   PSD_WIDTH_FROM_PEAK, false).low;
+        evaluateGates(adjusted, size, params.gates, onset, peakIndex, buffer.prefix, buffer.gateSums.data());
+    }
+    wave.numGates = buffer.gateSums.size();
+    wave.gateSums = buffer.gateSums.data();
+    //PGA.
+    wave.PGAVal = abs(adjusted[params.PGASampleVal] - wave.maxVal);
+}
+
+//Base class for anything that takes the analysed waveforms from the engine.
+class WaveConsumer{
+public:
+    virtual ~WaveConsumer(){}
+    //Called once for every waveform, in the order they appear in the file.
+    virtual void processWave(const Waveform &wave) = 0;
+    //Called once all of the waveforms have been read.
+    virtual void finish(){}
+};
+
+//Counts the widths, as the Widths method, into a WidthHistogram for the derived quantities. The _Widths.txt file is
+//only written when writeFile is set.
+class WidthsConsumer : public WaveConsumer{
+public:
+    WidthsConsumer(string outFileName, int wSize, bool writeFile = true, int format = PSD_OUTPUT_TEXT)
+            : outFileName(outputFileName(outFileName, format)), wSize(wSize), writeFile(writeFile), widths(wSize){
+        if (writeFile){
+            f_out.open(this->outFileName, format);
+        }
+    }
+    void processWave(const Waveform &wave){
+        //eliminate the noise cases with widths of 3999 or similar, and the rejected waveforms, and output them.
+        if ((wave.width < 0.8*wSize)&&(wave.width>0.0)&&!wave.rejected){
+            widths.add(round(wave.width));
+            if (!writeFile){
+                return;
+            }
+            if (f_out.is_open()){
+                f_out << wave.width << endl;
+            } else {
+                cout << "Unable to open file: " + outFileName<< endl;
+            }
+        }
+    }
+    void finish(){
+        f_out.close();
+        cout<<"                       Widths Completed                    "<<endl;
+    }
+    const WidthHistogram &histogram() const{
+        return widths;
+    }
+private:
+    string outFileName;
+    int wSize;
+    bool writeFile;
+    WidthHistogram widths;
+    OutputFile f_out;
+};
+
+//Writes the total integral against the width, as totalIntVsWidth. The same consumer also replaces
+//totalIntVsWidthPostBaselineAdjusted, since the engine already works on the baseline adjusted waveform.
+class TotalIntVsWidthConsumer : public WaveConsumer{
+public:
+    TotalIntVsWidthConsumer(string outFileName, int wSize, string methodName = "totalIntVsWidth",
+                            int format = PSD_OUTPUT_TEXT)
+            : outFileName(outputFileName(outFileName, format)), wSize(wSize), methodName(methodName){
+        f_out.open(this->outFileName, format);
+    }
+    void processWave(const Waveform &wave){
+        if ((wave.width < 0.8*wSize)&&(wave.width>0.0)&&!wave.rejected){
+            if (f_out.is_open()) {
+                f_out << wave.width << " " << wave.totalInt << endl;
+            } else {
+                cout << "Unable to open file: " + outFileName << endl;
+            }
+        }
+    }
+    void finish(){
+        f_out.close();
+        cout<<"                       "<<methodName<<" Completed                    "<<endl;
+    }
+private:
+    string outFileName;
+    int wSize;
+    string methodName;
+    OutputFile f_out;
+};
+
+//Writes the peak and tail integrals, as peakTailIntegrate.
+class PeakTailConsumer : public WaveConsumer{
+public:
+    PeakTailConsumer(string outFileName, int format = PSD_OUTPUT_TEXT) : outFileName(outputFileName(outFileName, format)){
+        f_out.open(this->outFileName, format);
+    }
+    void processWave(const Waveform &wave){
+        if (wave.rejected){
+            return;
+        }
+        if (f_out.is_open()) {
+            f_out << wave.peak << " " << wave.tail << endl;
+        } else {
+            cout << "Unable to open file " << endl;
+        }
+    }
+    void finish(){
+        f_out.close();
+        cout<<"                       peakTailIntegrate Completed                    "<<endl;
+    }
+private:
+    string outFileName;
+    OutputFile f_out;
+};
+
+//Writes the PGA values, as PGA.
+class PGAConsumer : public WaveConsumer{
+public:
+    PGAConsumer(string outFileName, int format = PSD_OUTPUT_TEXT) : outFileName(outputFileName(outFileName, format)){
+        f_out.open(this->outFileName, format);
+    }
+    void processWave(const Waveform &wave){
+        if (wave.rejected){
+            return;
+        }
+        if (f_out.is_open()) {
+            f_out << wave.PGAVal << endl;
+        } else {
+            cout << "Unable to open file: " + outFileName << endl;
+        }
+    }
+    void finish(){
+        f_out.close();
+        cout<<"                       PGA Completed                    "<<endl;
+    }
+private:
+    string outFileName;
+    OutputFile f_out;
+};
+
+//Writes the raw heights of the first waveforms, as firstTen. Like firstTen this stops after 9 waveforms.
+class FirstTenConsumer : public WaveConsumer{
+public:
+    FirstTenConsumer(string outFileName, int format = PSD_OUTPUT_TEXT) : outFileName(outputFileName(outFileName, format)){
+        f_out.open(this->outFileName, format);
+    }
+    void processWave(const Waveform &wave){
+        if (wave.index >= 9){
+            return;
+        }
+        if (f_out.is_open()) {
+            for (int i = 0; i < wave.size; ++i) {
+                f_out <<i <<" "<< wave.rawAt(i)<<endl;
+            }
+        } else {
+            cout << "Unable to open file " << endl;
+        }
+    }
+    void finish(){
+        f_out.close();
+        cout<<"                       firstTen Completed                    "<<endl;
+    }
+private:
+    string outFileName;
+    OutputFile f_out;
+};
+
+//Writes the baseline adjusted heights, as baselineAdjust.
+class BaselineAdjustConsumer : public WaveConsumer{
+public:
+    BaselineAdjustConsumer(string outFileName, int format = PSD_OUTPUT_TEXT) : outFileName(outputFileName(outFileName, format)){
+        f_out.open(this->outFileName, format);
+    }
+    void processWave(const Waveform &wave){
+        if (f_out.is_open()) {
+            for (int i = 0; i < wave.size; ++i) {
+                f_out << i << " "<<wave.adjustedAt(i) << endl;
+            }
+        } else {
+            cout << "Unable to open file " << endl;
+        }
+    }
+    void finish(){
+        f_out.close();
+        cout<<"                       baselineAdjust Completed                    "<<endl;
+    }
+private:
+    string outFileName;
+    OutputFile f_out;
+};
+
+//Writes the baseline adjusted waveforms as float32 heights to a .psdw file, the compact form of the "Baseline Adjusted"
+//copy of a run for when one is really needed.
+class AdjustedWaveFileConsumer : public WaveConsumer{
+public:
+    AdjustedWaveFileConsumer(string outFileName, int wSize, string location, double runTime)
+            : f_out(outFileName, wSize, PSDW_FLOAT32, location, runTime){}
+    void processWave(const Waveform &wave){
+        if (wave.sampleType == PSD_SAMPLES_DOUBLE){
+            f_out.writeWave((const double*)wave.adjusted, wave.size);
+        }else{
+            f_out.writeWave((const float*)wave.adjusted, wave.size);
+        }
+    }
+    void finish(){
+        f_out.close();
+        cout<<"                       baselineAdjust Completed                    "<<endl;
+    }
+private:
+    BinaryWaveWriter f_out;
+};
+
+//Writes the amplitude and the integral rise times, as IntegralRisetimeVsAmplitude.
+class RisetimeConsumer : public WaveConsumer{
+public:
+    RisetimeConsumer(string outFileName, int format = PSD_OUTPUT_TEXT) : outFileName(outputFileName(outFileName, format)){
+        f_out.open(this->outFileName, format);
+    }
+    void processWave(const Waveform &wave){
+        if (wave.rejected){
+            return;
+        }
+        if (f_out.is_open()) {
+            f_out << wave.maxVal;
+            for (int j=0; j<wave.numRisetimes; ++j){
+                f_out << " " << wave.risetimes[j];
+            }
+            f_out << endl;
+        } else {
+            cout << "Unable to open file: " + outFileName << endl;
+        }
+    }
+    void finish(){
+        f_out.close();
+        cout<<"                       IntegralRisetimeVsAmplitude Completed                    "<<endl;
+    }
+private:
+    string outFileName;
+    OutputFile f_out;
+};
+
+//Writes the sum over each gate and, if there are gates named tail and total, the tail/total ratio.
+class GateConsumer : public WaveConsumer{
+public:
+    GateConsumer(string outFileName, const GateSet &gateSet, int format = PSD_OUTPUT_TEXT)
+            : outFileName(outputFileName(outFileName, format)), gateSet(gateSet){
+        f_out.open(this->outFileName, format);
+    }
+    void processWave(const Waveform &wave){
+        if (wave.rejected){
+            return;
+        }
+        if (!f_out.is_open()) {
+            cout << "Unable to open file: " + outFileName << endl;
+            return;
+        }
+        for (int j=0; j<wave.numGates; ++j){
+            f_out << (j > 0 ? " " : "") << wave.gateSums[j];
+        }
+        if ((gateSet.tailGate >= 0) && (gateSet.totalGate >= 0)){
+            double total = wave.gateSums[gateSet.totalGate];
+            f_out << " " << ((total != 0) ? wave.gateSums[gateSet.tailGate]/total : 0.0);
+        }
+        f_out << endl;
+    }
+    void finish(){
+        f_out.close();
+        cout<<"                       gateIntegrals Completed                    "<<endl;
+    }
+private:
+    string outFileName;
+    GateSet gateSet;
+    OutputFile f_out;
+};
+
+//Counts the waveforms, as numWaves.
+class NumWavesConsumer : public WaveConsumer{
+public:
+    NumWavesConsumer(string inFileName) : inFileName(inFileName), numWaves(0){}
+    void processWave(const Waveform &){
+        numWaves++;
+    }
+    void finish(){
+        cout<<"The number of waves in "<<inFileName<<" is: "<<numWaves<<endl;
+    }
+private:
+    string inFileName;
+    int numWaves;
+};
+
+//Counts the waveforms flagged for each reason and the waveforms rejected, prints them and appends
+//"filename numWaves pileUp saturated baselineExcursions rejected" to a summary file.
+class RejectionConsumer : public WaveConsumer{
+public:
+    RejectionConsumer(string inFileName, string outFileName)
+            : inFileName(inFileName), outFileName(outFileName), numWaves(0), numPileUp(0), numSaturated(0),
+              numExcursions(0), numRejected(0){}
+    void processWave(const Waveform &wave){
+        numWaves++;
+        numPileUp += (wave.flags & PSD_FLAG_PILEUP) ? 1 : 0;
+        numSaturated += (wave.flags & PSD_FLAG_SATURATED) ? 1 : 0;
+        numExcursions += (wave.flags & PSD_FLAG_BASELINE) ? 1 : 0;
+        numRejected += wave.rejected ? 1 : 0;
+    }
+    void finish(){
+        cout << "Flagged in " << inFileName << ": " << numPileUp << " pile-up, " << numSaturated << " saturated, "
+             << numExcursions << " baseline excursions, " << numRejected << " of " << numWaves << " rejected" << endl;
+        lock_guard<mutex> summaryLock(summaryFileMutex);
+        ofstream f_out(outFileName, ios::out | ios::app);
+        if (f_out.is_open()) {
+            f_out << inFileName << " " << numWaves << " " << numPileUp << " " << numSaturated << " " << numExcursions
+                  << " " << numRejected << endl;
+        } else {
+            cout << "Unable to open file: " + outFileName << endl;
+        }
+        f_out.close();
+    }
+private:
+    string inFileName, outFileName;
+    int numWaves, numPileUp, numSaturated, numExcursions, numRejected;
+};
+
+//Appends the baseline deviation of the run, averaged over the deviations analyseWave finds for its waveforms, to a
+//file.
+class BaselineDeviationConsumer : public WaveConsumer{
+public:
+    BaselineDeviationConsumer(string inFileName, string outFileName)
+            : inFileName(inFileName), outFileName(outFileName){}
+    void processWave(const Waveform &wave){
+        deviations.add(wave.deviation);
+    }
+    void finish(){
+        double deviation = deviations.average();
+        lock_guard<mutex> summaryLock(summaryFileMutex);
+        ofstream f_out(outFileName, ios::out | ios::app);
+        if (f_out.is_open()) {
+            f_out << inFileName <<" "<<deviation<< endl;
+        } else {
+            cout << "Unable to open file: " + outFileName << endl;
+        }
+        f_out.close();
+        cout<<"                       baselineDeviation Completed                    "<<endl;
+    }
+private:
+    string inFileName, outFileName;
+    RunningStats deviations;
+};
+
+//Appends the average baseline of the run, over the baselines analyseWave finds for its waveforms, to a file.
+class BaselineAverageConsumer : public WaveConsumer{
+public:
+    BaselineAverageConsumer(string inFileName, string outFileName)
+            : inFileName(inFileName), outFileName(outFileName){}
+    void processWave(const Waveform &wave){
+        baselines.add(wave.basel);
+    }
+    void finish(){
+        double avgBaseL = baselines.average();
+        lock_guard<mutex> summaryLock(summaryFileMutex);
+        ofstream f_out(outFileName, ios::out | ios::app);
+        if (f_out.is_open()) {
+            f_out << inFileName<<" "<< avgBaseL << endl;
+        } else {
+            cout << "Unable to open file: " + outFileName << endl;
+        }
+        f_out.close();
+        cout<<"                       baselineAverage Completed                    "<<endl;
+    }
+private:
+    string inFileName, outFileName;
+    RunningStats baselines;
+};
+
+//Writes the baseline estimates of each waveform, as "mean deviation median trimmedMean tailMean tailDeviation", and
+//appends their averages over the run to a summary file along with the spread of the mean baseline from one waveform to
+//the next, to show up noise and drift.
+class BaselineConsumer : public WaveConsumer{
+public:
+    BaselineConsumer(string inFileName, string outFileName, string summaryFileName, int format = PSD_OUTPUT_TEXT)
+            : inFileName(inFileName), outFileName(outputFileName(outFileName, format)),
+              summaryFileName(summaryFileName){
+        f_out.open(this->outFileName, format);
+    }
+    void processWave(const Waveform &wave){
+        means.add(wave.basel);
+        deviations.add(wave.deviation);
+        medians.add(wave.baselMedian);
+        trimmedMeans.add(wave.baselTrimmed);
+        tailMeans.add(wave.tailBasel);
+        tailDeviations.add(wave.tailDeviation);
+        if (!f_out.is_open()) {
+            cout << "Unable to open file: " + outFileName << endl;
+            return;
+        }
+        f_out << wave.basel << " " << wave.deviation << " " << wave.baselMedian << " " << wave.baselTrimmed << " "
+              << wave.tailBasel << " " << wave.tailDeviation << endl;
+    }
+    void finish(){
+        f_out.close();
+        lock_guard<mutex> summaryLock(summaryFileMutex);
+        ofstream summary(summaryFileName, ios::out | ios::app);
+        if (summary.is_open()) {
+            summary << inFileName << " " << means.average() << " " << means.standardDeviation() << " "
+                    << deviations.average() << " " << medians.average() << " " << trimmedMeans.average() << " "
+                    << tailMeans.average() << " " << tailDeviations.average() << endl;
+        } else {
+            cout << "Unable to open file: " + summaryFileName << endl;
+        }
+        summary.close();
+        cout<<"                       baselines Completed                    "<<endl;
+    }
+private:
+    string inFileName, outFileName, summaryFileName;
+    OutputFile f_out;
+    RunningStats means, deviations, medians, trimmedMeans, tailMeans, tailDeviations;
+};
+
+//A group of consecutive waveforms handed between the reader, the workers and the writer in parallel mode.
+template <typename Sample>
+struct WaveBatch{
+    long long sequence; //Position of the batch in the file, counting from 0.
+    int numWaves; //Number of entries of waves in use.
+    vector<WaveBuffer<Sample> > waves;
+    atomic<int> writersLeft; //Consumer threads still to write the batch out.
+};
+
+//Waiting strategy for the lock-free rings: spin briefly, then give up the core in turn, then sleep, so that a stage
+//held up by a slow one picks up new work within microseconds without keeping a core busy for long.
+class Backoff{
+public:
+    Backoff() : waits(0){}
+    void pause(){
+        if (waits < 64){
+#ifdef PSD_X86_SIMD
+            _mm_pause();
+#endif
+        }else if (waits < 1024){
+            this_thread::yield();
+        }else{
+            this_thread::sleep_for(chrono::microseconds(20));
+        }
+        waits++;
+    }
+private:
+    int waits;
+};
+
+//Lock-free ring passing items from one producer thread to one consumer thread. The slots are allocated up front and
+//reused, and a full ring makes the producer wait, which holds back the stages before it. close() tells the consumer
+//that nothing more is coming once the ring is empty.
+template <typename T>
+class SPSCRing{
+public:
+    SPSCRing(int capacity) : items(capacity + 1), head(0), tail(0), closed(false), cachedTail(0), cachedHead(0){}
+    //Method to add an item, waiting while the ring is full. Only called from the producer thread.
+    void push(const T &item){
+        size_t position = tail.load(memory_order_relaxed);
+        size_t next = (position + 1 == items.size()) ? 0 : position + 1;
+        Backoff backoff;
+        while (next == cachedHead){
+            cachedHead = head.load(memory_order_acquire);
+            if (next == cachedHead){
+                backoff.pause();
+            }
+        }
+        items[position] = item;
+        tail.store(next, memory_order_release);
+    }
+    //Method to take the next item if there is one. Only called from the consumer thread.
+    bool tryPop(T &item){
+        size_t position = head.load(memory_order_relaxed);
+        if (position == cachedTail){
+            cachedTail = tail.load(memory_order_acquire);
+            if (position == cachedTail){
+                return false;
+            }
+        }
+        item = items[position];
+        head.store((position + 1 == items.size()) ? 0 : position + 1, memory_order_release);
+        return true;
+    }
+    //Method to take the next item, waiting if needed. Returns false once the ring is closed and empty.
+    bool pop(T &item){
+        Backoff backoff;
+        while (!tryPop(item)){
+            if (isFinished()){
+                return false;
+            }
+            backoff.pause();
+        }
+        return true;
+    }
+    //True once the ring is closed and everything pushed before that has been taken.
+    bool isFinished(){
+        if (!closed.load(memory_order_acquire)){
+            return false;
+        }
+        return head.load(memory_order_relaxed) == tail.load(memory_order_acquire);
+    }
+    void close(){
+        closed.store(true, memory_order_release);
+    }
+private:
+    vector<T> items; //One slot is always left empty, to tell a full ring from an empty one.
+    //The producer's and consumer's indices are kept on separate cache lines, each with the consumer's last view of the
+    //other, so that the two threads only share a line when one of them has caught up with the other.
+    alignas(64) atomic<size_t> head;
+    alignas(64) atomic<size_t> tail;
+    atomic<bool> closed;
+    alignas(64) size_t cachedTail; //Consumer's copy of tail.
+    alignas(64) size_t cachedHead; //Producer's copy of head.
+};
+
+//Method to do the same as the serial singlePassAnalysis with the work pipelined over several threads. A reader thread
+//fills batches of waveforms and deals them out in turn to numThreads workers, which analyse whole batches. The calling
+//thread collects the batches back in file order, and each consumer writes them out on a thread of its own, so the
+//Widths, totalIntVsWidth, PGA and other output files are written at the same time, each identical to the serial one.
+//Every hand off between threads is a lock-free single producer, single consumer ring of preallocated batches, and
+//batches go back to the reader once every consumer is done with them.
+template <typename Sample>
+void parallelPassAnalysis(WaveReader &f_in, const AnalysisParams &params, const vector<WaveConsumer*> &consumers,
+                          int numThreads, RunProfile *profile = NULL){
+    //Roughly 2^18 samples per batch, and enough batches for every worker to have one while others are queued.
+    int batchSize = max(1, (1<<18)/params.wSize);
+    int numBatches = 2*numThreads + 2;
+    int numWriters = consumers.size();
+    vector<WaveBatch<Sample> > batches(numBatches);
+    SPSCRing<WaveBatch<Sample>*> freeBatches(numBatches);
+    vector<unique_ptr<SPSCRing<WaveBatch<Sample>*> > > toAnalyse, analysed, toWrite;
+    for (int t=0; t<numThreads; ++t){
+        toAnalyse.push_back(unique_ptr<SPSCRing<WaveBatch<Sample>*> >(new SPSCRing<WaveBatch<Sample>*>(numBatches)));
+        analysed.push_back(unique_ptr<SPSCRing<WaveBatch<Sample>*> >(new SPSCRing<WaveBatch<Sample>*>(numBatches)));
+    }
+    for (int w=0; w<numWriters; ++w){
+        toWrite.push_back(unique_ptr<SPSCRing<WaveBatch<Sample>*> >(new SPSCRing<WaveBatch<Sample>*>(numBatches)));
+    }
+    for (int i=0; i<numBatches; ++i){
+        batches[i].waves.resize(batchSize);
+        batches[i].writersLeft = 0;
+        freeBatches.push(&batches[i]);
+    }
+
+    thread reader([&]{
+        ProfileThread profiling(profile);
+        WaveBatch<Sample> *batch;
+        long long sequence = 0;
+        int index = 0;
+        bool more = true;
+        while (more && freeBatches.pop(batch)){
+            batch->sequence = sequence;
+            batch->numWaves = 0;
+            StageClock clock(PSD_STAGE_READ);
+            while (batch->numWaves < batchSize){
+                WaveBuffer<Sample> &buffer = batch->waves[batch->numWaves];
+                if (!f_in.nextWave(buffer.raw, params.wSize)){
+                    more = false;
+                    break;
+                }
+                buffer.wave.index = index++;
+                batch->numWaves++;
+            }
+            clock.next(PSD_STAGE_NONE);
+            if (batch->numWaves > 0){
+                toAnalyse[sequence % numThreads]->push(batch);
+                sequence++;
+            }
+        }
+        for (int t=0; t<numThreads; ++t){
+            toAnalyse[t]->close();
+        }
+    });
+
+    vector<thread> workers;
+    for (int t=0; t<numThreads; ++t){
+        workers.push_back(thread([&, t]{
+            ProfileThread profiling(profile);
+            WaveBatch<Sample> *batch;
+            while (toAnalyse[t]->pop(batch)){
+                for (int i=0; i<batch->numWaves; ++i){
+                    analyseWave(batch->waves[i], params);
+                }
+                analysed[t]->push(batch);
+            }
+            analysed[t]->close();
+        }));
+    }
+
+    vector<thread> writers;
+    for (int w=0; w<numWriters; ++w){
+        writers.push_back(thread([&, w]{
+            ProfileThread profiling(profile);
+            WaveBatch<Sample> *batch;
+            while (toWrite[w]->pop(batch)){
+                StageClock clock(PSD_STAGE_OUTPUT);
+                for (int i=0; i<batch->numWaves; ++i){
+                    consumers[w]->processWave(batch->waves[i].wave);
+                }
+                clock.next(PSD_STAGE_NONE);
+                batch->writersLeft.fetch_sub(1, memory_order_acq_rel);
+            }
+        }));
+    }
+
+    //Batch n is always dealt to worker n % numThreads, so taking from the workers in turn puts the batches back in
+    //file order. The writers finish the batches in that order too, and the ones they are all done with are recycled
+    //while waiting, since the reader may be waiting on them.
+    vector<WaveBatch<Sample>*> writing(numBatches);
+    int writingHead = 0, numWriting = 0;
+    auto recycle = [&]{
+        while ((numWriting > 0) && (writing[writingHead]->writersLeft.load(memory_order_acquire) == 0)){
+            freeBatches.push(writing[writingHead]);
+            writingHead = (writingHead + 1) % numBatches;
+            numWriting--;
+        }
+    };
+    for (long long sequence = 0; ; ++sequence){
+        SPSCRing<WaveBatch<Sample>*> &next = *analysed[sequence % numThreads];
+        WaveBatch<Sample> *batch;
+        Backoff backoff;
+        bool more = true;
+        while (!next.tryPop(batch)){
+            if (next.isFinished()){
+                more = false;
+                break;
+            }
+            recycle();
+            backoff.pause();
+        }
+        if (!more){
+            break;
+        }
+        if (numWriters == 0){
+            freeBatches.push(batch);
+            continue;
+        }
+        batch->writersLeft.store(numWriters, memory_order_relaxed);
+        writing[(writingHead + numWriting) % numBatches] = batch;
+        numWriting++;
+        for (int w=0; w<numWriters; ++w){
+            toWrite[w]->push(batch);
+        }
+        recycle();
+    }
+    for (int w=0; w<numWriters; ++w){
+        toWrite[w]->close();
+    }
+    freeBatches.close();
+    reader.join();
+    for (int t=0; t<numThreads; ++t){
+        workers[t].join();
+    }
+    for (int w=0; w<numWriters; ++w){
+        writers[w].join();
+    }
+}
+
+//Method to run the engine on an open file with the heights held as Sample, serially or on numThreads worker threads.
+template <typename Sample>
+void passAnalysis(WaveReader &f_in, const AnalysisParams &params, const vector<WaveConsumer*> &consumers, int numThreads,
+                  RunProfile *profile){
+    if (numThreads > 1){
+        parallelPassAnalysis<Sample>(f_in, params, consumers, numThreads, profile);
+        return;
+    }
+    ProfileThread profiling(profile);
+    WaveBuffer<Sample> buffer;
+    buffer.wave.index = 0;
+    //Start reading in values. analyseWave times its own stages.
+    StageClock clock(PSD_STAGE_READ);
+    while(f_in.nextWave(buffer.raw, params.wSize)){
+        clock.next(PSD_STAGE_NONE);
+        analyseWave(buffer, params);
+        clock.next(PSD_STAGE_OUTPUT);
+        for (int i=0; i<consumers.size(); ++i){
+            consumers[i]->processWave(buffer.wave);
+        }
+        buffer.wave.index++;
+        clock.next(PSD_STAGE_READ);
+    }
+}
+
+//Method to read every waveform in a file once, analyse it and pass it on to each of the consumers in turn. With
+//numThreads above 1 the analysis runs on that many worker threads, with the output order unchanged. The heights are
+//held as params.sampleType. If profile is given, the stages are timed and the waveforms counted in it.
+void singlePassAnalysis(string inFileName, const AnalysisParams &params, const vector<WaveConsumer*> &consumers,
+                        int numThreads = 1, RunProfile *profile = NULL){
+    WaveReader f_in(inFileName);
+    if(!f_in.is_open()){
+        cout<< " not found in singlePassAnalysis with filename: " + inFileName<< endl;
+    }
+    int sampleType = (params.sampleType == PSD_SAMPLES_AUTO) ? f_in.storedSampleType() : params.sampleType;
+    if (sampleType == PSD_SAMPLES_FLOAT){
+        passAnalysis<float>(f_in, params, consumers, numThreads, profile);
+    }else if (sampleType == PSD_SAMPLES_INT32){
+        passAnalysis<int32_t>(f_in, params, consumers, numThreads, profile);
+    }else if (sampleType == PSD_SAMPLES_INT16){
+        passAnalysis<int16_t>(f_in, params, consumers, numThreads, profile);
+    }else{
+        passAnalysis<double>(f_in, params, consumers, numThreads, profile);
+    }
+    if (profile != NULL){
+        profile->addBytesRead(f_in.bytePosition());
+    }
+    f_in.close();
+    ProfileThread profiling(profile);
+    StageClock clock(PSD_STAGE_OUTPUT);
+    for (int i=0; i<consumers.size(); ++i){
+        consumers[i]->finish();
+    }
+    cout<<"                       singlePassAnalysis Completed                    "<<endl;
+}
+
+//-----------------------------------------------------Feature Store----------------------------------------------------
+//The per waveform tables each hold one or two features and nothing to say which waveform a line came from, so they
+//cannot be joined. With --feature-cache each run also gets "Feature Cache/<run>_Features.psdf", a table with one row per
+//waveform, row i being waveform i of the run with the rejected ones included, and a column for each feature and for the
+//flags. The rows are stored in blocks of PSD_FEATURE_BLOCK_ROWS, each block holding its rows column by column, so the
+//file is written as the waveforms arrive and a query reads only the columns it uses straight from the mapped file.
+//The header holds the size, modification time and a hash of the start of the input file and a hash of the analysis
+//parameters. A later run of the same file with the same parameters reads the features back instead of the waveforms,
+//so changing only the width cuts or the details in File Details.txt redoes the derived quantities without parsing the
+//run again.
+//----------------------------------------------------------------------------------------------------------------------
+
+#define PSDF_MAGIC "PSDFEAT1"
+#define PSDF_VERSION 2 //Version 1 stores held a row of features at a time, and are treated as out of date.
+#define PSD_CACHE_HASH_BYTES 65536 //Bytes at the start of the input file that are hashed.
+#define PSD_FEATURE_BLOCK_ROWS 65536 //Rows in each block of a store. Only the last block can be shorter.
+
+//Columns of a feature store, in the order they are stored.
+#define PSD_FEATURE_WIDTH 0
+#define PSD_FEATURE_TOTAL_INT 1
+#define PSD_FEATURE_PEAK 2
+#define PSD_FEATURE_TAIL 3
+#define PSD_FEATURE_PGA 4
+#define PSD_FEATURE_BASEL 5
+#define PSD_FEATURE_DEVIATION 6
+#define PSD_FEATURE_MAX_VAL 7
+#define PSD_FEATURE_PEAK_INDEX 8
+#define PSD_FEATURE_FLAGS 9 //PSD_FLAG_ reasons found for the waveform.
+#define PSD_FEATURE_REJECTED 10 //1 if the waveform was left out of the pulse shape analysis, otherwise 0.
+#define PSD_NUM_FEATURES 11
+
+//Names of the columns, as used in queries.
+const char *featureNames[PSD_NUM_FEATURES] = {"width", "totalInt", "peak", "tail", "PGA", "basel", "deviation",
+                                              "maxVal", "peakIndex", "flags", "rejected"};
+
+//Method to find a column by name. Returns -1 for an unknown name.
+int featureColumn(string name){
+    for (int column=0; column<PSD_NUM_FEATURES; ++column){
+        if (name == featureNames[column]){
+            return column;
+        }
+    }
+    return -1;
+}
+
+//Header at the start of a feature store, followed by its blocks of doubles.
+struct FeatureStoreHeader{
+    char magic[8]; //PSDF_MAGIC.
+    int32_t version; //PSDF_VERSION.
+    int32_t wSize; //Number of samples in each waveform.
+    int64_t inputSize; //Size of the input file in bytes.
+    int64_t inputModified; //Modification time of the input file in seconds since the epoch, or 0 if not known.
+    uint64_t inputHash; //Hash of the first PSD_CACHE_HASH_BYTES bytes of the input file.
+    uint64_t paramsHash; //Hash of the analysis version and parameters, from featureStoreParams.
+    int64_t numWaves; //Number of rows, filled in once the pass is complete.
+    int32_t numColumns; //PSD_NUM_FEATURES.
+    int32_t blockRows; //PSD_FEATURE_BLOCK_ROWS.
+};
+static_assert(sizeof(FeatureStoreHeader) == 64, "FeatureStoreHeader must have no padding");
+
+//Method to add n bytes to a 64 bit FNV-1a hash.
+uint64_t hashBytes(const void *data, size_t n, uint64_t hash = 14695981039346656037ULL){
+    const unsigned char *bytes = (const unsigned char*)data;
+    for (size_t i=0; i<n; ++i){
+        hash = (hash ^ bytes[i])*1099511628211ULL;
+    }
+    return hash;
+}
+
+//Method to describe the version of the analysis and the parameters the stored features depend on. The rise times,
+//gates and extra baselines are not stored, so they are left out.
+string featureStoreParams(const AnalysisParams &params){
+    stringstream description;
+    description.precision(17);
+    description << PSD_ANALYSIS_VERSION << " " << params.wSize << " " << params.baseLEnd << " " << params.threshold << " " << params.wStart << " "
+                << params.wEnd << " " << params.peakXValue << " " << params.tailEndXVal << " " << params.PGASampleVal
+                << " " << params.sampleType << " " << params.widthMethod << " " << params.interpolateWidth << " "
+                << params.rejectFlags << " " << params.adcMin << " " << params.adcMax;
+    return description.str();
+}
+
+//Method to fill in the header a store of inFileName analysed with params must have. Returns false if the input is not
+//a regular file that can be read, as a stream cannot be stored.
+bool featureStoreKey(string inFileName, const AnalysisParams &params, FeatureStoreHeader &key){
+    memset(&key, 0, sizeof(key));
+    memcpy(key.magic, PSDF_MAGIC, 8);
+    key.version = PSDF_VERSION;
+    key.wSize = params.wSize;
+    key.numColumns = PSD_NUM_FEATURES;
+    key.blockRows = PSD_FEATURE_BLOCK_ROWS;
+#ifdef PSD_POSIX_IO
+    struct stat info;
+    if ((stat(inFileName.c_str(), &info) != 0) || !S_ISREG(info.st_mode)){
+        return false;
+    }
+    key.inputSize = info.st_size;
+    key.inputModified = info.st_mtime;
+#endif
+    FILE *file = fopen(inFileName.c_str(), "rb");
+    if (file == NULL){
+        return false;
+    }
+    vector<char> head(PSD_CACHE_HASH_BYTES);
+    size_t numRead = fread(head.data(), 1, head.size(), file);
+#ifndef PSD_POSIX_IO
+    if (fseek(file, 0, SEEK_END) == 0){
+        key.inputSize = ftell(file);
+    }
+#endif
+    fclose(file);
+    key.inputHash = hashBytes(head.data(), numRead);
+    string description = featureStoreParams(params);
+    key.paramsHash = hashBytes(description.data(), description.size());
+    return true;
+}
+
+//Method to give the size in bytes a store of numWaves rows should be.
+long long featureStoreBytes(long long numWaves){
+    return sizeof(FeatureStoreHeader) + numWaves*PSD_NUM_FEATURES*(long long)sizeof(double);
+}
+
+//Method to check whether storeFileName is a complete store with the given key.
+bool featureStoreMatches(string storeFileName, const FeatureStoreHeader &key){
+    FILE *file = fopen(storeFileName.c_str(), "rb");
+    if (file == NULL){
+        return false;
+    }
+    FeatureStoreHeader header;
+    bool matches = (fread(&header, sizeof(header), 1, file) == 1) && (memcmp(header.magic, key.magic, 8) == 0)
+                   && (header.version == key.version) && (header.wSize == key.wSize)
+                   && (header.inputSize == key.inputSize) && (header.inputModified == key.inputModified)
+                   && (header.inputHash == key.inputHash) && (header.paramsHash == key.paramsHash)
+                   && (header.numColumns == key.numColumns) && (header.blockRows == key.blockRows)
+                   && (fseek(file, 0, SEEK_END) == 0) && (ftell(file) == featureStoreBytes(header.numWaves));
+    fclose(file);
+    return matches;
+}
+
+//Writes the features of every waveform to a store. Each block is gathered column by column in memory and written once
+//it is full. The file is written as storeFileName + ".tmp" and only replaces the store once the pass is complete, so an
+//interrupted run never leaves a store that looks whole.
+class FeatureStoreConsumer : public WaveConsumer{
+public:
+    FeatureStoreConsumer(string storeFileName, const FeatureStoreHeader &key)
+            : storeFileName(storeFileName), tempFileName(storeFileName + ".tmp"), header(key),
+              block(PSD_NUM_FEATURES*PSD_FEATURE_BLOCK_ROWS), rowsInBlock(0), error(false){
+        header.numWaves = 0;
+        file = fopen(tempFileName.c_str(), "wb");
+        if (file == NULL){
+            cout << "Unable to open file: " + tempFileName << endl;
+            return;
+        }
+        error = fwrite(&header, sizeof(header), 1, file) != 1;
+    }
+    ~FeatureStoreConsumer(){
+        if (file != NULL){
+            fclose(file);
+            remove(tempFileName.c_str());
+        }
+    }
+    //The destructor closes the file and removes the part-written store, so a FeatureStoreConsumer cannot be copied.
+    FeatureStoreConsumer(const FeatureStoreConsumer&) = delete;
+    FeatureStoreConsumer &operator=(const FeatureStoreConsumer&) = delete;
+    void processWave(const Waveform &wave){
+        if (file == NULL){
+            return;
+        }
+        double *row = block.data() + rowsInBlock;
+        row[PSD_FEATURE_WIDTH*PSD_FEATURE_BLOCK_ROWS] = wave.width;
+        row[PSD_FEATURE_TOTAL_INT*PSD_FEATURE_BLOCK_ROWS] = wave.totalInt;
+        row[PSD_FEATURE_PEAK*PSD_FEATURE_BLOCK_ROWS] = wave.peak;
+        row[PSD_FEATURE_TAIL*PSD_FEATURE_BLOCK_ROWS] = wave.tail;
+        row[PSD_FEATURE_PGA*PSD_FEATURE_BLOCK_ROWS] = wave.PGAVal;
+        row[PSD_FEATURE_BASEL*PSD_FEATURE_BLOCK_ROWS] = wave.basel;
+        row[PSD_FEATURE_DEVIATION*PSD_FEATURE_BLOCK_ROWS] = wave.deviation;
+        row[PSD_FEATURE_MAX_VAL*PSD_FEATURE_BLOCK_ROWS] = wave.maxVal;
+        row[PSD_FEATURE_PEAK_INDEX*PSD_FEATURE_BLOCK_ROWS] = wave.peakIndex;
+        row[PSD_FEATURE_FLAGS*PSD_FEATURE_BLOCK_ROWS] = wave.flags;
+        row[PSD_FEATURE_REJECTED*PSD_FEATURE_BLOCK_ROWS] = wave.rejected ? 1 : 0;
+        header.numWaves++;
+        if (++rowsInBlock == PSD_FEATURE_BLOCK_ROWS){
+            writeBlock();
+        }
+    }
+    void finish(){
+        if (file == NULL){
+            return;
+        }
+        writeBlock();
+        error = error || (fseek(file, 0, SEEK_SET) != 0) || (fwrite(&header, sizeof(header), 1, file) != 1);
+        error = (fclose(file) != 0) || error;
+        file = NULL;
+        remove(storeFileName.c_str());
+        if (error || (rename(tempFileName.c_str(), storeFileName.c_str()) != 0)){
+            cout << "Unable to write file: " + storeFileName << endl;
+            remove(tempFileName.c_str());
+            return;
+        }
+        cout<<"                       featureStore Completed                    "<<endl;
+    }
+private:
+    //Method to write out the rows gathered so far, one column after another.
+    void writeBlock(){
+        for (int column=0; (column<PSD_NUM_FEATURES) && (rowsInBlock > 0); ++column){
+            if (fwrite(block.data() + column*PSD_FEATURE_BLOCK_ROWS, sizeof(double), rowsInBlock, file) != rowsInBlock){
+                error = true;
+            }
+        }
+        rowsInBlock = 0;
+    }
+
+    string storeFileName, tempFileName;
+    FeatureStoreHeader header;
+    FILE *file;
+    vector<double> block; //PSD_FEATURE_BLOCK_ROWS values of each column in turn.
+    size_t rowsInBlock;
+    bool error;
+};
+
+//Read only view of a feature store, memory mapped where the platform allows it and otherwise read whole.
+class FeatureStore{
+public:
+    FeatureStore(string storeFileName) : fileName(storeFileName), source(storeFileName, storeBytes(storeFileName) + 1),
+                                         valid(false){
+        memset(&header, 0, sizeof(header));
+        if (!source.is_open()){
+            cout << " not found in FeatureStore with filename: " + storeFileName << endl;
+            return;
+        }
+        while (!source.atEnd()){
+            source.refill(0);
+        }
+        if (source.size() < sizeof(header)){
+            reportError("file too short for header");
+            return;
+        }
+        memcpy(&header, source.data(), sizeof(header));
+        if ((memcmp(header.magic, PSDF_MAGIC, 8) != 0) || (header.version != PSDF_VERSION)){
+            reportError("not a version " + to_string(PSDF_VERSION) + " feature store");
+        }else if ((header.numColumns != PSD_NUM_FEATURES) || (header.blockRows <= 0) || (header.numWaves < 0)){
+            reportError("unexpected layout");
+        }else if ((long long)source.size() != featureStoreBytes(header.numWaves)){
+            reportError("size does not match its " + to_string(header.numWaves) + " rows");
+        }else{
+            valid = true;
+        }
+    }
+    bool is_open() const{
+        return valid;
+    }
+    const FeatureStoreHeader &info() const{
+        return header;
+    }
+    long long numWaves() const{
+        return header.numWaves;
+    }
+    int numBlocks() const{
+        return (header.numWaves + header.blockRows - 1)/header.blockRows;
+    }
+    //Row of the first waveform in a block.
+    long long blockStart(int block) const{
+        return (long long)block*header.blockRows;
+    }
+    int blockSize(int block) const{
+        return min((long long)header.blockRows, header.numWaves - blockStart(block));
+    }
+    //Method to get the blockSize(block) values of a column for the rows of a block.
+    const double *column(int column, int block) const{
+        const double *blockData = (const double*)(source.data() + sizeof(header)) + blockStart(block)*PSD_NUM_FEATURES;
+        return blockData + (long long)column*blockSize(block);
+    }
+private:
+    static size_t storeBytes(string storeFileName){
+        long bytes = 0;
+        FILE *file = fopen(storeFileName.c_str(), "rb");
+        if (file != NULL){
+            if (fseek(file, 0, SEEK_END) == 0){
+                bytes = max(ftell(file), 0L);
+            }
+            fclose(file);
+        }
+        return bytes;
+    }
+    void reportError(string message){
+        cout << "Error reading " << fileName << ": " << message << endl;
+    }
+
+    string fileName;
+    InputSource source;
+    FeatureStoreHeader header;
+    bool valid;
+};
+
+//Method to hand the stored features of a run to consumers, in place of a pass over its waveforms. The waveforms have
+//no heights, rise times or gates, so only consumers that need none of them can be given a store.
+void replayFeatureStore(string storeFileName, const AnalysisParams &params, vector<WaveConsumer*> &consumers){
+    FeatureStore store(storeFileName);
+    if (store.is_open()){
+        Waveform wave = Waveform();
+        wave.size = store.info().wSize;
+        wave.sampleType = params.sampleType;
+        const double *columns[PSD_NUM_FEATURES];
+        for (int block=0; block<store.numBlocks(); ++block){
+            for (int column=0; column<PSD_NUM_FEATURES; ++column){
+                columns[column] = store.column(column, block);
+            }
+            for (int i=0; i<store.blockSize(block); ++i){
+                wave.index = store.blockStart(block) + i;
+                wave.width = columns[PSD_FEATURE_WIDTH][i];
+                wave.totalInt = columns[PSD_FEATURE_TOTAL_INT][i];
+                wave.peak = columns[PSD_FEATURE_PEAK][i];
+                wave.tail = columns[PSD_FEATURE_TAIL][i];
+                wave.PGAVal = columns[PSD_FEATURE_PGA][i];
+                wave.basel = columns[PSD_FEATURE_BASEL][i];
+                wave.deviation = columns[PSD_FEATURE_DEVIATION][i];
+                wave.maxVal = columns[PSD_FEATURE_MAX_VAL][i];
+                wave.peakIndex = columns[PSD_FEATURE_PEAK_INDEX][i];
+                wave.flags = columns[PSD_FEATURE_FLAGS][i];
+                wave.rejected = columns[PSD_FEATURE_REJECTED][i] != 0;
+                for (int j=0; j<consumers.size(); ++j){
+                    consumers[j]->processWave(wave);
+                }
+            }
+        }
+    }
+    for (int j=0; j<consumers.size(); ++j){
+        consumers[j]->finish();
+    }
+    cout<<"                       replayFeatureStore Completed                    "<<endl;
+}
+
+//---------------------------------------------------Batch Processing---------------------------------------------------
+//Each line of File Details.txt is a job: a run file, its location and the details of how it was taken. The jobs are run
+//several at a time, limited by a number of concurrent jobs and an estimate of the memory each one needs.
+//----------------------------------------------------------------------------------------------------------------------
+
+//Settings that depend on where the run was taken.
+struct RunSettings{
+    int wSize; //Number of points in the waveform.
+    int baseLEnd; //Point up to which only the baseline is present.
+    int tailW; //Point at which the tail of the pulse ends.
+    int peakXValue; //Point at which the peak value of the wave is.
+    int wStart; //Point at which the wave starts, in practice is the same as baseLEnd.
+    int wEnd; //Point at which the pulse ends, in practice is the same as tailW.
+    int PGASampleVal; //Sample value for the PGA method.
+    int widthLowCut; //Low cut point for the method counting the number of neutrons.
+    int widthHighCut; //High cut point for the method counting the number of neutrons.
+    double AmBeSourceActivity; //Neutron source activity.
+    string fileModifier; //Type of input file used (.txt, .dat, .csv etc.)
+    double adcMin, adcMax; //Lowest and highest codes the digitiser records, or -/+infinity if they are not known.
+};
+
+//Settings of the locations known without a profile file, in the same form as Location Profiles.txt. LUNA runs have no
+//source, so their activity and width cuts are 0.
+const char *builtInLocationProfiles =
+    "SeptEdinburgh 1000 100 600 200 100 800 600 5 50 2.738E5 .csv\n"
+    "LUNA 4000 30 200 34 30 100 100 0 0 0 .dat\n"
+    "JanEdinburgh 100000 10000 38000 22000 19000 60000 40000 19000 40000 2.737E5 .txt\n"
+    "FebEdinburgh 10000 1000 3800 2200 1900 6000 4000 1900 4000 2.737E5 .txt\n";
+
+//Settings of every known location, by name. Filled in once by loadLocationProfiles before any runs start and only read
+//after that.
+map<string, RunSettings> locationProfiles;
+
+//Method to check that the points of a location's settings lie inside its waveforms. Returns an empty string if they
+//do, otherwise what is wrong with them.
+string checkLocationSettings(const RunSettings &settings){
+    if (settings.wSize <= 0){
+        return "the waveform size must be positive";
+    }
+    if ((settings.baseLEnd <= 0) || (settings.baseLEnd > settings.wSize)){
+        return "the baseline end must be between 1 and the waveform size";
+    }
+    if ((settings.wStart < 0) || (settings.wStart > settings.wEnd) || (settings.wEnd > settings.wSize)){
+        return "the wave start and end must be in order and inside the waveform";
+    }
+    if ((settings.tailW < 0) || (settings.tailW > settings.wSize) || (settings.peakXValue < 0)
+        || (settings.peakXValue >= settings.wSize)){
+        return "the tail and peak points must be inside the waveform";
+    }
+    if ((settings.PGASampleVal < 0) || (settings.PGASampleVal >= settings.wSize)){
+        return "the PGA sample must be inside the waveform";
+    }
+    if ((settings.widthLowCut < 0) || (settings.widthLowCut > settings.widthHighCut)){
+        return "the width cuts must be in order";
+    }
+    if (settings.AmBeSourceActivity < 0){
+        return "the source activity cannot be negative";
+    }
+    if (!(settings.adcMin < settings.adcMax)){
+        return "the ADC range must be in order";
+    }
+    return "";
+}
+
+//Method to read location profiles, one per line as
+//  location wSize baseLEnd tailW peakXValue wStart wEnd PGASampleVal widthLowCut widthHighCut AmBeSourceActivity
+//  fileModifier [adcMin adcMax]
+//into locationProfiles, replacing any location of the same name. adcMin and adcMax are the digitiser's full scale codes,
+//which mark clipped pulses, and are left unknown if not given. Blank lines and lines starting with # are skipped, as
+//are lines that cannot be read or whose points do not fit their waveforms. Returns the number of profiles read.
+int readLocationProfiles(istream &in, string sourceName){
+    int numRead = 0;
+    int lineNo = 0;
+    string line;
+    while (getline(in, line)){
+        lineNo++;
+        stringstream fields(line);
+        string location;
+        if (!(fields >> location) || (location[0] == '#')){
+            continue;
+        }
+        RunSettings settings = RunSettings();
+        bool complete = (bool)(fields >> settings.wSize >> settings.baseLEnd >> settings.tailW >> settings.peakXValue
+                               >> settings.wStart >> settings.wEnd >> settings.PGASampleVal >> settings.widthLowCut
+                               >> settings.widthHighCut >> settings.AmBeSourceActivity >> settings.fileModifier);
+        vector<double> adcRange;
+        double code;
+        while (complete && (fields >> code)){
+            adcRange.push_back(code);
+        }
+        if (!complete || !fields.eof() || ((adcRange.size() != 0) && (adcRange.size() != 2))){
+            cout<<"Line "<<lineNo<<" in "<<sourceName<<": expected a location followed by wSize baseLEnd tailW "
+                "peakXValue wStart wEnd PGASampleVal widthLowCut widthHighCut AmBeSourceActivity fileModifier and "
+                "optionally adcMin adcMax"<<endl;
+            continue;
+        }
+        settings.adcMin = adcRange.empty() ? -numeric_limits<double>::infinity() : adcRange[0];
+        settings.adcMax = adcRange.empty() ? numeric_limits<double>::infinity() : adcRange[1];
+        string problem = checkLocationSettings(settings);
+        if (!problem.empty()){
+            cout<<"Line "<<lineNo<<" in "<<sourceName<<": "<<location<<" skipped, "<<problem<<endl;
+            continue;
+        }
+        locationProfiles[location] = settings;
+        numRead++;
+    }
+    return numRead;
+}
+
+//Method to set up the known locations: the built in ones, then those in fileName, which may add new locations or
+//replace built in ones. A missing file is only reported if it was asked for by name.
+void loadLocationProfiles(string fileName, bool required){
+    locationProfiles.clear();
+    stringstream builtIn(builtInLocationProfiles);
+    readLocationProfiles(builtIn, "the built in location profiles");
+    ifstream f_in(fileName.c_str());
+    if (!f_in){
+        if (required){
+            cout<< " not found in loadLocationProfiles with filename: " + fileName << endl;
+        }
+        return;
+    }
+    int numRead = readLocationProfiles(f_in, fileName);
+    cout<<"Read "<<numRead<<" location profiles from "<<fileName<<endl;
+}
+
+//Method to list the known locations as "A", "B" or "C", for messages about unknown ones.
+string knownLocations(){
+    string list;
+    int i = 0;
+    for (map<string, RunSettings>::const_iterator profile = locationProfiles.begin(); profile != locationProfiles.end();
+         ++profile, ++i){
+        if (i > 0){
+            list += (i + 1 == (int)locationProfiles.size()) ? " or " : ", ";
+        }
+        list += "\"" + profile->first + "\"";
+    }
+    return list;
+}
+
+//Method to fill in the settings for a location. Returns false for an unknown location.
+bool locationSettings(string location, RunSettings &settings){
+    map<string, RunSettings>::const_iterator profile = locationProfiles.find(location);
+    if (profile == locationProfiles.end()){
+        settings = RunSettings();
+        return false;
+    }
+    settings = profile->second;
+    return true;
+}
+
+//One line of File Details.txt.
+struct RunJob{
+    int line; //Line number in File Details.txt.
+    string filename; //Run name.
+    double runTime; //Duration of the run in seconds.
+    string location; //Location of the detector runs that sets up other variables
+    string fileDestination; //Folder containing the files.
+    double sourceDistance; //Distance from the detector to the source, 0 for background runs.
+    string orientation; //Horizontal or vertical detector orientation?
+    RunSettings settings;
+};
+
+//Method to read the jobs on lines firstLine to lastLine of the run list. Lines with an unknown location are reported
+//and skipped.
+vector<RunJob> readRunList(string fileDetails, int firstLine, int lastLine){
+    vector<RunJob> jobs;
+    fstream f_in;
+    f_in.open(fileDetails.c_str(),std::fstream::in);
+    if(!f_in){
+        cout<< " not found in readRunList with filename: " + fileDetails << endl;
+        return jobs;
+    }
+    RunJob job;
+    job.line = 0;
+    f_in >> job.filename >> job.runTime >> job.location >> job.fileDestination >> job.sourceDistance >> job.orientation;
+    while(f_in){
+        job.line++;
+        if ((job.line>=firstLine)&&(job.line<=lastLine)){
+            if (!locationSettings(job.location, job.settings)){
+                cout<<"Line "<<job.line<<" in "<<fileDetails<<": ";
+                cout<< "unknown location \"" << job.location << "\", skipping " << job.filename << ". Known locations are "
+                    << knownLocations() << endl;
+            }else{
+                jobs.push_back(job);
+            }
+        }
+        f_in >> job.filename >> job.runTime >> job.location >> job.fileDestination >> job.sourceDistance >> job.orientation;
+    }
+    f_in.close();
+    return jobs;
+}
+
+#define PSD_ADJUSTED_NONE 0
+#define PSD_ADJUSTED_PSDW 1
+#define PSD_ADJUSTED_TEXT 2
+
+//Choices made on the command line that apply to every run.
+struct RunOptions{
+    int numThreads; //Analysis threads for each run.
+    int sampleType; //PSD_SAMPLES_ type the heights are held as.
+    bool widthsFile; //Whether to write the _Widths.txt file. The derived quantities never need it.
+    int widthMethod; //PSD_WIDTH_ search used for the widths.
+    bool interpolateWidth; //Whether the widths are measured between interpolated crossings.
+    vector<RisetimeThresholds> risetimes; //Pairs of fractions for the integral rise time table, none to skip it.
+    GateSet gates; //Charge comparison gates, none to skip them.
+    int outputFormat; //PSD_OUTPUT_TEXT, or PSD_OUTPUT_BINARY for .psdc tables in place of the per waveform text files.
+    int baselineAdjusted; //PSD_ADJUSTED_ form of the "Baseline Adjusted" copy of each run to write, if any.
+    bool baselines; //Whether to write the robust and after pulse baselines of every waveform.
+    int rejectFlags; //PSD_FLAG_ reasons for leaving a waveform out of the pulse shape analysis.
+    int profileFormat; //PSD_PROFILE_ form of the timing report for each run, if any.
+    bool featureCache; //Whether to keep a feature store for each run in "Feature Cache" and read it back when it matches.
+};
+
+//Method to read pairs of rise time thresholds given as "low,high,low,high..." into thresholds. Returns false if the
+//list is not made of pairs of numbers.
+bool parseRisetimeThresholds(string list, vector<RisetimeThresholds> &thresholds){
+    vector<double> fractions;
+    const char *position = list.c_str();
+    while (*position != '\0'){
+        char *end;
+        fractions.push_back(strtod(position, &end));
+        if ((end == position) || ((*end != ',') && (*end != '\0'))){
+            return false;
+        }
+        position = (*end == ',') ? end + 1 : end;
+    }
+    if (fractions.empty() || (fractions.size() % 2 != 0)){
+        return false;
+    }
+    thresholds.resize(fractions.size()/2);
+    for (int j=0; j<thresholds.size(); ++j){
+        thresholds[j].low = fractions[2*j];
+        thresholds[j].high = fractions[2*j + 1];
+    }
+    return true;
+}
+
+//Method to read a list of reasons to reject waveforms, "none" or e.g. "pileup,saturation,baseline", into PSD_FLAG_
+//flags. Returns false if a reason is not known.
+bool parseRejectFlags(string list, int &flags){
+    flags = 0;
+    if (list == "none"){
+        return true;
+    }
+    stringstream reasons(list);
+    string reason;
+    while (getline(reasons, reason, ',')){
+        if (reason == "pileup"){
+            flags |= PSD_FLAG_PILEUP;
+        }else if (reason == "saturation"){
+            flags |= PSD_FLAG_SATURATED;
+        }else if (reason == "baseline"){
+            flags |= PSD_FLAG_BASELINE;
+        }else{
+            return false;
+        }
+    }
+    return true;
+}
+
+//Method to run every analysis for one run.
+void processRun(const RunJob &job, const RunOptions &options){
+    const RunSettings &settings = job.settings;
+    cout<<"             Starting at line "<<job.line<<" in File Details.txt"<<endl;
+    cout << "Filename: "<< job.filename << ", runTime: "<< job.runTime << "s, location: "
+    << job.location << ", fileDestination: " << job.fileDestination << " "<<endl
+    << "sourceDistance: "<< job.sourceDistance << "m, orientation: " << job.orientation << endl;
+    string fileDestination = job.fileDestination;
+    string filename = job.filename;
+
+    //Read the raw waveforms once and produce all of the per-waveform output files from that single pass.
+    string inFileName = runInputFileName(fileDestination + filename, settings.fileModifier);
+    AnalysisParams params;
+    params.wSize = settings.wSize;
+    params.baseLEnd = settings.baseLEnd;
+    params.threshold = 0.5;
+    params.wStart = settings.wStart;
+    params.wEnd = settings.wEnd;
+    params.peakXValue = settings.peakXValue;
+    params.tailEndXVal = settings.tailW;
+    params.PGASampleVal = settings.PGASampleVal;
+    params.sampleType = options.sampleType;
+    params.widthMethod = options.widthMethod;
+    params.interpolateWidth = options.interpolateWidth;
+    params.risetimes = options.risetimes;
+    params.gates = options.gates;
+    //The baseline after the pulse is taken from the end of the total integral window to the end of the waveform.
+    params.baselines.robust = options.baselines;
+    params.baselines.trimFraction = PSD_BASELINE_TRIM;
+    params.baselines.tailStart = settings.wEnd;
+    params.baselines.tailEnd = options.baselines ? settings.wSize : 0;
+    params.rejectFlags = options.rejectFlags;
+    params.adcMin = settings.adcMin;
+    params.adcMax = settings.adcMax;
+
+    //With --feature-cache, a run whose feature store already matches this input file and these parameters is not
+    //read again, unless it asks for tables that need more than the stored features.
+    string storeFileName = fileDestination + "Feature Cache/" + filename + "_Features.psdf";
+    FeatureStoreHeader storeKey;
+    bool storable = options.featureCache && featureStoreKey(inFileName, params, storeKey);
+    bool fromCache = storable && options.risetimes.empty() && options.gates.gates.empty() && !options.baselines
+                     && (options.baselineAdjusted == PSD_ADJUSTED_NONE) && featureStoreMatches(storeFileName, storeKey);
+
+    string widthsFileName = fileDestination + "Widths/" + filename + "_Widths.txt";
+    int format = options.outputFormat;
+    WidthsConsumer widths(widthsFileName, settings.wSize, options.widthsFile && !fromCache, format);
+    NumWavesConsumer waveCount(inFileName);
+    BaselineDeviationConsumer deviation(inFileName,
+                                        fileDestination + "Derived Quantities/Baseline Deviation.txt");
+    BaselineAverageConsumer baselineAvg(inFileName,
+                                        fileDestination + "Derived Quantities/AvgBasel.txt");
+    RejectionConsumer rejections(inFileName, fileDestination + "Derived Quantities/Rejections.txt");
+    unique_ptr<RunProfile> profile;
+    if (options.profileFormat != PSD_PROFILE_NONE){
+        profile.reset(new RunProfile(inFileName, options.numThreads));
+    }
+    if (fromCache){
+        //The per waveform tables are left as the run that wrote the store left them.
+        cout << "Reading the features of " << inFileName << " from " << storeFileName << endl;
+        vector<WaveConsumer*> consumers = {&widths, &waveCount, &deviation, &baselineAvg, &rejections};
+        ProfileThread profiling(profile.get());
+        StageClock clock(PSD_STAGE_READ);
+        replayFeatureStore(storeFileName, params, consumers);
+    }else{
+        TotalIntVsWidthConsumer totalInt(fileDestination + "Total Integral vs Width/" + filename +
+                                         "_Total_Integral_vs_Widths.txt", settings.wSize, "totalIntVsWidth", format);
+        PeakTailConsumer peakTail(fileDestination + "Tail vs Peak Integral/" + filename + "_Tail_vs_Peak_Integral.txt",
+                                  format);
+        PGAConsumer pga(fileDestination + "PGA/" + filename + "_PGA.txt", format);
+        FirstTenConsumer firstWaves(fileDestination + "First Ten/" + filename + "_First Ten.txt", format);
+        TotalIntVsWidthConsumer totalIntPBLA(fileDestination + "Total Integral vs Width PBLA/" + filename +
+                                             "_Total_Integral_vs_Width.txt", settings.wSize,
+                                             "totalIntVsWidthPostBaselineAdjusted", format);
+        vector<WaveConsumer*> consumers = {&widths, &waveCount, &totalInt, &peakTail, &pga, &firstWaves, &totalIntPBLA,
+                                           &deviation, &baselineAvg, &rejections};
+        //The baseline adjusted analyses work on the adjusted heights in memory, so the copy of the run is only written
+        //if asked for.
+        unique_ptr<WaveConsumer> baselineAdjusted;
+        string adjustedFileName = fileDestination + "Baseline Adjusted/" + filename + "_Baseline Adjusted";
+        if (options.baselineAdjusted == PSD_ADJUSTED_TEXT){
+            baselineAdjusted.reset(new BaselineAdjustConsumer(adjustedFileName + ".txt", format));
+        }else if (options.baselineAdjusted == PSD_ADJUSTED_PSDW){
+            baselineAdjusted.reset(new AdjustedWaveFileConsumer(adjustedFileName + ".psdw", settings.wSize,
+                                                                job.location, job.runTime));
+        }
+        if (baselineAdjusted){
+            consumers.insert(consumers.begin() + 6, baselineAdjusted.get());
+        }
+        unique_ptr<RisetimeConsumer> risetimes;
+        if (!options.risetimes.empty()){
+            risetimes.reset(new RisetimeConsumer(fileDestination + "Risetime vs Amplitude/" + filename +
+                                                 "_Integral_Risetime_vs_Amplitude.txt", format));
+            consumers.push_back(risetimes.get());
+        }
+        unique_ptr<GateConsumer> gates;
+        if (!options.gates.gates.empty()){
+            gates.reset(new GateConsumer(fileDestination + "Gates/" + filename + "_Gates.txt", options.gates, format));
+            consumers.push_back(gates.get());
+        }
+        unique_ptr<BaselineConsumer> baselines;
+        if (options.baselines){
+            baselines.reset(new BaselineConsumer(inFileName, fileDestination + "Baselines/" + filename +
+                                                 "_Baselines.txt", fileDestination + "Derived Quantities/Baselines.txt",
+                                                 format));
+            consumers.push_back(baselines.get());
+        }
+        unique_ptr<FeatureStoreConsumer> store;
+        if (storable){
+            store.reset(new FeatureStoreConsumer(storeFileName, storeKey));
+            consumers.push_back(store.get());
+        }
+        singlePassAnalysis(inFileName, params, consumers, options.numThreads, profile.get());
+    }
+    ProfileThread profiling(profile.get());
+    StageClock clock(PSD_STAGE_DERIVED);
+
+    //The derived quantities come from the widths counted during the pass. They are still labelled with the name of the
+    //_Widths.txt file, whether or not it was written.
+    const WidthHistogram &widthCounts = widths.histogram();
+    printWidthsDerivedQuantities(widthCounts, widthsFileName, settings.widthLowCut, settings.widthHighCut, job.runTime);
+
+    printWidthsDerivedQuantitiesOutFile(widthCounts, widthsFileName,
+                                        fileDestination + "Derived Quantities/timesandnumneutrons.txt",
+                                        settings.widthLowCut, settings.widthHighCut, job.runTime);
+
+    widthBinTimeNormalised(widthCounts,
+                           fileDestination + "Time Normalised/time_normalised_" + filename + "_Widths.txt",
+                           job.runTime, 1, settings.wSize);
+
+    //Only locations with a neutron source have a rate and efficiency to find.
+    if(settings.AmBeSourceActivity > 0){
+        WidthDerivedNeutronRate(widthCounts, widthsFileName,
+                                fileDestination + "Derived Quantities/FWHM_derived_neutron_rate.txt",
+                                settings.widthLowCut, settings.widthHighCut, job.runTime);
+
+        WidthsDerivedEfficiencies(widthCounts, widthsFileName,
+                                  fileDestination + "Derived Quantities/FWHM_derived_neutron_absolute_and_intrinsic_efficiency.txt",
+                                  job.orientation, job.sourceDistance, settings.AmBeSourceActivity, settings.widthLowCut,
+                                  settings.widthHighCut, job.runTime);
+
+    }
+
+    //peakValAverage(fileDestination+filename+fileModifier,fileDestination+"Derived Quantities/AvgPeak.txt", wSize, baseLEnd);
+    clock.next(PSD_STAGE_NONE);
+    if (profile){
+        profile->finish();
+        profile->print();
+        if (options.profileFormat == PSD_PROFILE_JSON){
+            profile->writeJSON(fileDestination + "Profiles/" + filename + "_Profile.json");
+        }else{
+            profile->appendCSV(fileDestination + "Profiles/Profile.csv");
+        }
+    }
+    cout << endl;
+}
+
+//Method to estimate the peak memory in bytes used by processRun: the reader buffers plus, in parallel mode, the pool of
+//batches in parallelPassAnalysis. Mapped input files are not counted since their pages belong to the page cache.
+double estimateRunMemory(const RunSettings &settings, int numThreads, int sampleType = PSD_SAMPLES_DOUBLE){
+    double waveBytes = (double)sampleTypeBytes(sampleType)*settings.wSize; //Raw and adjusted heights.
+    double bytes = 8.0*(1<<20) + 2*waveBytes;
+    if (numThreads > 1){
+        int batchSize = max(1, (1<<18)/settings.wSize);
+        bytes += (2.0*numThreads + 2)*batchSize*waveBytes;
+    }
+    return bytes;
+}
+
+//Method to run a list of jobs, at most maxJobs at a time and with their estimated memory adding up to no more than
+//memoryLimitGB. A job too big for the limit on its own is still run, but only once nothing else is running. Jobs are
+//started in list order and each is run with the given options.
+void runBatch(const vector<RunJob> &jobs, int maxJobs, double memoryLimitGB, const RunOptions &options){
+    mutex schedulerMutex;
+    condition_variable jobFinished;
+    int running = 0;
+    double memoryInUse = 0;
+    double memoryLimit = memoryLimitGB*1e9;
+    vector<thread> threads;
+    for (int i=0; i<jobs.size(); ++i){
+        double memory = estimateRunMemory(jobs[i].settings, options.numThreads, options.sampleType);
+        {
+            unique_lock<mutex> lock(schedulerMutex);
+            jobFinished.wait(lock, [&]{
+                return (running == 0) || ((running < maxJobs) && (memoryInUse + memory <= memoryLimit));
+            });
+            running++;
+            memoryInUse += memory;
+        }
+        threads.push_back(thread([&, i, memory]{
+            processRun(jobs[i], options);
+            {
+                lock_guard<mutex> lock(schedulerMutex);
+                running--;
+                memoryInUse -= memory;
+            }
+            jobFinished.notify_all();
+        }));
+    }
+    for (int i=0; i<threads.size(); ++i){
+        threads[i].join();
+    }
+    cout<<"                       runBatch Completed                    "<<endl;
+}
+
+//------------------------------------------------Figure of Merit Optimiser---------------------------------------------
+//Finding the PSD settings for a campaign used to mean running the analysis for each guess and fitting the results by
+//hand for FoM(). The optimiser reads a run once, keeps its baseline adjusted waveforms in memory and tries every
+//candidate width threshold and tail gate on them in parallel, fitting the gamma and neutron populations of each with
+//two Gaussians to get the figure of merit and its error.
+//----------------------------------------------------------------------------------------------------------------------
+
+//A fit is only ranked if it describes the histogram: a reduced chi squared below PSD_FOM_MAX_CHI2 and both populations
+//wider than a bin.
+#define PSD_FOM_MAX_CHI2 3.0
+//Two populations are only found if both fitted means lie in the range fitted, both amplitudes are positive and the FoM
+//is more than PSD_FOM_MIN_SIGNIFICANCE times its error and at least PSD_FOM_MIN. Below PSD_FOM_MIN the two Gaussians
+//overlap so far that they are describing the shape of a single population.
+#define PSD_FOM_MIN_SIGNIFICANCE 3.0
+#define PSD_FOM_MIN 0.5
+//Fraction of the physical memory the optimiser's WaveCache may take up when --memory-limit is not given.
+#define PSD_FOM_MEMORY_FRACTION 0.5
+
+//Histogram of a PSD parameter (x) against the total integral (y). With one y bin it is a plain histogram of x.
+class Histogram2D{
+public:
+    Histogram2D(int xBins = 1, double xLow = 0, double xHigh = 1, int yBins = 1, double yLow = 0, double yHigh = 1)
+            : xBins(xBins), yBins(yBins), xLow(xLow), xHigh(xHigh), yLow(yLow), yHigh(yHigh), counts(xBins*yBins, 0){}
+    void fill(double x, double y){
+        if ((x < xLow) || (x >= xHigh) || (y < yLow) || (y > yHigh)){
+            return;
+        }
+        //Multiplying before dividing keeps whole number x on the right bin when the bins are whole numbers wide.
+        int xBin = min((int)((x - xLow)*xBins/(xHigh - xLow)), xBins - 1);
+        int yBin = min((int)((y - yLow)*yBins/(yHigh - yLow)), yBins - 1);
+        counts[yBin*xBins + xBin]++;
+    }
+    void add(const Histogram2D &other){
+        for (int i=0; i<counts.size(); ++i){
+            counts[i] += other.counts[i];
+        }
+    }
+    //Method to sum the counts over the y bins, giving the histogram of x alone.
+    vector<double> projectX() const{
+        vector<double> projection(xBins, 0);
+        for (int yBin=0; yBin<yBins; ++yBin){
+            for (int xBin=0; xBin<xBins; ++xBin){
+                projection[xBin] += counts[yBin*xBins + xBin];
+            }
+        }
+        return projection;
+    }
+    double xLowEdge() const{
+        return xLow;
+    }
+    double xBinWidth() const{
+        return (xHigh - xLow)/xBins;
+    }
+    //Method to write the filled bins as "x y count" lines, x and y being the bin centres.
+    void write(string outFileName) const{
+        OutputFile f_out(outFileName);
+        if (!f_out.is_open()){
+            cout << "Unable to open file: " + outFileName << endl;
+            return;
+        }
+        for (int yBin=0; yBin<yBins; ++yBin){
+            for (int xBin=0; xBin<xBins; ++xBin){
+                if (counts[yBin*xBins + xBin] > 0){
+                    f_out << xLow + (xBin + 0.5)*(xHigh - xLow)/xBins << " " << yLow + (yBin + 0.5)*(yHigh - yLow)/yBins
+                    << " " << counts[yBin*xBins + xBin] << endl;
+                }
+            }
+        }
+        f_out.close();
+    }
+private:
+    int xBins, yBins;
+    double xLow, xHigh, yLow, yHigh;
+    vector<double> counts;
+};
+
+//Method to solve matrix*solution = rhs for an n by n matrix stored by rows, by Gaussian elimination with partial
+//pivoting. rhs holds numRhs columns, also stored by rows, and is replaced by the solution. Returns false if the
+//matrix is singular.
+bool solveLinear(vector<double> matrix, vector<double> &rhs, int n, int numRhs){
+    for (int col=0; col<n; ++col){
+        int pivot = col;
+        for (int row=col+1; row<n; ++row){
+            if (abs(matrix[row*n + col]) > abs(matrix[pivot*n + col])){
+                pivot = row;
+            }
+        }
+        if (matrix[pivot*n + col] == 0){
+            return false;
+        }
+        for (int k=0; k<n; ++k){
+            swap(matrix[col*n + k], matrix[pivot*n + k]);
+        }
+        for (int k=0; k<numRhs; ++k){
+            swap(rhs[col*numRhs + k], rhs[pivot*numRhs + k]);
+        }
+        for (int row=0; row<n; ++row){
+            if (row == col){
+                continue;
+            }
+            double factor = matrix[row*n + col]/matrix[col*n + col];
+            for (int k=col; k<n; ++k){
+                matrix[row*n + k] -= factor*matrix[col*n + k];
+            }
+            for (int k=0; k<numRhs; ++k){
+                rhs[row*numRhs + k] -= factor*rhs[col*numRhs + k];
+            }
+        }
+    }
+    for (int row=0; row<n; ++row){
+        for (int k=0; k<numRhs; ++k){
+            rhs[row*numRhs + k] /= matrix[row*n + row];
+        }
+    }
+    return true;
+}
+
+//Method to evaluate the sum of two Gaussians with parameters {amplitude, mean, sigma, amplitude, mean, sigma} at x,
+//writing the derivatives with respect to each parameter to gradient.
+double doubleGaussian(const double *parameters, double x, double *gradient){
+    double value = 0;
+    for (int k=0; k<2; ++k){
+        double amplitude = parameters[3*k], mean = parameters[3*k + 1], sigma = parameters[3*k + 2];
+        double z = (x - mean)/sigma, e = exp(-0.5*z*z);
+        value += amplitude*e;
+        gradient[3*k] = e;
+        gradient[3*k + 1] = amplitude*e*z/sigma;
+        gradient[3*k + 2] = amplitude*e*z*z/sigma;
+    }
+    return value;
+}
+
+//Result of fitting the gamma and neutron populations in a histogram of a PSD parameter. Population 0 has the lower
+//mean, which for both the widths and the tail/total ratio is the gammas, and population 1 the neutrons.
+struct PSDFit{
+    bool found; //False if the histogram did not show two populations, the fit failed or failed the checks.
+    double amplitude[2], mean[2], sigma[2];
+    double meanError[2], sigmaError[2];
+    double chiSquaredPerDoF;
+    double rangeLow, rangeHigh; //Range of the parameter fitted.
+    double binWidth; //Width of the bins fitted.
+    double FoM, FoMError;
+};
+
+//Method to fit two Gaussians to counts by weighted least squares (Levenberg-Marquardt, Poisson weights) starting from
+//parameters, and to fill the parameters, their errors and the reduced chi squared of the fit. The errors are scaled up
+//by the reduced chi squared when it is above 1.
+bool fitDoubleGaussian(const vector<double> &x, const vector<double> &counts, double *parameters, double *errors,
+                       double &chiSquaredPerDoF){
+    const int numParameters = 6;
+    int n = x.size();
+    if (n <= numParameters){
+        return false;
+    }
+    double gradient[numParameters];
+    double lambda = 1e-3;
+    vector<double> hessian(numParameters*numParameters), step(numParameters);
+    //Method to get chi squared and, if asked for, the Gauss-Newton hessian and the gradient for a set of parameters.
+    auto evaluate = [&](const double *trial, bool derivatives){
+        double chiSquared = 0;
+        if (derivatives){
+            fill(hessian.begin(), hessian.end(), 0.0);
+            fill(step.begin(), step.end(), 0.0);
+        }
+        for (int i=0; i<n; ++i){
+            double weight = 1.0/max(counts[i], 1.0);
+            double residual = counts[i] - doubleGaussian(trial, x[i], gradient);
+            chiSquared += weight*residual*residual;
+            if (derivatives){
+                for (int j=0; j<numParameters; ++j){
+                    step[j] += weight*residual*gradient[j];
+                    for (int k=0; k<numParameters; ++k){
+                        hessian[j*numParameters + k] += weight*gradient[j]*gradient[k];
+                    }
+                }
+            }
+        }
+        return chiSquared;
+    };
+    double chiSquared = evaluate(parameters, true);
+    for (int iteration=0; iteration<500; ++iteration){
+        vector<double> damped = hessian, delta = step;
+        for (int j=0; j<numParameters; ++j){
+            damped[j*numParameters + j] *= 1 + lambda;
+        }
+        if (!solveLinear(damped, delta, numParameters, 1)){
+            return false;
+        }
+        double trial[numParameters];
+        for (int j=0; j<numParameters; ++j){
+            trial[j] = parameters[j] + delta[j];
+        }
+        trial[2] = abs(trial[2]);
+        trial[5] = abs(trial[5]);
+        double trialChiSquared = evaluate(trial, false);
+        //Steps are taken while they lower chi squared, and the damping raised until none can.
+        if (trialChiSquared < chiSquared){
+            copy(trial, trial + numParameters, parameters);
+            chiSquared = evaluate(parameters, true);
+            lambda = max(lambda/10, 1e-12);
+        }else{
+            lambda *= 10;
+            if (lambda > 1e12){
+                break;
+            }
+        }
+    }
+    //Errors from the inverse of the hessian at the minimum.
+    vector<double> covariance(numParameters*numParameters, 0.0);
+    for (int j=0; j<numParameters; ++j){
+        covariance[j*numParameters + j] = 1;
+    }
+    if ((parameters[2] <= 0) || (parameters[5] <= 0) || !solveLinear(hessian, covariance, numParameters, numParameters)){
+        return false;
+    }
+    chiSquaredPerDoF = chiSquared/(n - numParameters);
+    for (int j=0; j<numParameters; ++j){
+        errors[j] = sqrt(abs(covariance[j*numParameters + j])*max(1.0, chiSquaredPerDoF));
+    }
+    return true;
+}
+
+//Method to find the two populations in a histogram of a PSD parameter, fit them and work out the figure of merit. The
+//fit covers the central 99% of the entries, regrouped into at most 100 bins, and starts from the highest peak and the
+//highest other peak separated from it by a dip. found is left false unless the fit passes the checks above
+//PSD_FOM_MIN_SIGNIFICANCE.
+PSDFit fitPSDHistogram(const vector<double> &counts, double xLow, double binWidth){
+    PSDFit fit;
+    fit.found = false;
+    fit.FoM = fit.FoMError = 0;
+    fit.rangeLow = xLow;
+    fit.rangeHigh = xLow + counts.size()*binWidth;
+    double total = 0;
+    for (int i=0; i<counts.size(); ++i){
+        total += counts[i];
+    }
+    if (total == 0){
+        return fit;
+    }
+    int first = 0, last = counts.size() - 1;
+    double running = 0;
+    for (int i=0; i<counts.size(); ++i){
+        running += counts[i];
+        if (running <= 0.005*total){
+            first = i + 1;
+        }
+        if (running < 0.995*total){
+            last = i + 1;
+        }
+    }
+    last = min(last, (int)counts.size() - 1);
+    int group = max(1, (int)ceil((last - first + 1)/100.0));
+    vector<double> x, y;
+    for (int i=first; i<=last; i+=group){
+        double sum = 0;
+        for (int j=i; (j<i+group) && (j<counts.size()); ++j){
+            sum += counts[j];
+        }
+        x.push_back(xLow + (i + 0.5*group)*binWidth);
+        y.push_back(sum);
+    }
+    fit.rangeLow = xLow + first*binWidth;
+    fit.rangeHigh = xLow + (first + x.size()*group)*binWidth;
+    fit.binWidth = group*binWidth;
+    int n = y.size();
+    if (n < 8){
+        return fit;
+    }
+    //Starting values from a smoothed copy.
+    vector<double> smooth(n, 0);
+    for (int i=0; i<n; ++i){
+        int numSummed = 0;
+        for (int j=max(0, i-2); j<=min(n-1, i+2); ++j){
+            smooth[i] += y[j];
+            numSummed++;
+        }
+        smooth[i] /= numSummed;
+    }
+    int peaks[2];
+    peaks[0] = max_element(smooth.begin(), smooth.end()) - smooth.begin();
+    peaks[1] = -1;
+    for (int i=0; i<n; ++i){
+        bool localMax = ((i == 0) || (smooth[i] >= smooth[i-1])) && ((i == n-1) || (smooth[i] >= smooth[i+1]));
+        if (!localMax || (i == peaks[0]) || (smooth[i] < 0.01*smooth[peaks[0]])){
+            continue;
+        }
+        double valley = smooth[i];
+        for (int j=min(i, peaks[0]); j<=max(i, peaks[0]); ++j){
+            valley = min(valley, smooth[j]);
+        }
+        if ((valley < 0.7*smooth[i]) && ((peaks[1] < 0) || (smooth[i] > smooth[peaks[1]]))){
+            peaks[1] = i;
+        }
+    }
+    if (peaks[1] < 0){
+        return fit;
+    }
+    double parameters[6], errors[6];
+    for (int k=0; k<2; ++k){
+        //Half width at half maximum, going away from the other peak.
+        int direction = (peaks[k] < peaks[1-k]) ? -1 : 1, edge = peaks[k];
+        while ((edge + direction >= 0) && (edge + direction < n) && (smooth[edge] > 0.5*smooth[peaks[k]])){
+            edge += direction;
+        }
+        parameters[3*k] = smooth[peaks[k]];
+        parameters[3*k + 1] = x[peaks[k]];
+        parameters[3*k + 2] = max(abs(x[edge] - x[peaks[k]]), 0.5*group*binWidth)/1.1774;
+    }
+    if (!fitDoubleGaussian(x, y, parameters, errors, fit.chiSquaredPerDoF)){
+        return fit;
+    }
+    int order[2] = {0, 1};
+    if (parameters[4] < parameters[1]){
+        swap(order[0], order[1]);
+    }
+    for (int k=0; k<2; ++k){
+        fit.amplitude[k] = parameters[3*order[k]];
+        fit.mean[k] = parameters[3*order[k] + 1];
+        fit.sigma[k] = parameters[3*order[k] + 2];
+        fit.meanError[k] = errors[3*order[k] + 1];
+        fit.sigmaError[k] = errors[3*order[k] + 2];
+    }
+    if ((fit.amplitude[0] <= 0) || (fit.amplitude[1] <= 0)){
+        return fit;
+    }
+    for (int k=0; k<2; ++k){
+        if ((fit.mean[k] < fit.rangeLow) || (fit.mean[k] > fit.rangeHigh)){
+            return fit;
+        }
+    }
+    //FWHM = 2 sqrt(2 ln 2) sigma.
+    const double FWHMPerSigma = 2.35482;
+    fit.FoM = figureOfMerit(fit.mean[1] - fit.mean[0], sqrt(fit.meanError[0]*fit.meanError[0] +
+                                                            fit.meanError[1]*fit.meanError[1]),
+                            FWHMPerSigma*fit.sigma[0], FWHMPerSigma*fit.sigmaError[0],
+                            FWHMPerSigma*fit.sigma[1], FWHMPerSigma*fit.sigmaError[1], fit.FoMError);
+    fit.found = (fit.FoM >= PSD_FOM_MIN) && (fit.FoM > PSD_FOM_MIN_SIGNIFICANCE*fit.FoMError);
+    return fit;
+}
+
+//Method to return the size of the physical memory in bytes, or 0 if it is not known.
+size_t physicalMemory(){
+#ifdef PSD_POSIX_IO
+    long pages = sysconf(_SC_PHYS_PAGES), pageSize = sysconf(_SC_PAGE_SIZE);
+    if ((pages > 0) && (pageSize > 0)){
+        return (size_t)pages*pageSize;
+    }
+#endif
+    return 0;
+}
+
+//Baseline adjusted waveforms of one run held in memory as floats, with what the optimiser needs from the analysis of
+//each of them.
+struct WaveCache{
+    int wSize;
+    size_t maxHeights; //Most heights adjusted may hold.
+    bool full; //Whether a waveform did not fit within maxHeights, in which case the cache is emptied.
+    vector<float> adjusted; //wSize heights for each waveform in turn.
+    vector<int> peakIndex;
+    vector<double> totalInt;
+    int numWaves() const{
+        return peakIndex.size();
+    }
+    const float *wave(int index) const{
+        return adjusted.data() + (size_t)index*wSize;
+    }
+};
+
+//Copies every waveform from the engine that is not rejected into a WaveCache, until it would hold more than
+//maxHeights heights.
+class WaveCacheConsumer : public WaveConsumer{
+public:
+    WaveCacheConsumer(WaveCache &cache) : cache(cache){}
+    void processWave(const Waveform &wave){
+        if (wave.rejected || cache.full){
+            return;
+        }
+        if (cache.adjusted.size() + wave.size > cache.maxHeights){
+            cache.full = true;
+            vector<float>().swap(cache.adjusted);
+            vector<int>().swap(cache.peakIndex);
+            vector<double>().swap(cache.totalInt);
+            return;
+        }
+        for (int i=0; i<wave.size; ++i){
+            cache.adjusted.push_back(wave.adjustedAt(i));
+        }
+        cache.peakIndex.push_back(wave.peakIndex);
+        cache.totalInt.push_back(wave.totalInt);
+    }
+private:
+    WaveCache &cache;
+};
+
+//One setting tried by the optimiser: a width threshold, or a tail gate for the tail/total ratio.
+struct FoMCandidate{
+    string description;
+    double threshold; //Fraction of the maximum height the width is measured at, for a width candidate.
+    int tailGate; //Index of the tail gate in the optimiser's GateSet, or -1 for a width candidate.
+    Histogram2D histogram;
+    PSDFit fit;
+};
+
+//Method to work out the PSD parameter of a candidate for waveform index of the cache. gateSums must already hold the
+//gates of the waveform for gate candidates. Returns false if the waveform is left out, as the Widths method leaves out
+//widths of 0 or above 80% of the waveform.
+bool candidateValue(const FoMCandidate &candidate, const WaveCache &cache, int index, const double *gateSums,
+                    double &value){
+    if (candidate.tailGate < 0){
+        const float *wave = cache.wave(index);
+        int peak = cache.peakIndex[index];
+        PulseEdges edges = findPulseEdges(wave, cache.wSize, candidate.threshold*abs(wave[peak]), peak,
+                                          PSD_WIDTH_OUTERMOST, false);
+        value = edges.high - edges.low;
+        return (value < 0.8*cache.wSize) && (value > 0.0);
+    }
+    if (gateSums[0] == 0){
+        return false;
+    }
+    value = gateSums[candidate.tailGate]/gateSums[0];
+    return true;
+}
+
+//Method to search the width thresholds and tail gates for the best figure of merit for a run, using the wSize,
+//baseline, total integral window and tail window of its location. The waveforms are read once with numThreads
+//threads, and the candidates are then tried over the cached waveforms with the waveforms split between the threads.
+//The best candidate's histogram against the total integral is written to inFileName + "_FoM_Histogram.txt". The cache may
+//take up at most memoryLimit bytes, or PSD_FOM_MEMORY_FRACTION of the physical memory if memoryLimit is 0.
+void optimiseFoM(string inFileName, string location, int numThreads, size_t memoryLimit){
+    RunSettings settings;
+    if (!locationSettings(location, settings)){
+        cout << location << " not found in optimiseFoM with filename: " + inFileName << endl;
+        return;
+    }
+    AnalysisParams params;
+    params.wSize = settings.wSize;
+    params.baseLEnd = settings.baseLEnd;
+    params.threshold = 0.5;
+    params.wStart = settings.wStart;
+    params.wEnd = settings.wEnd;
+    params.peakXValue = settings.peakXValue;
+    params.tailEndXVal = settings.tailW;
+    params.PGASampleVal = settings.PGASampleVal;
+    params.sampleType = PSD_SAMPLES_DOUBLE;
+    params.widthMethod = PSD_WIDTH_OUTERMOST;
+    params.interpolateWidth = false;
+    params.baselines.robust = false;
+    params.baselines.tailStart = params.baselines.tailEnd = 0;
+    //Every waveform is kept, as in the batch runs unless --reject is given.
+    params.rejectFlags = 0;
+    params.adcMin = settings.adcMin;
+    params.adcMax = settings.adcMax;
+
+    //Read and cache the run.
+    if (memoryLimit == 0){
+        memoryLimit = PSD_FOM_MEMORY_FRACTION*physicalMemory();
+    }
+    WaveCache cache;
+    cache.wSize = settings.wSize;
+    cache.maxHeights = (memoryLimit > 0) ? memoryLimit/sizeof(float) : numeric_limits<size_t>::max();
+    cache.full = false;
+    WaveCacheConsumer cacheConsumer(cache);
+    vector<WaveConsumer*> consumers = {&cacheConsumer};
+    singlePassAnalysis(inFileName, params, consumers, numThreads);
+    if (cache.full){
+        cout << "The waveforms of " << inFileName << " need more than " << memoryLimit/1e6
+        << " MB to cache, give a larger --memory-limit or optimise on a shorter run" << endl;
+        return;
+    }
+    int numWaves = cache.numWaves();
+    cout << "Cached " << numWaves << " waveforms (" << cache.adjusted.size()*sizeof(float)/1e6 << " MB)" << endl;
+    if (numWaves == 0){
+        return;
+    }
+
+    //Width thresholds from 20% to 80% of the maximum, and tail gates starting from just after the peak to half way
+    //along the usual tail window, each against the usual total integral window.
+    GateSet gateSet;
+    gateSet.onsetFraction = 0.1;
+    gateSet.tailGate = gateSet.totalGate = -1;
+    Gate total = {"total", PSD_GATE_ABSOLUTE, settings.wStart, settings.wEnd};
+    gateSet.gates.push_back(total);
+    int tailLength = max(2, settings.tailW - settings.peakXValue);
+    vector<FoMCandidate> candidates;
+    for (int k=4; k<=16; ++k){
+        FoMCandidate candidate;
+        candidate.threshold = 0.05*k;
+        candidate.tailGate = -1;
+        candidate.description = "width at " + to_string((int)round(100*candidate.threshold)) + "% of maximum";
+        candidate.histogram = Histogram2D((int)ceil(0.8*settings.wSize), 0, ceil(0.8*settings.wSize));
+        candidates.push_back(candidate);
+    }
+    for (int k=1; k<=20; ++k){
+        Gate tail = {"tail", PSD_GATE_PEAK, max(1, (int)round(k*tailLength/40.0)), tailLength};
+        FoMCandidate candidate;
+        candidate.threshold = 0;
+        candidate.tailGate = gateSet.gates.size();
+        candidate.description = "tail/total, tail from peak+" + to_string(tail.start) + " to peak+" + to_string(tail.end);
+        candidate.histogram = Histogram2D(1000, 0, 1);
+        candidates.push_back(candidate);
+        gateSet.gates.push_back(tail);
+    }
+
+    //Fill a histogram for every candidate, with each thread taking a share of the waveforms.
+    numThreads = max(1, min(numThreads, numWaves));
+    vector<vector<Histogram2D> > threadHistograms(numThreads);
+    vector<thread> threads;
+    for (int t=0; t<numThreads; ++t){
+        threads.push_back(thread([&, t]{
+            vector<Histogram2D> &histograms = threadHistograms[t];
+            for (int c=0; c<candidates.size(); ++c){
+                histograms.push_back(candidates[c].histogram);
+            }
+            vector<double> prefix, gateSums(gateSet.gates.size());
+            int first = (long long)numWaves*t/numThreads, last = (long long)numWaves*(t+1)/numThreads;
+            for (int index=first; index<last; ++index){
+                int peak = cache.peakIndex[index];
+                evaluateGates(cache.wave(index), cache.wSize, gateSet, 0, peak, prefix, gateSums.data());
+                for (int c=0; c<candidates.size(); ++c){
+                    double value;
+                    if (candidateValue(candidates[c], cache, index, gateSums.data(), value)){
+                        histograms[c].fill(value, 0);
+                    }
+                }
+            }
+        }));
+    }
+    for (int t=0; t<numThreads; ++t){
+        threads[t].join();
+        for (int c=0; c<candidates.size(); ++c){
+            if (t == 0){
+                candidates[c].histogram = threadHistograms[t][c];
+            }else{
+                candidates[c].histogram.add(threadHistograms[t][c]);
+            }
+        }
+    }
+
+    //Fit every candidate and report.
+    int best = -1;
+    for (int c=0; c<candidates.size(); ++c){
+        FoMCandidate &candidate = candidates[c];
+        candidate.fit = fitPSDHistogram(candidate.histogram.projectX(), candidate.histogram.xLowEdge(),
+                                        candidate.histogram.xBinWidth());
+        cout << candidate.description << ": ";
+        if (!candidate.fit.found){
+            cout << "no two populations found" << endl;
+            continue;
+        }
+        cout << "FoM " << candidate.fit.FoM << " +- " << candidate.fit.FoMError << " (means " << candidate.fit.mean[0]
+        << ", " << candidate.fit.mean[1] << ", sigmas " << candidate.fit.sigma[0] << ", " << candidate.fit.sigma[1]
+        << ", chi^2/dof " << candidate.fit.chiSquaredPerDoF << ")";
+        if (candidate.fit.chiSquaredPerDoF > PSD_FOM_MAX_CHI2){
+            cout << " not ranked, poor fit" << endl;
+            continue;
+        }
+        if ((candidate.fit.sigma[0] < candidate.fit.binWidth) || (candidate.fit.sigma[1] < candidate.fit.binWidth)){
+            cout << " not ranked, narrower than a bin" << endl;
+            continue;
+        }
+        cout << endl;
+        if ((best < 0) || (candidate.fit.FoM > candidates[best].fit.FoM)){
+            best = c;
+        }
+    }
+    if (best < 0){
+        cout << "No setting separated the neutrons from the gammas in " << inFileName << endl;
+        return;
+    }
+    const FoMCandidate &winner = candidates[best];
+    const PSDFit &fit = winner.fit;
+    cout << "Best setting for " << inFileName << ": " << winner.description << endl
+    << "FoM " << fit.FoM << " +- " << fit.FoMError << endl
+    << "gammas:   mean " << fit.mean[0] << " +- " << fit.meanError[0] << ", sigma " << fit.sigma[0] << " +- "
+    << fit.sigmaError[0] << endl
+    << "neutrons: mean " << fit.mean[1] << " +- " << fit.meanError[1] << ", sigma " << fit.sigma[1] << " +- "
+    << fit.sigmaError[1] << endl;
+    if (winner.tailGate < 0){
+        //The low cut goes where the two fitted populations are equally likely, the high cut 3 sigma above the neutrons.
+        double lowCut = fit.mean[0];
+        for (int i=0; i<=1000; ++i){
+            double width = fit.mean[0] + (fit.mean[1] - fit.mean[0])*i/1000.0;
+            double gammas = fit.amplitude[0]*exp(-0.5*pow((width - fit.mean[0])/fit.sigma[0], 2));
+            double neutrons = fit.amplitude[1]*exp(-0.5*pow((width - fit.mean[1])/fit.sigma[1], 2));
+            lowCut = width;
+            if (neutrons >= gammas){
+                break;
+            }
+        }
+        cout << "Suggested widthLowCut " << lowCut << " and widthHighCut " << fit.mean[1] + 3*fit.sigma[1]
+        << " (currently " << settings.widthLowCut << " and " << settings.widthHighCut << ")" << endl;
+    }
+
+    //Histogram of the best setting against the total integral, over the range fitted.
+    double largestIntegral = 0;
+    for (int index=0; index<numWaves; ++index){
+        largestIntegral = max(largestIntegral, abs(cache.totalInt[index]));
+    }
+    //Widths are whole samples, so their bins are kept a whole number of samples wide.
+    int xBins = 200;
+    double xHigh = fit.rangeHigh;
+    if (winner.tailGate < 0){
+        int binWidth = max(1, (int)ceil((fit.rangeHigh - fit.rangeLow)/200));
+        xBins = ceil((fit.rangeHigh - fit.rangeLow)/binWidth);
+        xHigh = fit.rangeLow + xBins*binWidth;
+    }
+    Histogram2D histogram(xBins, fit.rangeLow, xHigh, 100, 0, max(largestIntegral, 1.0));
+    vector<double> prefix, gateSums(gateSet.gates.size());
+    for (int index=0; index<numWaves; ++index){
+        double value;
+        if (winner.tailGate >= 0){
+            evaluateGates(cache.wave(index), cache.wSize, gateSet, 0, cache.peakIndex[index], prefix, gateSums.data());
+        }
+        if (candidateValue(winner, cache, index, gateSums.data(), value)){
+            histogram.fill(value, abs(cache.totalInt[index]));
+        }
+    }
+    histogram.write(inFileName + "_FoM_Histogram.txt");
+    cout<<"                       optimiseFoM Completed                    "<<endl;
+}
+
+//-----------------------------------------------------Feature Queries--------------------------------------------------
+//Cut and count and histograms over the columns of a feature store, so several features can be cut on together without
+//reading the run again. Each cut keeps low <= value < high in one column, and the cuts are applied a column at a time
+//over each block of the store.
+//----------------------------------------------------------------------------------------------------------------------
+
+//A cut keeping the rows of a feature store with low <= value < high in one column.
+struct FeatureCut{
+    int column; //PSD_FEATURE_ column.
+    double low;
+    double high;
+};
+
+//An axis of a histogram of a feature store. A column of -1 is no axis.
+struct FeatureAxis{
+    int column;
+    int bins;
+    double low;
+    double high;
+};
+
+//Method to split "a:b:c" into "a b c" for reading with >>.
+string colonsToSpaces(string text){
+    replace(text.begin(), text.end(), ':', ' ');
+    return text;
+}
+
+//Method to read cuts given as "column:low:high,..." e.g. "width:5:50,rejected:0:1". Returns false if any cut cannot be
+//read or names an unknown column.
+bool parseFeatureCuts(string list, vector<FeatureCut> &cuts){
+    cuts.clear();
+    stringstream cutList(list);
+    string cutText;
+    while (getline(cutList, cutText, ',')){
+        stringstream fields(colonsToSpaces(cutText));
+        string name, extra;
+        FeatureCut cut;
+        if (!(fields >> name >> cut.low >> cut.high) || (fields >> extra)){
+            return false;
+        }
+        cut.column = featureColumn(name);
+        if (cut.column < 0){
+            return false;
+        }
+        cuts.push_back(cut);
+    }
+    return true;
+}
+
+//Method to read the axes of a histogram given as "column:bins:low:high" or "x:bins:low:high,y:bins:low:high", e.g.
+//"width:50:0:50,totalInt:100:0:100000". y has no column if only x is given. Returns false if an axis cannot be read.
+bool parseFeatureAxes(string list, FeatureAxis &x, FeatureAxis &y){
+    FeatureAxis *axes[2] = {&x, &y};
+    y.column = -1;
+    y.bins = 1;
+    y.low = 0;
+    y.high = 1;
+    stringstream axisList(list);
+    string axisText;
+    int numAxes = 0;
+    while (getline(axisList, axisText, ',')){
+        if (numAxes == 2){
+            return false;
+        }
+        FeatureAxis &axis = *axes[numAxes++];
+        stringstream fields(colonsToSpaces(axisText));
+        string name, extra;
+        if (!(fields >> name >> axis.bins >> axis.low >> axis.high) || (fields >> extra)){
+            return false;
+        }
+        axis.column = featureColumn(name);
+        if ((axis.column < 0) || (axis.bins <= 0) || !(axis.high > axis.low)){
+            return false;
+        }
+    }
+    return numAxes > 0;
+}
+
+//Method to mark the rows of a block of a store that pass every cut, with a 1 in pass and otherwise 0.
+void selectFeatureRows(const FeatureStore &store, int block, const vector<FeatureCut> &cuts,
+                       vector<unsigned char> &pass){
+    int n = store.blockSize(block);
+    pass.assign(n, 1);
+    for (int k=0; k<cuts.size(); ++k){
+        const double *values = store.column(cuts[k].column, block);
+        double low = cuts[k].low, high = cuts[k].high;
+        for (int i=0; i<n; ++i){
+            pass[i] &= (values[i] >= low) & (values[i] < high);
+        }
+    }
+}
+
+//Method to count the rows of a store that pass every cut.
+long long countFeatures(const FeatureStore &store, const vector<FeatureCut> &cuts){
+    vector<unsigned char> pass;
+    long long count = 0;
+    for (int block=0; block<store.numBlocks(); ++block){
+        selectFeatureRows(store, block, cuts, pass);
+        for (int i=0; i<pass.size(); ++i){
+            count += pass[i];
+        }
+    }
+    return count;
+}
+
+//Method to histogram the rows of a store that pass every cut, x against y, or x alone if y has no column.
+Histogram2D histogramFeatures(const FeatureStore &store, const FeatureAxis &x, const FeatureAxis &y,
+                              const vector<FeatureCut> &cuts){
+    Histogram2D histogram(x.bins, x.low, x.high, y.bins, y.low, y.high);
+    vector<unsigned char> pass;
+    for (int block=0; block<store.numBlocks(); ++block){
+        selectFeatureRows(store, block, cuts, pass);
+        const double *xValues = store.column(x.column, block);
+        const double *yValues = (y.column >= 0) ? store.column(y.column, block) : NULL;
+        for (int i=0; i<pass.size(); ++i){
+            if (pass[i]){
+                histogram.fill(xValues[i], (yValues != NULL) ? yValues[i] : y.low);
+            }
+        }
+    }
+    return histogram;
+}
+
+//Method to count the waveforms in a feature store that pass the cuts in where, and if axes are given, to write their
+//histogram to histogramFileName as "x y count" lines. Returns false if the store or the query cannot be read.
+bool queryFeatures(string storeFileName, string where, string axes, string histogramFileName){
+    vector<FeatureCut> cuts;
+    if (!parseFeatureCuts(where, cuts)){
+        cout << "Cuts must be column:low:high, with column one of";
+        for (int column=0; column<PSD_NUM_FEATURES; ++column){
+            cout << " " << featureNames[column];
+        }
+        cout << endl;
+        return false;
+    }
+    FeatureAxis x, y;
+    if (!axes.empty() && !parseFeatureAxes(axes, x, y)){
+        cout << "Histogram axes must be column:bins:low:high, or two of them separated by a comma" << endl;
+        return false;
+    }
+    FeatureStore store(storeFileName);
+    if (!store.is_open()){
+        return false;
+    }
+    cout << countFeatures(store, cuts) << " of " << store.numWaves() << " waveforms in " << storeFileName
+         << " pass the cuts" << endl;
+    if (!axes.empty()){
+        histogramFeatures(store, x, y, cuts).write(histogramFileName);
+        cout << "Histogram written to " << histogramFileName << endl;
+    }
+    return true;
+}
+
+//---------------------------------------------------Live Acquisition---------------------------------------------------
+//Everything above runs once a run is over. In live mode the waveforms are read from standard input, a FIFO or a local
+//TCP port as the digitiser writes them, classified by width as they arrive, and the neutron and non-neutron rates and
+//flux over a rolling window are published every few seconds, so that drifts show up during the run rather than after.
+//----------------------------------------------------------------------------------------------------------------------
+
+//A window rate further than this many standard deviations from the rate over the whole run so far is marked as a drift.
+#define PSD_LIVE_DRIFT_SIGMA 3.0
+
+//Neutron and non-neutron counts in one second bins, covering the last window seconds of a live run. One extra bin is
+//kept for events arriving in the second being published.
+class RollingCounts{
+public:
+    RollingCounts(int window) : window(window), neutrons(window + 1, 0), rejections(window + 1, 0), latest(-1){}
+    //Method to count one event arriving in the given second of the run.
+    void add(long long second, bool neutron){
+        advance(second);
+        if (neutron){
+            neutrons[second % neutrons.size()]++;
+        }else{
+            rejections[second % rejections.size()]++;
+        }
+    }
+    //Method to total the counts over the window seconds before end, or since the start if that is sooner.
+    void sum(long long end, long long &numNeutrons, long long &numRejections){
+        advance(end - 1);
+        numNeutrons = numRejections = 0;
+        for (long long second = max(0LL, end - window); second < end; ++second){
+            numNeutrons += neutrons[second % neutrons.size()];
+            numRejections += rejections[second % rejections.size()];
+        }
+    }
+private:
+    //Method to empty the bins of the seconds after the latest one counted, up to second.
+    void advance(long long second){
+        for (long long next = max(latest + 1, second - window); next <= second; ++next){
+            neutrons[next % neutrons.size()] = 0;
+            rejections[next % rejections.size()] = 0;
+        }
+        latest = max(latest, second);
+    }
+    int window;
+    vector<long long> neutrons, rejections;
+    long long latest; //Latest second counted so far.
+};
+
+//Method to classify the waveforms arriving on source by width as they come in, and every interval seconds print the
+//neutron and non-neutron rates and the neutron flux over the last window seconds, with the same neutron cut as
+//printWidthsDerivedQuantities. Each report is also appended to logFileName, if given, as
+//"time window neutrons nonNeutrons neutronRate error nonNeutronRate error flux error drift". The derived quantities of
+//the whole run are printed once the source closes.
+void liveAnalysis(string source, string location, const RunOptions &options, double lowCut, double highCut,
+                  int interval, int window, string logFileName){
+    RunSettings settings;
+    if (!locationSettings(location, settings)){
+        cout << location << " not found in liveAnalysis with filename: " + source << endl;
+        return;
+    }
+    AnalysisParams params;
+    params.wSize = settings.wSize;
+    params.baseLEnd = settings.baseLEnd;
+    params.threshold = 0.5;
+    params.wStart = settings.wStart;
+    params.wEnd = settings.wEnd;
+    params.peakXValue = settings.peakXValue;
+    params.tailEndXVal = settings.tailW;
+    params.PGASampleVal = settings.PGASampleVal;
+    params.sampleType = PSD_SAMPLES_DOUBLE;
+    params.widthMethod = options.widthMethod;
+    params.interpolateWidth = options.interpolateWidth;
+    params.baselines.robust = false;
+    params.baselines.tailStart = params.baselines.tailEnd = 0;
+    params.rejectFlags = options.rejectFlags;
+    params.adcMin = settings.adcMin;
+    params.adcMax = settings.adcMax;
+
+    WaveReader f_in(source);
+    if (!f_in.is_open()){
+        cout << " not found in liveAnalysis with filename: " + source << endl;
+        return;
+    }
+    ofstream f_log;
+    if (!logFileName.empty()){
+        f_log.open(logFileName, ios::out | ios::app);
+        if (!f_log.is_open()){
+            cout << "Unable to open file: " + logFileName << endl;
+        }
+    }
+    cout << "Live analysis of " << source << " at " << location << ": neutron widths " << lowCut << " to " << highCut
+    << ", reporting every " << interval << "s over the last " << window << "s" << endl;
+
+    //The reader thread analyses each waveform as soon as it is complete, while this thread wakes up to report, so a
+    //report is never held up waiting for data.
+    mutex countsMutex;
+    condition_variable readerFinished;
+    bool finished = false;
+    RollingCounts recent(window);
+    WidthHistogram widths(settings.wSize);
+    long long runNeutrons = 0, runRejections = 0;
+    int minWidth = max(0, (int)ceil(lowCut));
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    thread reader([&]{
+        WaveBuffer<double> buffer;
+        buffer.wave.index = 0;
+        while (f_in.nextWave(buffer.raw, params.wSize)){
+            analyseWave(buffer, params);
+            long long second = chrono::duration_cast<chrono::seconds>(chrono::steady_clock::now() - start).count();
+            //Noise cases are left out, as in the Widths method.
+            if ((buffer.wave.width < 0.8*settings.wSize) && (buffer.wave.width > 0.0) && !buffer.wave.rejected){
+                int width = round(buffer.wave.width);
+                bool neutron = (width >= minWidth) && (width <= highCut);
+                lock_guard<mutex> lock(countsMutex);
+                recent.add(second, neutron);
+                widths.add(width);
+                (neutron ? runNeutrons : runRejections)++;
+            }
+            buffer.wave.index++;
+        }
+        {
+            lock_guard<mutex> lock(countsMutex);
+            finished = true;
+        }
+        readerFinished.notify_all();
+    });
+
+    for (long long tick = interval; ; tick += interval){
+        long long numNeutrons, numRejections, totalNeutrons, totalRejections;
+        {
+            unique_lock<mutex> lock(countsMutex);
+            if (readerFinished.wait_until(lock, start + chrono::seconds(tick), [&]{ return finished; })){
+                break;
+            }
+            recent.sum(tick, numNeutrons, numRejections);
+            totalNeutrons = runNeutrons;
+            totalRejections = runRejections;
+        }
+        //The window is timed by the clock rather than entered by hand, so its length is taken as exact.
+        double windowLength = min((long long)window, tick);
+        WidthRates rates = widthRates(numNeutrons, numRejections, windowLength, 0);
+        WidthRates runRates = widthRates(totalNeutrons, totalRejections, tick, 0);
+        bool drift = false;
+        if (tick > window){
+            double neutronSpread = sqrt(rates.neutRateErr*rates.neutRateErr + runRates.neutRateErr*runRates.neutRateErr);
+            double nonNeutronSpread = sqrt(rates.nonNeutRateErr*rates.nonNeutRateErr +
+                                           runRates.nonNeutRateErr*runRates.nonNeutRateErr);
+            drift = (abs(rates.neutRate - runRates.neutRate) > PSD_LIVE_DRIFT_SIGMA*neutronSpread) ||
+                    (abs(rates.nonNeutRate - runRates.nonNeutRate) > PSD_LIVE_DRIFT_SIGMA*nonNeutronSpread);
+        }
+        cout << tick << "s: last " << windowLength << "s neutrons " << numNeutrons << " (" << rates.neutRate << " +- "
+        << rates.neutRateErr << "s^-1), non-neutrons " << numRejections << " (" << rates.nonNeutRate << " +- "
+        << rates.nonNeutRateErr << "s^-1), flux " << rates.flux << " +- " << rates.fluxError << "cm^-2s^-1"
+        << (drift ? ", DRIFT from the run rates" : "") << endl;
+        if (f_log.is_open()){
+            f_log << tick << " " << windowLength << " " << numNeutrons << " " << numRejections << " " << rates.neutRate
+            << " " << rates.neutRateErr << " " << rates.nonNeutRate << " " << rates.nonNeutRateErr << " " << rates.flux
+            << " " << rates.fluxError << " " << drift << endl;
+        }
+    }
+    reader.join();
+    f_in.close();
+    f_log.close();
+
+    double runTime = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    printWidthsDerivedQuantities(widths, source, lowCut, highCut, runTime);
+    cout<<"                       liveAnalysis Completed                    "<<endl;
+}
+
+//What PulseGenerator puts into its waveforms.
+struct PulseOptions{
+    double neutronFraction; //Fraction of the waveforms with a neutron like pulse.
+    double noise; //Standard deviation of the noise on each height, in ADC counts.
+    double drift; //Standard deviation of the step the baseline takes from one waveform to the next, in ADC counts.
+    double pileUpFraction; //Fraction of the waveforms with a second pulse later on.
+};
+
+//Method to give the PulseOptions the live generator has always used: noise of 1.5 counts, a steady baseline and no
+//pile-up.
+PulseOptions defaultPulseOptions(double neutronFraction){
+    PulseOptions options;
+    options.neutronFraction = neutronFraction;
+    options.noise = 1.5;
+    options.drift = 0.0;
+    options.pileUpFraction = 0.0;
+    return options;
+}
+
+//Makes synthetic waveforms for a location in place of the digitiser: a noisy baseline around 2244 with a falling pulse
+//starting between wStart and peakXValue. The pulse decays so that gammas come out at around half the low width cut and
+//neutrons half way between the cuts. The baseline wanders by options.drift from one waveform to the next, held near
+//2244, and a piled up waveform has a second pulse somewhere between the first and the end of the waveform. The same
+//seed always gives the same waveforms.
+class PulseGenerator{
+public:
+    PulseGenerator(const RunSettings &settings, double lowCut, double highCut, const PulseOptions &options,
+                   unsigned seed = 1)
+            : settings(settings), options(options), random(seed), baseline(2244){
+        onset = (settings.wStart + settings.peakXValue)/2;
+        //The width at half maximum of an exponential decay is its time constant times ln 2.
+        gammaDecay = max(0.5*lowCut, 1.0)/log(2.0);
+        neutronDecay = max(0.5*(lowCut + highCut), 2.0)/log(2.0);
+    }
+    //Method to fill heights with the next waveform, wSize+1 samples as recorded, and say whether it is a neutron.
+    void next(vector<int> &heights, bool &neutron){
+        uniform_real_distribution<double> uniform(0.0, 1.0);
+        normal_distribution<double> noise(0.0, options.noise);
+        neutron = uniform(random) < options.neutronFraction;
+        double amplitude = 100 + 1400*uniform(random);
+        double decay = neutron ? neutronDecay : gammaDecay;
+        //Random numbers are only drawn for the drift and the pile-up when they are asked for, so that without them the
+        //waveforms are the same as they have always been.
+        if (options.drift > 0){
+            baseline += options.drift*normal_distribution<double>(0.0, 1.0)(random) - 0.01*(baseline - 2244);
+        }
+        int secondOnset = settings.wSize + 1;
+        double secondAmplitude = 0, secondDecay = 1;
+        if ((options.pileUpFraction > 0) && (uniform(random) < options.pileUpFraction)){
+            secondOnset = onset + 1 + (int)(uniform(random)*(settings.wSize - onset - 1));
+            secondAmplitude = 100 + 1400*uniform(random);
+            secondDecay = (uniform(random) < options.neutronFraction) ? neutronDecay : gammaDecay;
+        }
+        heights.resize(settings.wSize + 1);
+        for (int i=0; i<=settings.wSize; ++i){
+            double height = baseline + noise(random);
+            if (i >= onset){
+                double t = i - onset;
+                height -= amplitude*(1 - exp(-t/0.5))*exp(-t/decay);
+            }
+            if (i >= secondOnset){
+                double t = i - secondOnset;
+                height -= secondAmplitude*(1 - exp(-t/0.5))*exp(-t/secondDecay);
+            }
+            heights[i] = round(height);
+        }
+    }
+private:
+    RunSettings settings;
+    PulseOptions options;
+    mt19937 random;
+    double baseline;
+    int onset;
+    double gammaDecay, neutronDecay;
+};
+
+//Method to stand in for the digitiser: write synthetic waveforms for a location as "index height" text to destination
+//at random times averaging rate waveforms per second, for the given number of seconds or until the reader goes away.
+//destination is "-" for standard output, "tcp:PORT" to connect to liveAnalysis waiting on that local port, or a file
+//or FIFO. Messages go to cerr so that they never mix with waveforms written to standard output.
+void generateLive(string destination, string location, double rate, double seconds, double neutronFraction,
+                  double lowCut, double highCut){
+    RunSettings settings;
+    if (!locationSettings(location, settings)){
+        cerr << location << " not found in generateLive with filename: " + destination << endl;
+        return;
+    }
+    FILE *f_out = NULL;
+    if (destination == "-"){
+        f_out = stdout;
+    }else if (destination.compare(0, 4, "tcp:") == 0){
+#ifdef PSD_POSIX_IO
+        int connection = connectLocal(atoi(destination.c_str() + 4));
+        f_out = (connection >= 0) ? fdopen(connection, "w") : NULL;
+#endif
+    }else{
+        f_out = fopen(destination.c_str(), "w");
+    }
+    if (f_out == NULL){
+        cerr << "Unable to open file: " + destination << endl;
+        return;
+    }
+#ifdef PSD_POSIX_IO
+    //A reader that goes away shows up as a failed write rather than ending the program.
+    signal(SIGPIPE, SIG_IGN);
+#endif
+    PulseGenerator generator(settings, lowCut, highCut, defaultPulseOptions(neutronFraction));
+    exponential_distribution<double> gap(rate);
+    mt19937 random(2);
+    vector<int> heights;
+    long long numWaves = 0, numNeutrons = 0;
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    double time = gap(random);
+    while (time < seconds){
+        this_thread::sleep_until(start + chrono::duration_cast<chrono::steady_clock::duration>(
+                chrono::duration<double>(time)));
+        bool neutron;
+        generator.next(heights, neutron);
+        for (int i=0; i<heights.size(); ++i){
+            fprintf(f_out, "%d %d\n", i, heights[i]);
         }
-        if (f_out1.is_open()) {
-            f_out1 << filename1 <<" "<<LUNAVal1<<endl;
-        } else {
-            cout << "Unable to open file1 " << endl;
+        //Each waveform is sent as soon as it is made, as the digitiser would.
+        if ((fflush(f_out) != 0) || ferror(f_out)){
+            break;
         }
-        f_in >> filename0 >> LUNAVal0 >>filename1>>LUNAVal1;
+        numWaves++;
+        numNeutrons += neutron;
+        time += gap(random);
     }
-    f_out0.close();
-    f_out1.close();
-    f_in.close();
-    cout<<"                       sortedLUNA Completed                    "<<endl;
+    if (f_out != stdout){
+        fclose(f_out);
+    }else{
+        fflush(f_out);
+    }
+    cerr << "Generated " << numWaves << " waveforms, " << numNeutrons << " of them neutrons, to " << destination << endl;
+    cerr<<"                       generateLive Completed                    "<<endl;
 }
 
-
-//------------------------------------------Derived Quantities----------------------------------------------------------
-//Section to calculate the physically derived quantities of the detectors/neutrons coming through from the
-//above methods. Quantites such as flux, efficiency etc.
+//-----------------------------------------------------Benchmarks-------------------------------------------------------
+//Timing tests and checks for the pieces of the pipeline, run from the command line rather than the usual
+//File Details.txt loop.
 //----------------------------------------------------------------------------------------------------------------------
-//Method to sort the neutron cases from the non-neutrons. Outputs the number of neutrons, non-neutrons,
-//their rates per hour and per second, total events, the neutron flux and its error in cm^-2s^-1 and the
-//difference between the rates of non-neutrons and neutrons with its error in s^-1. All derived from the
-//Widths methods above.
 
-void printWidthsDerivedQuantities(string inFileName, double lowThreshold, double highThreshold, double time){
-    cout<<inFileName<<endl;
-    fstream f_in;
-    f_in.open(inFileName.c_str(),std::fstream::in);
-    if(!f_in){
-        cout<< " not found in printWidthsDerivedQuantities with filename: " + inFileName << endl;
+//Method to write a synthetic "index height" file of roughly the given size, made of wSize+1 sample records with a
+//baseline of 2244 and a decaying pulse, for timing the readers. With wholeCounts the heights are rounded to whole ADC
+//counts, as the digitiser records them.
+void writeSyntheticTextFile(string outFileName, double gigabytes, int wSize, bool wholeCounts = false){
+    FILE *f_out = fopen(outFileName.c_str(), "wb");
+    if (f_out == NULL){
+        cout << "Unable to open file: " + outFileName << endl;
+        return;
     }
-    double inVal, flux, fluxError;
-    int numRejections = 0;
-    int numNeutrons = 0;
-    int total = 0;
-    //Start reading in values.
-    f_in >> inVal;
-    while(f_in){
-        if((!(inVal<lowThreshold))&&(!(inVal>highThreshold))){
-            numNeutrons++;
-        }
-        else{
-            numRejections++;
+    long long targetBytes = (long long)(gigabytes*1e9), written = 0;
+    unsigned int noise = 12345;
+    while (written < targetBytes){
+        for (int i=0; i<=wSize; ++i){
+            noise = noise*1103515245 + 12345;
+            double height = 2244 + (int)((noise >> 16) % 5) - 2;
+            if (i > wSize/5){
+                height -= 500*exp(-(i - wSize/5)/(0.02*wSize));
+            }
+            if (wholeCounts){
+                height = round(height);
+            }
+            written += fprintf(f_out, "%d %.1f\n", i, height);
         }
-        total++;
-        f_in>>inVal;
     }
+    fclose(f_out);
+}
 
-    //calculate errors and other associated values
-    double A = EJ426DETY*EJ426DETX;
-    double AT = EJ426DETY*EJ426DETX*time;
-    flux = numNeutrons/AT;
-    fluxError = sqrt(numNeutrons/(AT*AT)
-                     + numNeutrons*numNeutrons*DETAREAERROR*DETAREAERROR/(AT*AT*A*A)
-                     + numNeutrons*numNeutrons*TIMEERR*TIMEERR/(AT*AT*time*time));
-    double neutRateErr = sqrt(numNeutrons*(1+numNeutrons*TIMEERR*TIMEERR/(time*time)))/time;
-    double nonNeutRateErr = sqrt(numRejections*(1+numRejections*TIMEERR*TIMEERR/(time*time)))/time;
-    double neutRateHrErr = sqrt(numNeutrons*(1+numNeutrons*TIMEERR*TIMEERR/(time*time)))*3600/time;
-    double nonNeutRateHrErr = sqrt(numRejections*(1+numRejections*TIMEERR*TIMEERR/(time*time)))*3600/time;
+//Method to compare the samples per second read by fstream extraction and by the SampleParser on a synthetic file.
+void benchmarkSampleParser(string fileName, double gigabytes){
+    int wSize = 1000;
+    cout << "Writing " << gigabytes << " GB of synthetic samples to " << fileName << endl;
+    writeSyntheticTextFile(fileName, gigabytes, wSize);
 
-    cout<<"For the input run widths file: "<<inFileName<<endl
-    <<"which was "<<time<<"s long"<<endl
-    <<"using the low threshhold value of "<<lowThreshold<< " and a high of "<< highThreshold
-    <<" to discriminate widths, the number of neutrons is: "<<numNeutrons<<endl
-    <<"and the number of rejections is: "<<numRejections<<endl
-    <<"with a total number of events: "<<total<<endl
-    <<"this results in a calculated neutron flux, for the detector, of: "<<flux<<"cm^-2s^-1"<<endl
-    <<"with an associated error of: "<<fluxError<<"cm^-2s^-1"<<endl
-    <<"the neutron rate for this run is: "<<numNeutrons/time<<"s^-1 with an error of: "<<neutRateErr<<"s^-1" <<endl
-    <<"which, in units of hours, is: "<<numNeutrons*3600/time<<"hr^-1 with an error of: "<<neutRateHrErr<<"hr^-1" <<endl
-    <<"the non-neutron rate for this run is: "<<numRejections/time<<"s^-1 with an error of: "<<nonNeutRateErr<<"s^-1" <<endl
-    <<"which, in units of hours, is: "<<numRejections*3600/time<<"hr^-1 with an error of: "<<nonNeutRateHrErr<<"hr^-1" <<endl
-    <<"The difference between non-neutron and neutron rates is: "<<numRejections/time - numNeutrons/time<<"s^-1 with "
-    <<"error: "<<sqrt(neutRateErr*neutRateErr + nonNeutRateErr*nonNeutRateErr)<<"s^-1" <<endl;
+    //Current stream path.
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    fstream f_in;
+    f_in.open(fileName.c_str(),std::fstream::in);
+    long long streamSamples = 0;
+    double streamSum = 0, height;
+    int time;
+    f_in >> time >> height;
+    while(f_in){
+        streamSum += height;
+        streamSamples++;
+        f_in >> time >> height;
+    }
     f_in.close();
-    cout<<"                       printWidthsDerivedQuantities Completed                    "<<endl;
+    double streamSeconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
 
-}
+    //SampleParser path.
+    start = chrono::steady_clock::now();
+    SampleParser parser(fileName);
+    long long parserSamples = 0;
+    double parserSum = 0;
+    while(parser.nextSample(height)){
+        parserSum += height;
+        parserSamples++;
+    }
+    parser.close();
+    double parserSeconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
 
-void printWidthsDerivedQuantitiesOutFile(string inFileName, string outFileName, double lowThreshold, double highThreshold, double time){
-    cout<<inFileName<<endl;
-    fstream f_in;
-    f_in.open(inFileName.c_str(),std::fstream::in);
-    if(!f_in){
-        cout<< " not found in printWidthsDerivedQuantitiesOutFile with filename: " + inFileName << endl;
+    if ((streamSamples != parserSamples) || (streamSum != parserSum)){
+        cout << "Mismatch between readers: " << streamSamples << " samples summing to " << streamSum << " against "
+        << parserSamples << " samples summing to " << parserSum << endl;
     }
-    double inVal;
-    int numRejections = 0;
-    int numNeutrons = 0;
-    int total = 0;
-    //Start reading in values.
-    f_in >> inVal;
-    while(f_in){
-        if((!(inVal<lowThreshold))&&(!(inVal>highThreshold))){
-            numNeutrons++;
+    cout << "fstream:      " << streamSamples << " samples in " << streamSeconds << "s, "
+    << streamSamples/streamSeconds << " samples/s" << endl
+    << "SampleParser: " << parserSamples << " samples in " << parserSeconds << "s, "
+    << parserSamples/parserSeconds << " samples/s" << endl
+    << "Speed up: " << streamSeconds/parserSeconds << endl;
+    remove(fileName.c_str());
+    cout<<"                       benchmarkSampleParser Completed                    "<<endl;
+}
+
+//Mutex protected queue the pipeline used to pass batches between threads before the lock-free rings, kept as the
+//baseline for benchmarkRings. close() wakes anyone waiting once nothing more is coming. The items are held in a ring
+//allocated up front, so the queue must never hold more than capacity items at once.
+template <typename T>
+class BlockingQueue{
+public:
+    BlockingQueue(int capacity) : items(capacity), head(0), count(0), closed(false){}
+    void push(T item){
+        {
+            lock_guard<mutex> lock(queueMutex);
+            items[(head + count) % items.size()] = item;
+            count++;
         }
-        else{
-            numRejections++;
+        ready.notify_one();
+    }
+    //Method to take the next item, waiting if needed. Returns false once the queue is closed and empty.
+    bool pop(T &item){
+        unique_lock<mutex> lock(queueMutex);
+        ready.wait(lock, [this]{ return (count > 0) || closed; });
+        if (count == 0){
+            return false;
         }
-        total++;
-        f_in>>inVal;
+        item = items[head];
+        head = (head + 1) % items.size();
+        count--;
+        return true;
     }
-    ofstream f_out(outFileName, ios::out | ios::app);
-    if (f_out.is_open()) {
-        f_out << inFileName << " "<< time<<" "<<numNeutrons<<endl;
-    } else {
-        cout << "Unable to open file: " + outFileName << endl;
+    void close(){
+        {
+            lock_guard<mutex> lock(queueMutex);
+            closed = true;
+        }
+        ready.notify_all();
     }
-    f_out.close();
-    f_in.close();
-    cout<<"                       printWidthsDerivedQuantitiesOutFile Completed                    "<<endl;
-
-}
+private:
+    vector<T> items;
+    int head, count; //The queued items are items[head] onwards, wrapping round.
+    mutex queueMutex;
+    condition_variable ready;
+    bool closed;
+};
 
-
-//Method to print out to a file the filename and the neutron rate for that run based on the thresholds given. The thresholds
-//are to be decided upon inspection of the widths files produced by the above methods.
-void WidthDerivedNeutronRate(string inFileName, string outFileName, double lowThreshold, double highThreshold, double time){
-    cout<<inFileName<<endl;
-    fstream f_in;
-    f_in.open(inFileName.c_str(),std::fstream::in);
-    if(!f_in){
-        cout<< " not found in WidthDerivedNeutronRate with filename: " + inFileName << endl;
+//Method to pass numWaves waveforms of wSize samples from a producer thread to a consumer thread through a Queue, with
+//the slots going back to the producer through a second Queue as in parallelPassAnalysis. The producer writes the first
+//and last samples and the time each slot was sent, and the consumer reads them, so the hand off is timed rather than
+//the copying. Prints the waveforms per second and the median, 99th percentile and largest time from send to receipt.
+template <typename Queue>
+void benchmarkHandOff(string name, int wSize, int numWaves, int numSlots){
+    typedef chrono::steady_clock::time_point TimePoint;
+    vector<vector<double> > slots(numSlots, vector<double>(wSize, 0.0));
+    vector<TimePoint> sent(numSlots);
+    vector<double> latencies(numWaves);
+    Queue freeSlots(numSlots), full(numSlots);
+    for (int i=0; i<numSlots; ++i){
+        freeSlots.push(i);
     }
-    double inVal;
-    int numNeutrons = 0;
-    //Start reading in values.
-    ofstream f_out(outFileName, ios::out | ios::app);
-    f_in >> inVal;
-    while(f_in){
-        if((!(inVal<lowThreshold))&&(!(inVal>highThreshold))){
-            numNeutrons++;
+    double checksum = 0;
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    thread producer([&]{
+        int slot;
+        for (int n=0; (n < numWaves) && freeSlots.pop(slot); ++n){
+            slots[slot][0] = slots[slot][wSize-1] = n;
+            sent[slot] = chrono::steady_clock::now();
+            full.push(slot);
         }
-        f_in>>inVal;
+        full.close();
+    });
+    int slot, received = 0;
+    while (full.pop(slot)){
+        latencies[received++] = chrono::duration<double>(chrono::steady_clock::now() - sent[slot]).count();
+        checksum += slots[slot][0] + slots[slot][wSize-1];
+        freeSlots.push(slot);
     }
-    if (f_out.is_open()) {
-        f_out << inFileName <<" "<<numNeutrons/time<<endl;
-    } else {
-        cout << "Unable to open file " << endl;
+    freeSlots.close();
+    producer.join();
+    double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    if (received == 0){
+        cout << name << ": no waveforms received" << endl;
+        return;
     }
-    f_out.close();
-    f_in.close();
-    cout<<"For the input run widths file "<<inFileName<<" the neutron rate is: "<<numNeutrons/time<<endl;
-    cout<<"                       WidthDerivedNeutronRate Completed                    "<<endl;
+    sort(latencies.begin(), latencies.begin() + received);
+    cout << name << ": " << received << " waveforms in " << seconds << "s, " << received/seconds
+    << " waveforms/s, latency median " << 1e6*latencies[received/2] << "us, 99% " << 1e6*latencies[received*99/100]
+    << "us, max " << 1e6*latencies[received-1] << "us (checksum " << checksum << ")" << endl;
 }
 
-double widthDerivedNeutronRateVal(string inFileName, double lowThreshold, double highThreshold, double time){
-    cout<<inFileName<<endl;
-    fstream f_in;
-    f_in.open(inFileName.c_str(),std::fstream::in);
-    if(!f_in){
-        cout<< " not found in WidthDerivedNeutronRateVal with filename: " + inFileName << endl;
+//Method to compare the lock-free ring with the mutex queue for handing waveforms of the largest, JanEdinburgh, size
+//between the pipeline's threads, with a deep and a shallow pool of slots.
+void benchmarkRings(int numWaves){
+    if (numWaves <= 0){
+        cout << "The number of waveforms for benchmarkRings must be positive, not " << numWaves << endl;
+        return;
     }
-    double inVal;
-    int numNeutrons = 0;
-    //Start reading in values.
-    f_in >> inVal;
-    while(f_in){
-        if((!(inVal<lowThreshold))&&(!(inVal>highThreshold))){
-            numNeutrons++;
+    int wSize = 100000;
+    for (int numSlots : {2*(int)thread::hardware_concurrency() + 2, 2}){
+        cout << numWaves << " waveforms of " << wSize << " samples through " << numSlots << " slots" << endl;
+        benchmarkHandOff<SPSCRing<int> >("SPSCRing     ", wSize, numWaves, numSlots);
+        benchmarkHandOff<BlockingQueue<int> >("BlockingQueue", wSize, numWaves, numSlots);
+    }
+    cout<<"                       benchmarkRings Completed                    "<<endl;
+}
+
+//Method to write numWaves synthetic waveforms for a location to a text file, as the digitiser records them, from a
+//generator seeded with seed so that every run of the benchmarks reads the same file.
+void writeSyntheticRun(string outFileName, const RunSettings &settings, double lowCut, double highCut,
+                       const PulseOptions &pulses, long long numWaves, unsigned seed){
+    FILE *f_out = fopen(outFileName.c_str(), "wb");
+    if (f_out == NULL){
+        cout << "Unable to open file: " + outFileName << endl;
+        return;
+    }
+    PulseGenerator generator(settings, lowCut, highCut, pulses, seed);
+    vector<int> heights;
+    bool neutron;
+    for (long long n=0; n<numWaves; ++n){
+        generator.next(heights, neutron);
+        for (int i=0; i<heights.size(); ++i){
+            fprintf(f_out, "%d %d\n", i, heights[i]);
         }
-        f_in>>inVal;
     }
-    f_in.close();
-    cout<<"                       WidthDerivedNeutronRateVal Completed                    "<<endl;
-    return numNeutrons/time;
+    fclose(f_out);
 }
 
-//Method to calculate the efficiency of the detector from the number of neutrons measured by the widths method (takes in a _Widths file),
-// an orientation and the activity of the source. Will produce both the absolute and intrinsic effeciency. The input orientation must be
-// either "horizontal" or "vertical", being the largest faces of the detector facing up and down or left and right respectively.
-void WidthsDerivedEfficiencies(string inFileName, string outFileName, string orientation, double distanceInMetres, double sourceActivity,
-                                double lowThreshold, double highThreshold, double time){
-    if (!(orientation == "horizontal")&&!(orientation == "vertical")){
-        cout<<"Please enter an orientation of 'vertical' or 'horizontal'."<<endl;
-        exit(1);
+//Collects the timings of a benchmark suite, prints each as it comes in and appends them all to a CSV file so that
+//one build can be compared with another.
+class BenchmarkResults{
+public:
+    BenchmarkResults(string outFileName) : outFileName(outFileName){
+        time_t now = time(NULL);
+        char stamp[32];
+        strftime(stamp, sizeof(stamp), "%Y-%m-%dT%H:%M:%S", localtime(&now));
+        timestamp = stamp;
     }
-    fstream f_in;
-    f_in.open(inFileName.c_str(),std::fstream::in);
-    if(!f_in){
-        cout<< " not found in WidthsDerivedEfficiency with filename: " + inFileName << endl;
+    //Method to note that name took seconds to get through numWaves waveforms of wSize samples at location.
+    void add(string location, int wSize, string name, double seconds, long long numWaves){
+        double samples = (double)numWaves*wSize;
+        cout << "    " << name << ": " << seconds << "s, " << numWaves/seconds << " waveforms/s, "
+             << samples/seconds << " samples/s" << endl;
+        stringstream row;
+        row << timestamp << "," << location << "," << wSize << "," << numWaves << "," << waveKernels.name << ","
+            << name << "," << seconds << "," << numWaves/seconds << "," << samples/seconds;
+        rows.push_back(row.str());
     }
-    double neutronRate = widthDerivedNeutronRateVal(inFileName, lowThreshold, highThreshold, time);
-    double absoluteEfficiency = neutronRate/sourceActivity;
-    double solidAngle, detectorWidth, detectorDepth, bonusDistance, trueDistance;
-    if(orientation == "horizontal"){
-        detectorWidth = DETZ/100; //metres
-        detectorDepth = DETY/100; //metres
-    }else{
-        detectorWidth = DETY/100;
-        detectorDepth = DETZ/100;
+    void write(){
+        ifstream existing(outFileName, ios::in | ios::ate);
+        bool isNew = !existing.is_open() || (existing.tellg() <= 0);
+        existing.close();
+        ofstream f_out(outFileName, ios::out | ios::app);
+        if (!f_out.is_open()) {
+            cout << "Unable to open file: " + outFileName << endl;
+            return;
+        }
+        if (isNew){
+            f_out << "timestamp,location,wSize,waveforms,kernels,benchmark,seconds,waveforms_per_second,samples_per_second"
+                  << endl;
+        }
+        for (int i=0; i<rows.size(); ++i){
+            f_out << rows[i] << endl;
+        }
+        f_out.close();
+        cout << "Benchmark results appended to " << outFileName << endl;
     }
-    bonusDistance = detectorDepth/2;
-    trueDistance = distanceInMetres + bonusDistance;
-    solidAngle = 4*atan(detectorWidth*EJ426DETX/
-                                (4*trueDistance*sqrt(detectorWidth*detectorWidth/
-                                                             4+EJ426DETX*EJ426DETX/4+trueDistance*trueDistance)));
-    double intrinsicEfficiency = absoluteEfficiency*4*M_PI/solidAngle;
+private:
+    string outFileName, timestamp;
+    vector<string> rows;
+};
 
-    ofstream f_out(outFileName, ios::out | ios::app);
-    if (f_out.is_open()) {
-        f_out << inFileName <<" "<<absoluteEfficiency<<" "<< intrinsicEfficiency<< endl;
-    } else {
-        cout << "Unable to open file: " + outFileName << endl;
+//Method to time a benchmark, run repeats times, and return the fastest time in seconds.
+template <typename Function>
+double bestTime(int repeats, Function function){
+    double best = numeric_limits<double>::infinity();
+    for (int r=0; r<repeats; ++r){
+        chrono::steady_clock::time_point start = chrono::steady_clock::now();
+        function();
+        best = min(best, chrono::duration<double>(chrono::steady_clock::now() - start).count());
     }
-    f_out.close();
-    f_in.close();;
-    cout<<"                       WidthsDerivedEfficiency Completed                    "<<endl;
+    return best;
 }
 
+//Method to benchmark one location on synthetic waveforms of its geometry, around numSamples heights in all: each of
+//the analysis methods end to end, the single pass engine with one thread and with every core broken down by stage,
+//and each kernel over the waveforms held in memory. The kernels are whichever set waveKernels picked, so PSD_KERNELS
+//can be used to time the others.
+void benchmarkLocation(string location, long long numSamples, const PulseOptions &pulses, BenchmarkResults &results){
+    RunSettings settings;
+    if (!locationSettings(location, settings)){
+        cout << location << " not found in benchmarkLocation with filename: " << location << endl;
+        return;
+    }
+    //LUNA has no width cuts of its own, so it gets the ones used for it in the live mode examples.
+    double lowCut = (settings.widthHighCut > 0) ? settings.widthLowCut : 7;
+    double highCut = (settings.widthHighCut > 0) ? settings.widthHighCut : 50;
+    int wSize = settings.wSize;
+    long long numWaves = max(20LL, numSamples/(wSize + 1));
+    string inFileName = "bench_" + location + ".txt";
+    string outFileName = "bench_" + location + "_out.txt";
+    cout << location << ": " << numWaves << " waveforms of " << wSize << " samples" << endl;
+    writeSyntheticRun(inFileName, settings, lowCut, highCut, pulses, numWaves, 1);
 
-//----------------------------------------------------------------------------------------------------------------------
-//-------------------------------------------------------------MAIN-----------------------------------------------------
-//----------------------------------------------------------------------------------------------------------------------
-int main() {
+    //Each of the methods end to end, reading the file and writing its output.
+    results.add(location, wSize, "Widths", bestTime(1, [&]{
+        Widths(inFileName, outFileName, 0.5, wSize, settings.baseLEnd);
+    }), numWaves);
+    results.add(location, wSize, "totalIntVsWidth", bestTime(1, [&]{
+        totalIntVsWidth(inFileName, outFileName, 0.5, wSize, settings.baseLEnd, settings.wStart, settings.wEnd);
+    }), numWaves);
+    results.add(location, wSize, "peakTailIntegrate", bestTime(1, [&]{
+        peakTailIntegrate(inFileName, outFileName, wSize, settings.baseLEnd, settings.peakXValue, settings.tailW);
+    }), numWaves);
+    results.add(location, wSize, "PGA", bestTime(1, [&]{
+        PGA(inFileName, outFileName, settings.PGASampleVal, wSize, settings.baseLEnd);
+    }), numWaves);
+    results.add(location, wSize, "IntegralRisetimeVsAmplitude", bestTime(1, [&]{
+        IntegralRisetimeVsAmplitude(inFileName, outFileName, 0.1, 0.9, wSize, settings.baseLEnd);
+    }), numWaves);
 
-    reprint("AmBe_Spectrum.txt","AmBe_Spectrum_Processed.txt");
-    int wSize, //Number of points in the waveform.
-            baseLEnd, //Point up to which only the baseline is present.
-            tailW, //Point at which the tail of the pulse ends.
-            peakXValue, //Point at which the peak value of the wave is.
-            wStart, //Point at which the wave starts, in practice is the same as baseLEnd.
-            wEnd, //Point at which the pulse ends, in practice is the same as tailW.
-            PGASampleVal, //Sample value for the PGA method.
-            widthLowCut, //Low cut point for the method counting the number of neutrons.
-            widthHighCut; //High cut point for the method counting the number of neutrons.
-    double sourceDistance, //Distance from the detector to the source, if there is one, for background runs this should
-                           //be set to 0 in the input file.
-            AmBeSourceActivity, //Neutron source activity.
-            runTime; //Duration of the run in seconds.
-    string fileModifier, //Type of input file used (.txt, .dat, .csv etc.)
-            orientation, //Horizontal or vertical detector orientation?
-            location, //Location of the detector runs that sets up other variables
-            filename, //Run name.
-            fileDestination; //Folder containing the files.
-    string fileDetails = "File Details.txt"; //Name of the input file containing all details of the runs.
-    fstream f_in;
-    f_in.open(fileDetails.c_str(),std::fstream::in);
-    if(!f_in){
-        cout<< " not found MAIN" << endl;
+    //The engine producing the same outputs in one pass.
+    AnalysisParams params;
+    params.wSize = wSize;
+    params.baseLEnd = settings.baseLEnd;
+    params.threshold = 0.5;
+    params.wStart = settings.wStart;
+    params.wEnd = settings.wEnd;
+    params.peakXValue = settings.peakXValue;
+    params.tailEndXVal = settings.tailW;
+    params.PGASampleVal = settings.PGASampleVal;
+    params.sampleType = PSD_SAMPLES_DOUBLE;
+    params.widthMethod = PSD_WIDTH_OUTERMOST;
+    params.interpolateWidth = false;
+    params.risetimes.resize(1);
+    params.risetimes[0].low = 0.1;
+    params.risetimes[0].high = 0.9;
+    params.baselines.robust = false;
+    params.baselines.tailStart = params.baselines.tailEnd = 0;
+    //Every waveform is kept, as in a default run, so the timings include the width, PGA, rise time and gate work.
+    params.rejectFlags = 0;
+    params.adcMin = settings.adcMin;
+    params.adcMax = settings.adcMax;
+    //The run averages of the baseline and its deviation, which used to read the file for themselves.
+    {
+        BaselineDeviationConsumer deviation(inFileName, outFileName + "_deviation");
+        BaselineAverageConsumer baselineAvg(inFileName, outFileName + "_average");
+        vector<WaveConsumer*> consumers = {&deviation, &baselineAvg};
+        results.add(location, wSize, "baselineDeviation and baselineAverage", bestTime(1, [&]{
+            singlePassAnalysis(inFileName, params, consumers);
+        }), numWaves);
+        remove((outFileName + "_deviation").c_str());
+        remove((outFileName + "_average").c_str());
+    }
+    vector<int> threadCounts = {1};
+    if (thread::hardware_concurrency() > 1){
+        threadCounts.push_back(thread::hardware_concurrency());
+    }
+    for (int threads : threadCounts){
+        WidthsConsumer widths(outFileName, wSize);
+        TotalIntVsWidthConsumer totalInt(outFileName + "_total", wSize);
+        PeakTailConsumer peakTail(outFileName + "_peakTail");
+        PGAConsumer pga(outFileName + "_PGA");
+        RisetimeConsumer risetimes(outFileName + "_risetimes");
+        BaselineDeviationConsumer deviation(inFileName, outFileName + "_deviation");
+        vector<WaveConsumer*> consumers = {&widths, &totalInt, &peakTail, &pga, &risetimes, &deviation};
+        RunProfile profile(inFileName, threads);
+        string name = "singlePassAnalysis " + to_string(threads) + " thread" + ((threads > 1) ? "s" : "");
+        results.add(location, wSize, name, bestTime(1, [&]{
+            singlePassAnalysis(inFileName, params, consumers, threads, &profile);
+        }), numWaves);
+        profile.finish();
+        profile.print();
+        remove((outFileName + "_total").c_str());
+        remove((outFileName + "_peakTail").c_str());
+        remove((outFileName + "_PGA").c_str());
+        remove((outFileName + "_risetimes").c_str());
+        remove((outFileName + "_deviation").c_str());
     }
-    //Start reading in values. They are all stored in an input file to be edited upon reception of new data.
-    f_in >> filename >> runTime >> location >> fileDestination >> sourceDistance >> orientation;
-    int counter = 0;
-    cout<<endl<<endl<<"        ---------------Beginning PSD Codes--------------- "<<endl;
-    while(f_in){
-        counter ++;
-        if ((counter<4)||(counter>111)){
-            f_in  >> filename >> runTime >> location >> fileDestination >> sourceDistance >> orientation;
-            continue;
-        }
 
-        cout<<"             Starting at line "<<counter<<" in "<<fileDetails<<endl;
-        if(location == "SeptEdinburgh"){
-            wSize = 1000;
-            baseLEnd = 100;
-            tailW = 600;
-            peakXValue = 200;
-            wStart = 100;
-            wEnd = 800;
-            PGASampleVal = 600;
-            fileModifier = ".csv";
-            AmBeSourceActivity = 2.738E5; //Neutrons per second
-            widthLowCut = 5;
-            widthHighCut = 50;
-        }else if(location == "LUNA"){
-            wSize = 4000;
-            baseLEnd = 30;
-            tailW = 200;
-            peakXValue = 34;
-            wStart = 30;
-            wEnd = 100;
-            PGASampleVal = 100;
-            fileModifier = ".dat";
-        }else if(location == "JanEdinburgh"){
-            wSize = 100000;
-            baseLEnd = 10000;
-            tailW = 38000;
-            peakXValue = 22000;
-            wStart = 19000;
-            wEnd = 60000;
-            PGASampleVal = 40000;
-            fileModifier = ".txt";
-            AmBeSourceActivity = 2.737E5; //Neutrons per second
-            widthLowCut = 19000;
-            widthHighCut = 40000;
-        }else if(location == "FebEdinburgh"){
-            wSize = 10000;
-            baseLEnd = 1000;
-            tailW = 3800;
-            peakXValue = 2200;
-            wStart = 1900;
-            wEnd = 6000;
-            PGASampleVal = 4000;
-            fileModifier = ".txt";
-            AmBeSourceActivity = 2.737E5; //Neutrons per second
-            widthLowCut = 1900;
-            widthHighCut = 4000;
-        }else{
-            cout<< "Please make sure the file format contains \"LUNA\", \"JanEdinburgh\" or \"FebEdinburgh\""<<endl;
-            break;
+    //The kernels over the waveforms in memory, best of 5.
+    vector<WaveBuffer<double> > waves(numWaves);
+    WaveReader f_in(inFileName);
+    for (long long n=0; n<numWaves; ++n){
+        f_in.nextWave(waves[n].raw, wSize);
+    }
+    f_in.close();
+    int size = waves[0].raw.size();
+    vector<double> workspace;
+    //Every result is added to sink so that none of the work can be optimised away.
+    volatile double sink = 0;
+    results.add(location, wSize, "kernel sum", bestTime(5, [&]{
+        for (long long n=0; n<numWaves; ++n){
+            sink += waveKernels.sum(waves[n].raw.data(), size);
+        }
+    }), numWaves);
+    results.add(location, wSize, "kernel sumSquaredDeviation", bestTime(5, [&]{
+        for (long long n=0; n<numWaves; ++n){
+            sink += waveKernels.sumSquaredDeviation(waves[n].raw.data(), size, 2244.0);
+        }
+    }), numWaves);
+    for (long long n=0; n<numWaves; ++n){
+        waves[n].adjusted.resize(size);
+    }
+    results.add(location, wSize, "kernel subtractSumMaxAbs", bestTime(5, [&]{
+        for (long long n=0; n<numWaves; ++n){
+            double maxAbs = 0;
+            sink += waveKernels.subtractSumMaxAbs(waves[n].raw.data(), waves[n].adjusted.data(), size, 2244.0, maxAbs);
+        }
+    }), numWaves);
+    results.add(location, wSize, "kernel countBeyond", bestTime(5, [&]{
+        for (long long n=0; n<numWaves; ++n){
+            sink += waveKernels.countBeyond(waves[n].adjusted.data(), size, -1.0, 300.0);
+        }
+    }), numWaves);
+    results.add(location, wSize, "kernel outermostAbove", bestTime(5, [&]{
+        for (long long n=0; n<numWaves; ++n){
+            int first, last;
+            waveKernels.outermostAbove(waves[n].adjusted.data(), size, 150.0, first, last);
+            sink += last - first;
         }
-        cout << "Filename: "<< filename << ", runTime: "<< runTime << "s, location: "
-        << location << ", fileDestination: " << fileDestination << " "<<endl
-        << "sourceDistance: "<< sourceDistance << "m, orientation: " << orientation << endl;
+    }), numWaves);
+    results.add(location, wSize, "analyseWave", bestTime(5, [&]{
+        for (long long n=0; n<numWaves; ++n){
+            analyseWave(waves[n], params);
+        }
+    }), numWaves);
+    results.add(location, wSize, "findPulseEdges", bestTime(5, [&]{
+        for (long long n=0; n<numWaves; ++n){
+            const Waveform &wave = waves[n].wave;
+            sink += findPulseEdges(waves[n].adjusted.data(), size, 0.5*abs(wave.maxVal), wave.peakIndex,
+                                   PSD_WIDTH_OUTERMOST, false).high;
+        }
+    }), numWaves);
+    for (long long n=0; n<numWaves; ++n){
+        waves[n].risetimes.resize(1);
+    }
+    results.add(location, wSize, "integralRisetimes", bestTime(5, [&]{
+        for (long long n=0; n<numWaves; ++n){
+            integralRisetimes(waves[n].adjusted.data(), size, params.risetimes, workspace,
+                              waves[n].risetimes.data());
+        }
+    }), numWaves);
+    remove(inFileName.c_str());
+    remove(outFileName.c_str());
+}
 
-        Widths(fileDestination + filename + fileModifier,
-               fileDestination + "Widths/" + filename + "_Widths.txt", 0.5, wSize, baseLEnd);
+//Method to run the benchmarks for a location, or for every location with "all", and append the results to
+//resultsFileName.
+void benchmarkSuite(string location, long long numSamples, const PulseOptions &pulses, string resultsFileName){
+    BenchmarkResults results(resultsFileName);
+    if (location == "all"){
+        for (string each : {"SeptEdinburgh", "LUNA", "FebEdinburgh", "JanEdinburgh"}){
+            benchmarkLocation(each, numSamples, pulses, results);
+        }
+    }else{
+        benchmarkLocation(location, numSamples, pulses, results);
+    }
+    results.write();
+    cout<<"                       benchmarkSuite Completed                    "<<endl;
+}
 
-        printWidthsDerivedQuantities(fileDestination + "Widths/" + filename + "_Widths.txt", widthLowCut,
-                                     widthHighCut, runTime);
 
-        printWidthsDerivedQuantitiesOutFile(fileDestination + "Widths/" + filename + "_Widths.txt",
-                                            fileDestination + "Derived Quantities/timesandnumneutrons.txt",
-                                            widthLowCut, widthHighCut, runTime);
+#ifdef PSD_COUNT_ALLOCATIONS
+//Notes the number of heap allocations made so far when the warm up waveform reaches the consumers and again once the
+//engine has finished, before any other consumer's finish() runs, so it must be the first consumer in the list.
+class AllocationCountConsumer : public WaveConsumer{
+public:
+    AllocationCountConsumer(int warmUp) : warmUp(warmUp), atWarmUp(-1), atLast(-1){}
+    void processWave(const Waveform &wave){
+        if (wave.index == warmUp){
+            atWarmUp = heapAllocations.load();
+        }
+    }
+    void finish(){
+        atLast = heapAllocations.load();
+    }
+    //Number of allocations after the warm up, or -1 if there were not enough waveforms to get past it.
+    long long steadyStateAllocations() const{
+        return (atWarmUp < 0) ? -1 : atLast - atWarmUp;
+    }
+private:
+    int warmUp;
+    long long atWarmUp, atLast;
+};
+#endif
 
-        numWaves(fileDestination + filename + fileModifier, wSize);
+//Method to check that, once every buffer has been used once, analysing a run makes no heap allocations in either the
+//serial or the parallel engine. Returns true if the check passed.
+bool checkAllocations(){
+#ifndef PSD_COUNT_ALLOCATIONS
+    cout << "Allocations are only counted in builds with -DPSD_COUNT_ALLOCATIONS." << endl;
+    return false;
+#else
+    string inFileName = "allocation_check.txt";
+    AnalysisParams params;
+    params.wSize = 1000;
+    params.baseLEnd = 100;
+    params.threshold = 0.5;
+    params.wStart = 100;
+    params.wEnd = 800;
+    params.peakXValue = 200;
+    params.tailEndXVal = 600;
+    params.PGASampleVal = 600;
+    params.sampleType = PSD_SAMPLES_DOUBLE;
+    params.widthMethod = PSD_WIDTH_OUTERMOST;
+    params.interpolateWidth = false;
+    params.baselines.robust = true;
+    params.baselines.trimFraction = PSD_BASELINE_TRIM;
+    params.baselines.tailStart = 800;
+    params.baselines.tailEnd = 1000;
+    params.rejectFlags = PSD_FLAG_ALL;
+    params.adcMin = -numeric_limits<double>::infinity();
+    params.adcMax = numeric_limits<double>::infinity();
+    //Long enough that most of the parallel run comes after the warm up.
+    writeSyntheticTextFile(inFileName, 0.1, params.wSize);
 
-        widthBinTimeNormalised(fileDestination + "Widths/" +filename + "_Widths.txt",
-                               fileDestination + "Time Normalised/time_normalised_" + filename + "_Widths.txt",
-                               runTime, 1, wSize);
+    bool passed = true;
+    int threadCounts[] = {1, 4};
+    for (int t=0; t<2; ++t){
+        int numThreads = threadCounts[t];
+        //Past this waveform every batch in the parallel engine has been filled at least once.
+        int warmUp = (numThreads > 1) ? (2*numThreads + 2)*max(1, (1<<18)/params.wSize) : 10;
+        WidthsConsumer widths("allocation_check_Widths.txt", params.wSize);
+        TotalIntVsWidthConsumer totalInt("allocation_check_Total.txt", params.wSize);
+        PeakTailConsumer peakTail("allocation_check_PeakTail.txt");
+        PGAConsumer pga("allocation_check_PGA.txt");
+        BaselineAdjustConsumer baselineAdjusted("allocation_check_Adjusted.txt");
+        AdjustedWaveFileConsumer adjustedCopy("allocation_check_Adjusted.psdw", params.wSize, "", 0);
+        BaselineDeviationConsumer deviation(inFileName, "allocation_check_Deviation.txt");
+        BaselineAverageConsumer baselineAvg(inFileName, "allocation_check_Basel.txt");
+        BaselineConsumer baselines(inFileName, "allocation_check_Baselines.txt", "allocation_check_Baselines_Run.txt");
+        AllocationCountConsumer counter(warmUp);
+        vector<WaveConsumer*> consumers = {&counter, &widths, &totalInt, &peakTail, &pga, &baselineAdjusted,
+                                           &adjustedCopy, &deviation, &baselineAvg, &baselines};
+        singlePassAnalysis(inFileName, params, consumers, numThreads);
+        long long allocations = counter.steadyStateAllocations();
+        cout << numThreads << " thread(s): " << allocations << " heap allocations after waveform " << warmUp << endl;
+        if (allocations != 0){
+            passed = false;
+        }
+    }
+    string outFileNames[] = {"allocation_check_Widths.txt", "allocation_check_Total.txt", "allocation_check_PeakTail.txt",
+                             "allocation_check_PGA.txt", "allocation_check_Adjusted.txt",
+                             "allocation_check_Adjusted.psdw", "allocation_check_Deviation.txt",
+                             "allocation_check_Basel.txt", "allocation_check_Baselines.txt",
+                             "allocation_check_Baselines_Run.txt", inFileName};
+    for (int i=0; i<11; ++i){
+        remove(outFileNames[i].c_str());
+    }
+    cout << (passed ? "Allocation check passed" : "Allocation check FAILED") << endl;
+    return passed;
+#endif
+}
 
-        totalIntVsWidth(fileDestination + filename + fileModifier, fileDestination + "Total Integral vs Width/" +
-                filename + "_Total_Integral_vs_Widths.txt", 0.5, wSize, baseLEnd, wStart, wEnd );
+//Keeps the quantities analyseWave calculated for every waveform, for comparing one run of the engine with another.
+class FeatureRecordConsumer : public WaveConsumer{
+public:
+    void processWave(const Waveform &wave){
+        waves.push_back(wave);
+        waves.back().raw = waves.back().adjusted = NULL;
+        waves.back().risetimes = waves.back().gateSums = NULL;
+    }
+    vector<Waveform> waves;
+};
 
-        peakTailIntegrate(fileDestination + filename + fileModifier, fileDestination + "Tail vs Peak Integral/"
-                                                                     + filename + "_Tail_vs_Peak_Integral.txt",wSize,
-                                                                     baseLEnd, peakXValue, tailW);
+//Method to check whether value is within relative*|reference| or absolute of reference, whichever is larger.
+bool withinTolerance(double value, double reference, double relative, double absolute){
+    return abs(value - reference) <= max(relative*abs(reference), absolute);
+}
 
-        PGA(fileDestination + filename + fileModifier, fileDestination + "PGA/" + filename + "_PGA.txt",
-            PGASampleVal, wSize, baseLEnd);
+//Method to check the float, int32 and int16 sample paths against the double path, on synthetic waveforms of whole
+//counts read from text and, for int16, from a .psdw file with 2 threads. The stated tolerances are:
+//  width                          within 1 sample
+//  basel, deviation, integrals    within 1e-6 relative or 1e-6 counts
+//  maxVal, PGAVal                 within 0.01 counts (the float rounding of the baseline adjusted heights)
+//Returns true if every waveform was within them.
+bool validateSampleTypes(){
+    string inFileName = "sample_check.txt", binaryFileName = "sample_check.psdw";
+    AnalysisParams params;
+    params.wSize = 1000;
+    params.baseLEnd = 100;
+    params.threshold = 0.5;
+    params.wStart = 100;
+    params.wEnd = 800;
+    params.peakXValue = 200;
+    params.tailEndXVal = 600;
+    params.PGASampleVal = 600;
+    params.widthMethod = PSD_WIDTH_OUTERMOST;
+    params.interpolateWidth = false;
+    params.baselines.robust = false;
+    params.baselines.tailStart = params.baselines.tailEnd = 0;
+    params.rejectFlags = 0;
+    params.adcMin = -numeric_limits<double>::infinity();
+    params.adcMax = numeric_limits<double>::infinity();
+    writeSyntheticTextFile(inFileName, 0.05, params.wSize, true);
+    convertToBinary(inFileName, binaryFileName, params.wSize, "int16", "Synthetic", 0);
 
-        firstTen(fileDestination + filename + fileModifier,
-                 fileDestination + "First Ten/" + filename + "_First Ten.txt", wSize);
+    int sampleTypes[] = {PSD_SAMPLES_DOUBLE, PSD_SAMPLES_FLOAT, PSD_SAMPLES_INT32, PSD_SAMPLES_INT16, PSD_SAMPLES_AUTO};
+    vector<Waveform> reference;
+    bool passed = true;
+    for (int t=0; t<5; ++t){
+        params.sampleType = sampleTypes[t];
+        bool binary = (params.sampleType == PSD_SAMPLES_AUTO);
+        FeatureRecordConsumer record;
+        vector<WaveConsumer*> consumers = {&record};
+        chrono::steady_clock::time_point start = chrono::steady_clock::now();
+        singlePassAnalysis(binary ? binaryFileName : inFileName, params, consumers, binary ? 2 : 1);
+        double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+        if (t == 0){
+            reference = record.waves;
+        }
+        int widthChanges = 0, failures = 0;
+        double largestHeightError = 0, largestIntegralError = 0;
+        for (int i=0; i<reference.size(); ++i){
+            if (i >= record.waves.size()){
+                failures += reference.size() - record.waves.size();
+                break;
+            }
+            const Waveform &a = record.waves[i], &b = reference[i];
+            if (a.width != b.width){
+                widthChanges++;
+            }
+            largestHeightError = max(largestHeightError, max(abs(a.maxVal - b.maxVal), abs(a.PGAVal - b.PGAVal)));
+            largestIntegralError = max(largestIntegralError, max(abs(a.totalInt - b.totalInt),
+                                                                 max(abs(a.peak - b.peak), abs(a.tail - b.tail))));
+            if ((abs(a.width - b.width) > 1) || !withinTolerance(a.basel, b.basel, 1e-6, 1e-6) ||
+                !withinTolerance(a.deviation, b.deviation, 1e-6, 1e-6) ||
+                !withinTolerance(a.totalInt, b.totalInt, 1e-6, 1e-6) || !withinTolerance(a.peak, b.peak, 1e-6, 1e-6) ||
+                !withinTolerance(a.tail, b.tail, 1e-6, 1e-6) || !withinTolerance(a.maxVal, b.maxVal, 0, 0.01) ||
+                !withinTolerance(a.PGAVal, b.PGAVal, 0, 0.01)){
+                failures++;
+            }
+        }
+        if (record.waves.size() > reference.size()){
+            failures += record.waves.size() - reference.size();
+        }
+        cout << (binary ? "int16 (.psdw)" : sampleTypeName(params.sampleType)) << ": " << record.waves.size()
+        << " waveforms in " << seconds << "s, " << widthChanges << " width changes, largest height difference "
+        << largestHeightError << ", largest integral difference " << largestIntegralError << ", " << failures
+        << " outside tolerance" << endl;
+        if (failures > 0){
+            passed = false;
+        }
+    }
+    remove(inFileName.c_str());
+    remove(binaryFileName.c_str());
+    cout << (passed ? "Sample type check passed" : "Sample type check FAILED") << endl;
+    return passed;
+}
 
-        baselineAdjust(fileDestination + filename + fileModifier,
-                       fileDestination + "Baseline Adjusted/" + filename + "_Baseline Adjusted.txt", wSize, baseLEnd);
+//----------------------------------------------------------------------------------------------------------------------
+//-------------------------------------------------------------MAIN-----------------------------------------------------
+//----------------------------------------------------------------------------------------------------------------------
+int main(int argc, char *argv[]) {
 
-        totalIntVsWidthPostBaselineAdjusted(fileDestination + "Baseline Adjusted/" + filename + "_Baseline Adjusted.txt",
-                                                fileDestination + "Total Integral vs Width PBLA/" + filename +
-                                                "_Total_Integral_vs_Width.txt", 0.5, wSize, wStart, wEnd);
+    //The settings of each location are the built in ones plus any in "Location Profiles.txt", or in the file given with
+    //--location-profiles, so a new digitiser setup only needs a line in that file.
+    string profilesFileName = "Location Profiles.txt";
+    bool profilesRequired = false;
+    for (int i=1; i<argc-1; ++i){
+        if (string(argv[i]) == "--location-profiles"){
+            profilesFileName = argv[i+1];
+            profilesRequired = true;
+        }
+    }
+    loadLocationProfiles(profilesFileName, profilesRequired);
 
-        if((location=="SeptEdinburgh")||(location=="JanEdinburgh")||(location=="FebEdinburgh")){
-            WidthDerivedNeutronRate(fileDestination + "Widths/" + filename + "_Widths.txt",
-                                    fileDestination + "Derived Quantities/FWHM_derived_neutron_rate.txt",
-                                    widthLowCut, widthHighCut, runTime);
+    //Benchmarks are selected on the command line, e.g. ./PSDCodes --bench-parser 1
+    if ((argc > 1) && (string(argv[1]) == "--bench-parser")){
+        benchmarkSampleParser("bench_samples.txt", (argc > 2) ? atof(argv[2]) : 1.0);
+        return 0;
+    }
+    if ((argc > 1) && (string(argv[1]) == "--bench-rings")){
+        benchmarkRings((argc > 2) ? atoi(argv[2]) : 1000000);
+        return 0;
+    }
+    //The benchmark suite times every analysis on synthetic waveforms for one location or all of them, e.g.
+    //./PSDCodes --bench-suite all --bench-samples 20000000 --noise 1.5 --drift 0.2 --pile-up 0.05 --neutron-fraction 0.3
+    //and appends the timings to "Benchmark Results.csv", or the file given with --bench-results.
+    if ((argc > 2) && (string(argv[1]) == "--bench-suite")){
+        PulseOptions pulses = defaultPulseOptions(0.3);
+        long long numSamples = 10000000;
+        string resultsFileName = "Benchmark Results.csv";
+        for (int i=3; i<argc-1; ++i){
+            if (string(argv[i]) == "--bench-samples"){
+                numSamples = atoll(argv[i+1]);
+            }else if (string(argv[i]) == "--noise"){
+                pulses.noise = atof(argv[i+1]);
+            }else if (string(argv[i]) == "--drift"){
+                pulses.drift = atof(argv[i+1]);
+            }else if (string(argv[i]) == "--pile-up"){
+                pulses.pileUpFraction = atof(argv[i+1]);
+            }else if (string(argv[i]) == "--neutron-fraction"){
+                pulses.neutronFraction = atof(argv[i+1]);
+            }else if (string(argv[i]) == "--bench-results"){
+                resultsFileName = argv[i+1];
+            }
+        }
+        benchmarkSuite(argv[2], numSamples, pulses, resultsFileName);
+        return 0;
+    }
+    if ((argc > 1) && (string(argv[1]) == "--check-allocations")){
+        return checkAllocations() ? 0 : 1;
+    }
+    if ((argc > 1) && (string(argv[1]) == "--validate-samples")){
+        return validateSampleTypes() ? 0 : 1;
+    }
+    //Search for the PSD settings with the best figure of merit for one run, e.g.
+    //./PSDCodes --optimise-fom "SeptEdinburgh/run1.csv" SeptEdinburgh --threads 8 --memory-limit 4000
+    //--memory-limit is in MB and bounds the waveforms held in memory, by default half of the physical memory.
+    if ((argc > 3) && (string(argv[1]) == "--optimise-fom")){
+        int optimiserThreads = max(1, (int)thread::hardware_concurrency());
+        size_t memoryLimit = 0;
+        for (int i=4; i<argc-1; ++i){
+            if (string(argv[i]) == "--threads"){
+                optimiserThreads = max(1, atoi(argv[i+1]));
+            }else if (string(argv[i]) == "--memory-limit"){
+                double megabytes = atof(argv[i+1]);
+                if (megabytes <= 0){
+                    cout << "--memory-limit must be a positive number of MB" << endl;
+                    return 1;
+                }
+                memoryLimit = megabytes*1e6;
+            }
+        }
+        optimiseFoM(argv[2], argv[3], optimiserThreads, memoryLimit);
+        return 0;
+    }
+    //Cut and count over the feature store of a run, and optionally histogram the waveforms that pass, e.g.
+    //./PSDCodes --query-features "Sept/Feature Cache/run1_Features.psdf" --where width:5:50,rejected:0:1
+    //    --histogram width:50:0:50,totalInt:100:0:100000 --histogram-file "Sept/width_vs_totalInt.txt"
+    if ((argc > 2) && (string(argv[1]) == "--query-features")){
+        string where, axes, histogramFileName = "Feature Histogram.txt";
+        for (int i=3; i<argc-1; ++i){
+            if (string(argv[i]) == "--where"){
+                where = argv[i+1];
+            }else if (string(argv[i]) == "--histogram"){
+                axes = argv[i+1];
+            }else if (string(argv[i]) == "--histogram-file"){
+                histogramFileName = argv[i+1];
+            }
+        }
+        return queryFeatures(argv[2], where, axes, histogramFileName) ? 0 : 1;
+    }
+    //One-off conversion of a text dump to a .psdw file, e.g.
+    //./PSDCodes --convert "JanEdinburgh/run.txt" "JanEdinburgh/run.psdw" 100000 int16 JanEdinburgh 3600
+    //Runs in File Details.txt then read the .psdw file in place of the text dump.
+    if ((argc > 7) && (string(argv[1]) == "--convert")){
+        convertToBinary(argv[2], argv[3], atoi(argv[4]), argv[5], argv[6], atof(argv[7]));
+        return 0;
+    }
+    //Number of threads analysing the waveforms of each run, set with --threads N. Defaults to one per core.
+    int numThreads = max(1, (int)thread::hardware_concurrency());
+    for (int i=1; i<argc-1; ++i){
+        if (string(argv[i]) == "--threads"){
+            numThreads = max(1, atoi(argv[i+1]));
+        }
+    }
 
-            WidthsDerivedEfficiencies(fileDestination + "Widths/" + filename + "_Widths.txt",
-                                      fileDestination + "Derived Quantities/FWHM_derived_neutron_absolute_and_intrinsic_efficiency.txt",
-                                      orientation, sourceDistance, AmBeSourceActivity, widthLowCut, widthHighCut, runTime);
+    //Jobs running at once (--jobs N) and the memory they may use between them in GB (--memory-limit X). The threads
+    //from --threads are shared out between the running jobs. Only lines firstLine to lastLine of the run list are
+    //processed (--lines first last).
+    int maxJobs = 1, firstLine = 4, lastLine = 111;
+    double memoryLimitGB = 8.0;
+    for (int i=1; i<argc-1; ++i){
+        if (string(argv[i]) == "--jobs"){
+            maxJobs = max(1, atoi(argv[i+1]));
+        }else if (string(argv[i]) == "--memory-limit"){
+            memoryLimitGB = atof(argv[i+1]);
+        }else if ((string(argv[i]) == "--lines") && (i+2 < argc)){
+            firstLine = atoi(argv[i+1]);
+            lastLine = atoi(argv[i+2]);
+        }
+    }
 
+    //Type the heights are held as during the analysis (--samples auto|double|float|int32|int16). auto uses the type a
+    //.psdw file stores and double for text files.
+    int sampleType = PSD_SAMPLES_DOUBLE;
+    for (int i=1; i<argc-1; ++i){
+        if (string(argv[i]) == "--samples"){
+            sampleType = sampleTypeFromName(argv[i+1]);
+            if (sampleType < PSD_SAMPLES_AUTO){
+                cout << "Unknown sample type " << argv[i+1] << ", use auto, double, float, int32 or int16" << endl;
+                return 1;
+            }
         }
+    }
 
-        baselineDeviation(fileDestination + filename + fileModifier,
-                          fileDestination + "Derived Quantities/Baseline Deviation.txt", wSize, baseLEnd);
+    //The widths are counted in memory for the derived quantities, and the _Widths.txt files are only kept as an export
+    //for looking at by hand. --no-widths-file skips writing them.
+    RunOptions options;
+    options.numThreads = max(1, numThreads/maxJobs);
+    options.sampleType = sampleType;
+    options.widthsFile = true;
+    //The per waveform tables are text unless --binary-output asks for .psdc column files.
+    options.outputFormat = PSD_OUTPUT_TEXT;
+    //No "Baseline Adjusted" copy of the runs is written unless --baseline-adjusted psdw (float32) or text asks for one.
+    options.baselineAdjusted = PSD_ADJUSTED_NONE;
+    //The median, trimmed mean and after pulse baseline of every waveform are only found with --baselines.
+    options.baselines = false;
+    //Every waveform is kept in the pulse shape analysis, as before the flags were added, unless --reject lists reasons to
+    //leave some out, e.g. --reject pileup,saturation,baseline. The flagged waveforms are counted in Rejections.txt
+    //either way.
+    options.rejectFlags = 0;
+    //Runs are only timed stage by stage with --profile json, for a "Profiles/<run>_Profile.json" per run, or --profile
+    //csv, for a line per run in "Profiles/Profile.csv".
+    options.profileFormat = PSD_PROFILE_NONE;
+    //Runs are read in full every time unless --feature-cache keeps their features in "Feature Cache" to be read back
+    //by later runs of the same files with the same settings.
+    options.featureCache = false;
+    //Widths are measured between the outermost samples above half the maximum unless --width-method peak is given,
+    //which walks out from the peak instead, and --width-interpolate measures between interpolated crossings.
+    options.widthMethod = PSD_WIDTH_OUTERMOST;
+    options.interpolateWidth = false;
+    //The onset the gates can be measured from is where the pulse first rises above 10% of its maximum.
+    options.gates.onsetFraction = 0.1;
+    options.gates.tailGate = options.gates.totalGate = -1;
+    for (int i=1; i<argc; ++i){
+        if (string(argv[i]) == "--no-widths-file"){
+            options.widthsFile = false;
+        }else if ((string(argv[i]) == "--reject") && (i+1 < argc)){
+            if (!parseRejectFlags(argv[i+1], options.rejectFlags)){
+                cout << "Reasons to reject must be none or a list of pileup, saturation and baseline" << endl;
+                return 1;
+            }
+        }else if ((string(argv[i]) == "--profile") && (i+1 < argc)){
+            if (string(argv[i+1]) == "json"){
+                options.profileFormat = PSD_PROFILE_JSON;
+            }else if (string(argv[i+1]) == "csv"){
+                options.profileFormat = PSD_PROFILE_CSV;
+            }else{
+                cout << "Unknown profile format " << argv[i+1] << ", use json or csv" << endl;
+                return 1;
+            }
+        }else if (string(argv[i]) == "--baselines"){
+            options.baselines = true;
+        }else if (string(argv[i]) == "--feature-cache"){
+            options.featureCache = true;
+        }else if (string(argv[i]) == "--binary-output"){
+            options.outputFormat = PSD_OUTPUT_BINARY;
+        }else if ((string(argv[i]) == "--baseline-adjusted") && (i+1 < argc)){
+            if (string(argv[i+1]) == "psdw"){
+                options.baselineAdjusted = PSD_ADJUSTED_PSDW;
+            }else if (string(argv[i+1]) == "text"){
+                options.baselineAdjusted = PSD_ADJUSTED_TEXT;
+            }else if (string(argv[i+1]) != "none"){
+                cout << "Unknown baseline adjusted copy " << argv[i+1] << ", use none, psdw or text" << endl;
+                return 1;
+            }
+        }else if (string(argv[i]) == "--width-interpolate"){
+            options.interpolateWidth = true;
+        }else if ((string(argv[i]) == "--width-method") && (i+1 < argc)){
+            if (string(argv[i+1]) == "peak"){
+                options.widthMethod = PSD_WIDTH_FROM_PEAK;
+            }else if (string(argv[i+1]) != "outermost"){
+                cout << "Unknown width method " << argv[i+1] << ", use outermost or peak" << endl;
+                return 1;
+            }
+        }else if ((string(argv[i]) == "--gates") && (i+1 < argc)){
+            //Gate sums for each run, one column per gate in the order given, then tail/total if both are defined,
+            //e.g. --gates total:onset:-5:300,tail:peak:20:300
+            if (!parseGates(argv[i+1], options.gates)){
+                cout << "Gates must be name:reference:start:end with reference absolute, onset or peak" << endl;
+                return 1;
+            }
+        }else if ((string(argv[i]) == "--risetimes") && (i+1 < argc)){
+            //Integral rise time table for each run, e.g. --risetimes 0.1,0.9,0.2,0.8 for the 10/90 and 20/80 times.
+            if (!parseRisetimeThresholds(argv[i+1], options.risetimes)){
+                cout << "Rise time thresholds must be pairs of fractions, e.g. 0.1,0.9,0.2,0.8" << endl;
+                return 1;
+            }
+        }
+    }
 
-        //peakValAverage(fileDestination+filename+fileModifier,fileDestination+"Derived Quantities/AvgPeak.txt", wSize, baseLEnd);
-        baselineAverage(fileDestination+filename+fileModifier,fileDestination+"Derived Quantities/AvgBasel.txt", wSize, baseLEnd);
-        cout << endl;
-        f_in  >> filename >> runTime >> location >> fileDestination >> sourceDistance >> orientation;
+    //Live analysis of waveforms streamed from the digitiser on standard input ("-"), a FIFO or a local TCP port, e.g.
+    //./PSDCodes --live tcp:5000 LUNA --cuts 7 50 --interval 10 --window 60 --live-log "LUNA/live_rates.txt"
+    //and a stand in for the digitiser sending it rate waveforms per second, e.g.
+    //./PSDCodes --generate-live tcp:5000 LUNA 50 --seconds 600 --cuts 7 50 --neutron-fraction 0.3
+    //The neutron width cuts are the location's unless --cuts is given, and LUNA has none of its own.
+    if ((argc > 3) && ((string(argv[1]) == "--live") || (string(argv[1]) == "--generate-live"))){
+        RunSettings liveSettings;
+        if (!locationSettings(argv[3], liveSettings)){
+            cout << argv[3] << " not found in main with filename: " << argv[2] << endl;
+            return 1;
+        }
+        double lowCut = liveSettings.widthLowCut, highCut = liveSettings.widthHighCut;
+        int interval = 10, window = 60;
+        double seconds = 3600, neutronFraction = 0.3;
+        string logFileName;
+        for (int i=4; i<argc-1; ++i){
+            if ((string(argv[i]) == "--cuts") && (i+2 < argc)){
+                lowCut = atof(argv[i+1]);
+                highCut = atof(argv[i+2]);
+            }else if (string(argv[i]) == "--interval"){
+                interval = max(1, atoi(argv[i+1]));
+            }else if (string(argv[i]) == "--window"){
+                window = max(1, atoi(argv[i+1]));
+            }else if (string(argv[i]) == "--live-log"){
+                logFileName = argv[i+1];
+            }else if (string(argv[i]) == "--seconds"){
+                seconds = atof(argv[i+1]);
+            }else if (string(argv[i]) == "--neutron-fraction"){
+                neutronFraction = atof(argv[i+1]);
+            }
+        }
+        if (highCut <= 0){
+            cerr << argv[3] << " has no neutron width cuts, give them with --cuts low high" << endl;
+            return 1;
+        }
+        if (string(argv[1]) == "--live"){
+            liveAnalysis(argv[2], argv[3], options, lowCut, highCut, interval, window, logFileName);
+        }else if (argc > 4){
+            generateLive(argv[2], argv[3], atof(argv[4]), seconds, neutronFraction, lowCut, highCut);
+        }
+        return 0;
     }
-    f_in.close();
+
+    reprint("AmBe_Spectrum.txt","AmBe_Spectrum_Processed.txt");
+    //The details of the runs are all stored in an input file to be edited upon reception of new data.
+    string fileDetails = "File Details.txt";
+    vector<RunJob> jobs = readRunList(fileDetails, firstLine, lastLine);
+    cout<<endl<<endl<<"        ---------------Beginning PSD Codes--------------- "<<endl;
+    runBatch(jobs, maxJobs, memoryLimitGB, options);
 
     //sortedLUNA("LUNA/Derived Quantities/Baseline Deviation.txt", "LUNA/Derived Quantities/Baseline Deviation 0.txt",
     //                 "LUNA/Derived Quantities/Baseline Deviation 1.txt");
@@ -1314,6 +6645,9 @@ int main() {
     //a steady increase in neutron count and a flat progression in non-neutron count. This could potentially
     //be radon, but other investigations must be performed to rule out certain options.
 
+    RunSettings LUNA;
+    locationSettings("LUNA", LUNA);
+    int wSize = LUNA.wSize, baseLEnd = LUNA.baseLEnd;
     peakValComparison("LUNA/dump_001_wf_0.dat", "LUNA/dump_007_wf_0.dat", wSize, baseLEnd);
     peakValComparison("LUNA/dump_001_wf_1.dat", "LUNA/dump_007_wf_1.dat", wSize, baseLEnd);
 